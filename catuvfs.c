@@ -1,192 +1,201 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <arpa/inet.h>
 #include <string.h>
-#include "disk.h"
+#include <unistd.h>
+#include "uvfs.h"
 
-/************************ STRUCT *******************************/
-
-typedef struct diskimage diskimage_t;
-struct diskimage {
-    char * imagename;
-    superblock_entry_t * sb;
-    FILE * f;
-} __attribute__ ((packed));
+#define QUEUE_CHUNK (256 << 10)
 
 /************************* FUNCTION PROTOTYPES ****************************/
 
-char *              month_to_string(short m);
-void                unpack_datetime(unsigned char *time, short *year, short *month, short *day, short *hour, short *minute, short *second);
-void                sseek(FILE * f, int len, int origin);
-void                sread(void * buffer, size_t sizeofelements, size_t num, FILE *f);
-void                convertToNet(superblock_entry_t * sb);
-unsigned int        findFileOnDisk(diskimage_t * image, char * filename);
-void                catFile(diskimage_t * image, unsigned int start_block);
-unsigned long int   read_fat_entry(diskimage_t * image, unsigned long int entry);
-void                convertToNetDE(directory_entry_t * de);
+void                catFile(uvfs_image_t * image, directory_entry_t * de, uvfs_index_t * index,
+                        size_t offset, size_t length, uvfs_cachestat_t * stat);
+void                catQueued(uvfs_image_t * image, directory_entry_t * de, uvfs_index_t * index,
+                        size_t offset, size_t length, unsigned int depth, uvfs_cachestat_t * stat);
+void                writeOut(const unsigned char * buffer, size_t len);
 
 /************************* FUNCTION IMPLEMENTATIONS *************************/
 
-char *month_to_string(short m) {
-    switch(m) {
-    case 1: return "Jan";
-    case 2: return "Feb";
-    case 3: return "Mar";
-    case 4: return "Apr";
-    case 5: return "May";
-    case 6: return "Jun";
-    case 7: return "Jul";
-    case 8: return "Aug";
-    case 9: return "Sep";
-    case 10: return "Oct";
-    case 11: return "Nov";
-    case 12: return "Dec";
-    default: return "?!?";
-    }
-}
-
-void unpack_datetime(unsigned char *time, short *year, short *month, 
-    short *day, short *hour, short *minute, short *second)
+/*
+ * Streams length bytes of the file described by de (host byte order),
+ * starting at offset, to stdout. The extent holding offset is found by
+ * binary search in index; from there each run of consecutive blocks goes
+ * out in transfers of at most half the read-ahead window, which keeps the
+ * chain ahead of the reader advised. The last block stops at file_size.
+ * Page cache hits and misses are added to stat unless it is NULL.
+ */
+void catFile(uvfs_image_t * image, directory_entry_t * de, uvfs_index_t * index,
+    size_t offset, size_t length, uvfs_cachestat_t * stat)
 {
-    assert(time != NULL);
+    uvfs_sender_t sender;
+    uvfs_readahead_t ra;
+    size_t bs = image->sb.block_size;
 
-    memcpy(year, time, 2);
-    *year = htons(*year);
+    if(offset >= de->file_size)
+        return;
+    if(length > de->file_size - offset)
+        length = de->file_size - offset;
 
-    *month = (unsigned short)(time[2]);
-    *day = (unsigned short)(time[3]);
-    *hour = (unsigned short)(time[4]);
-    *minute = (unsigned short)(time[5]);
-    *second = (unsigned short)(time[6]);
-}
+    uvfs_sender_init(&sender, STDOUT_FILENO);
+    uvfs_readahead_init(&ra, UVFS_READAHEAD_WINDOW);
 
-/*
- * Safe seek
- * Runs fseek with input params and handles errors
- */
-void sseek(FILE * f, int len, int origin)
-{
-    if(0 != fseek(f, len, origin))
+    int i = uvfs_index_lookup(index, offset / bs);
+
+    for(; i < index->num_extents && length > 0; i++)
     {
-        fprintf(stderr, "Seek failed.\n");
-        exit(1);
+        size_t start = (size_t)index->first_block[i] * bs;
+        size_t skip = offset - start;
+        size_t len = (size_t)index->extents[i].length * bs - skip;
+        off_t from = uvfs_block_offset(image, index->extents[i].start) + skip;
+
+        if(len > length)
+            len = length;
+        length -= len;
+
+        while(len > 0)
+        {
+            size_t n = len < ra.window / 2 ? len : ra.window / 2;
+
+            if(stat != NULL)
+                uvfs_cache_probe(image, from, n, stat);
+            uvfs_readahead(image, index, &ra, offset);
+            uvfs_send(image, &sender, from, n);
+            from += n;
+            offset += n;
+            len -= n;
+        }
     }
-}
-/*
- * Safe read
- * Runs fread with input params and handles error
- */
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f)
-{
-    if( fread(buffer, sizeofelements, num, f) != num )
+
+    if(length > 0)
     {
-        fprintf(stderr, "Read failed.\n");
+        fprintf(stderr, "Corrupt FAT chain.\n");
         exit(1);
     }
 }
 
 /*
- * Converts superblock to network byte order
+ * Same output as catFile, but keeps up to depth chunk reads of the chain
+ * outstanding at once through the queued I/O layer and writes the chunks
+ * to stdout in order as they complete. Each chunk's pages are counted in
+ * stat, unless it is NULL, as it is queued.
  */
-void convertToNet(superblock_entry_t * sb)
+void catQueued(uvfs_image_t * image, directory_entry_t * de, uvfs_index_t * index,
+    size_t offset, size_t length, unsigned int depth, uvfs_cachestat_t * stat)
 {
-    sb->block_size = htons(sb->block_size);
-    sb->num_blocks = htonl(sb->num_blocks);
-    sb->fat_start = htonl(sb->fat_start);
-    sb->fat_blocks = htonl(sb->fat_blocks);
-    sb->dir_start = htonl(sb->dir_start);
-    sb->dir_blocks = htonl(sb->dir_blocks);
-}
+    uvfs_aio_t aio;
+    size_t bs = image->sb.block_size;
+    unsigned long queued = 0, written = 0;
 
-/*
- * Locates filename on image.
- * Returns location of first block or 0xffffffff if end of file.
- */
-unsigned int findFileOnDisk(diskimage_t * image, char * filename)
-{
-    int i, j;
-    // for each block of root
-    for(i = 0; i < image->sb->dir_blocks; i++)
-    {
-        // for each directory entry of block
-        for(j = 0; j < image->sb->block_size/SIZE_DIR_ENTRY; j++)
-        {
-            sseek(image->f, ((image->sb->dir_start + i) * image->sb->block_size + j * SIZE_DIR_ENTRY), SEEK_SET);
-            directory_entry_t de;
-            sread(&de, sizeof(directory_entry_t), 1, image->f);
+    if(offset >= de->file_size)
+        return;
+    if(length > de->file_size - offset)
+        length = de->file_size - offset;
 
-            if(de.status == DIR_ENTRY_AVAILABLE || strcmp(de.filename, filename) != 0)
-                continue;
+    unsigned char * buffers = malloc((size_t)depth * QUEUE_CHUNK);
+    size_t * lens = malloc(depth * sizeof(size_t));
+    unsigned char * ready = calloc(depth, 1);
 
-            convertToNetDE(&de);
-            return de.start_block;
-        }
+    if(buffers == NULL || lens == NULL || ready == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
     }
-    return 0;
-}
 
-/*
- * Prints to stdout the file in image that starts at start_block
- */
-void catFile(diskimage_t * image, unsigned int start_block)
-{
-    unsigned char block_data[image->sb->block_size + 1];
+    uvfs_aio_init(&aio, depth);
 
-    sseek(image->f, start_block * image->sb->block_size, SEEK_SET);
-    sread(&block_data, sizeof(char), image->sb->block_size, image->f);
-    block_data[image->sb->block_size] = '\0';
+    int i = uvfs_index_lookup(index, offset / bs);
+    size_t skip = i < index->num_extents ? offset - (size_t)index->first_block[i] * bs : 0;
 
-    printf("%s", block_data);
-
-    unsigned long int block = read_fat_entry(image, start_block);
-    for(;block != FAT_LASTBLOCK;)
+    while(length > 0 || written < queued)
     {
-        // read next block from FAT
-
-        sseek(image->f, block * image->sb->block_size, SEEK_SET);
-        sread(&block_data, sizeof(char), image->sb->block_size, image->f);
-        block_data[image->sb->block_size] = '\0';
-        printf("%s", block_data);
-        //NextBlockStart = FatStart + CurrentBlockStart * 4 (each FAT entry is 4 bytes)
-        block = read_fat_entry(image, block);
+        // chunk k always lives in slot k % depth
+        while(length > 0 && queued - written < depth)
+        {
+            if(i >= index->num_extents)
+            {
+                fprintf(stderr, "Corrupt FAT chain.\n");
+                exit(1);
+            }
+
+            size_t avail = (size_t)index->extents[i].length * bs - skip;
+            size_t n = avail < length ? avail : length;
+            off_t from = uvfs_block_offset(image, index->extents[i].start) + skip;
+            int slot = queued % depth;
+
+            if(n > QUEUE_CHUNK)
+                n = QUEUE_CHUNK;
+
+            if(stat != NULL)
+                uvfs_cache_probe(image, from, n, stat);
+            lens[slot] = n;
+            uvfs_aio_read(&aio, image->fd, buffers + (size_t)slot * QUEUE_CHUNK, n, from, slot);
+            queued++;
+            length -= n;
+            skip += n;
+            if(skip == (size_t)index->extents[i].length * bs)
+            {
+                i++;
+                skip = 0;
+            }
+        }
+
+        int slot;
+        if(uvfs_aio_wait(&aio, &slot) != lens[slot])
+        {
+            fprintf(stderr, "Read failed.\n");
+            exit(1);
+        }
+        ready[slot] = 1;
+
+        while(written < queued && ready[written % depth])
+        {
+            slot = written % depth;
+            writeOut(buffers + (size_t)slot * QUEUE_CHUNK, lens[slot]);
+            ready[slot] = 0;
+            written++;
+        }
     }
-}
 
-/*
- * Input: diskimage, current block
- * Returns: next block of file
- */
-unsigned long int read_fat_entry(diskimage_t * image, unsigned long int entry)
-{
-    sseek(image->f, image->sb->fat_start * image->sb->block_size + entry * SIZE_FAT_ENTRY, SEEK_SET);
-    unsigned long int ret;
-    sread(&ret, sizeof(unsigned long int), 1, image->f);
-    ret = htonl(ret);
-    return ret;
+    uvfs_aio_destroy(&aio);
+    free(buffers);
+    free(lens);
+    free(ready);
 }
 
-/*
- * Convert directory entry to network byte order
- */
-void convertToNetDE(directory_entry_t * de)
+void writeOut(const unsigned char * buffer, size_t len)
 {
-    de->start_block = htonl(de->start_block);
-    de->num_blocks = htonl(de->num_blocks);
-    de->file_size = htonl(de->file_size);
+    while(len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buffer, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            fprintf(stderr, "Write failed.\n");
+            exit(1);
+        }
+        buffer += n;
+        len -= n;
+    }
 }
 
 /******************** MAIN ************************/
 
 int main(int argc, char *argv[]) {
     int  i;
-    superblock_entry_t sb;
     char *imagename = NULL;
     char *filename  = NULL;
+    char *indexname = NULL;
+    char *server = NULL;
+    int  cache_stats = 0;
+    int  queue_depth = 1;
+    size_t offset = 0;
+    size_t length = (size_t)-1;
 
-    diskimage_t image;
-    image.sb = &sb;
+    uvfs_image_t image;
 
 /******************* ZASTRE ***********************/
 
@@ -197,48 +206,86 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--file") == 0 && i+1 < argc) {
             filename = argv[i+1];
             i++;
+        } else if (strcmp(argv[i], "--offset") == 0 && i+1 < argc) {
+            offset = strtoull(argv[i+1], NULL, 0);
+            i++;
+        } else if (strcmp(argv[i], "--length") == 0 && i+1 < argc) {
+            length = strtoull(argv[i+1], NULL, 0);
+            i++;
+        } else if (strcmp(argv[i], "--index") == 0 && i+1 < argc) {
+            indexname = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = 1;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i+1 < argc) {
+            queue_depth = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
+            server = argv[i+1];
+            i++;
         }
     }
 
     if (imagename == NULL || filename == NULL) {
         fprintf(stderr, "usage: catuvfs --image <imagename> " \
-            "--file <filename in image>");
+            "--file <filename in image> " \
+            "[--offset <bytes>] [--length <bytes>] [--index <sidecar>] " \
+            "[--cache-stats] [--queue-depth <n>] [--server <socket path>]\n");
         exit(1);
     }
 
 /******************** END Z *********************/
 
-    if( (image.f = fopen(imagename, "rb+")) == NULL)
-    {
-        fprintf(stderr, "Specified image could not be opened.\n");
-        exit(1);
+    // the server streams the range from its resident chain index
+    if (server != NULL) {
+        uvfs_client_call(server, UVFSD_CAT, imagename, filename, offset, length,
+            -1, STDOUT_FILENO, NULL);
+        return 0;
     }
 
-    image.imagename = imagename;
-    sseek(image.f, 0L, SEEK_SET);
-    // read in super block
-    sread(image.sb, sizeof(superblock_entry_t), 1, image.f);
-    // validate image
-    if(strncmp(image.sb->magic, FILE_SYSTEM_ID, 8) != 0)
-    {
-        fprintf(stderr, "Image did not match expected format.\n");
-        exit(1);
-    }
+    uvfs_open(&image, imagename, UVFS_RDONLY);
 
-    convertToNet(image.sb);
+    // the entry and its chain are read under the metadata lock; the data
+    // itself is not covered, so a replace or defrag running meanwhile can
+    // change or move the blocks being read
+    uvfs_lock_metadata(&image, UVFS_LOCK_SHARED);
 
-    unsigned long int start_block;
+    directory_entry_t de;
 
-    if((start_block = findFileOnDisk(&image, filename)) == 0)
+    if(!uvfs_lookup(&image, filename, &de) || de.status != DIR_ENTRY_NORMALFILE)
     {
         fprintf(stderr, "File not found on specified image.\n");
         exit(1);
     }
+    convertToNetDE(&de);
+
+    // a cached index skips the chain walk entirely
+    uvfs_index_t index;
+
+    if(indexname == NULL || !uvfs_index_load(&image, indexname, &de, &index))
+    {
+        uvfs_index_build(&image, &de, &index);
+        if(indexname != NULL)
+            uvfs_index_save(indexname, &de, &index);
+    }
+
+    uvfs_lock_metadata(&image, UVFS_LOCK_NONE);
+
+    uvfs_cachestat_t stat = { 0, 0 };
 
-    catFile(&image, start_block);
+    // a queue depth above one reads the chain through the queued I/O
+    // layer instead of the kernel copy paths
+    if(queue_depth > 1)
+        catQueued(&image, &de, &index, offset, length, queue_depth, cache_stats ? &stat : NULL);
+    else
+        catFile(&image, &de, &index, offset, length, cache_stats ? &stat : NULL);
 
-    if(image.f)
-        fclose(image.f);
+    if(cache_stats)
+        fprintf(stderr, "Cache: %lu hits, %lu misses (pages)\n", stat.hits, stat.misses);
 
-    return 0; 
-}
\ No newline at end of file
+    uvfs_index_destroy(&index);
+
+    uvfs_close(&image);
+
+    return 0;
+}
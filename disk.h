@@ -3,10 +3,10 @@
 
 #define FILE_SYSTEM_ID_LEN 8
 #define FILE_SYSTEM_ID "uvicfs17"
+#define FILE_SYSTEM_ID_EXTENTS "uvicfs18"   // uvicfs17 with extent maps, see below
 
 #define MIN_BLOCK_SIZE 64
 #define SIZE_FAT_ENTRY 4
-#define MAX_FAT 5120
 #define FAT_START_BLOCK 1
 #define SIZE_DIR_ENTRY 64
 #define MAX_DIR_ENTRIES 64
@@ -23,6 +23,87 @@ struct superblock_entry {
 } __attribute__ ((packed));
 
 
+/*
+ * Optional superblock extensions live in block 0 after the superblock.
+ * uvicfs17 readers ignore these bytes; each extension carries its own
+ * magic so images without it read as "absent".
+ */
+#define SB_SUMMARY_OFFSET 30
+#define SB_SUMMARY_MAGIC "uvsm"
+#define SB_SUMMARY_MAGIC_LEN 4
+#define SB_SUMMARY_CLEAN 0x1
+
+typedef struct superblock_summary superblock_summary_t;
+struct superblock_summary {
+             char  magic[SB_SUMMARY_MAGIC_LEN];
+    unsigned int   flags;
+    unsigned int   free_blocks;
+    unsigned int   resv_blocks;
+    unsigned int   alloc_blocks;
+    unsigned int   checksum;
+} __attribute__ ((packed));
+
+/*
+ * Optional on-image hash table over root directory filenames. num_slots
+ * network-order words live in table_blocks blocks (marked FAT_RESERVED)
+ * from table_start: 0 is empty, DIRHASH_TOMBSTONE a removed entry, and
+ * anything else a directory entry index plus one. Linear probing from
+ * FNV-1a(filename) % num_slots.
+ */
+#define SB_DIRHASH_OFFSET 54
+#define SB_DIRHASH_MAGIC "uvht"
+#define SB_DIRHASH_MAGIC_LEN 4
+#define SB_DIRHASH_CLEAN 0x1
+#define DIRHASH_EMPTY     0x00000000
+#define DIRHASH_TOMBSTONE 0xffffffff
+
+typedef struct superblock_dirhash superblock_dirhash_t;
+struct superblock_dirhash {
+             char  magic[SB_DIRHASH_MAGIC_LEN];
+    unsigned int   flags;
+    unsigned int   table_start;
+    unsigned int   table_blocks;
+    unsigned int   num_slots;
+    unsigned int   checksum;
+} __attribute__ ((packed));
+
+
+/*
+ * Optional metadata journal: journal_blocks blocks from journal_start
+ * (marked FAT_RESERVED) split into two equal slots that take
+ * transactions in turn, transaction n going to slot n % 2. sequence is
+ * the last transaction known to be written in place; replay applies the
+ * valid transactions after it in order.
+ *
+ * A transaction starts with a journal_descriptor followed by num_blocks
+ * network-order block numbers, padded to a whole block, then one image
+ * of each block. checksum is FNV-1a over the whole transaction with the
+ * checksum field zero.
+ */
+#define SB_JOURNAL_OFFSET 78
+#define SB_JOURNAL_MAGIC "uvjl"
+#define SB_JOURNAL_MAGIC_LEN 4
+
+#define JOURNAL_MAGIC "uvjd"
+#define JOURNAL_MAGIC_LEN 4
+
+typedef struct superblock_journal superblock_journal_t;
+struct superblock_journal {
+             char  magic[SB_JOURNAL_MAGIC_LEN];
+    unsigned int   journal_start;
+    unsigned int   journal_blocks;
+    unsigned int   sequence;
+    unsigned int   checksum;
+} __attribute__ ((packed));
+
+typedef struct journal_descriptor journal_descriptor_t;
+struct journal_descriptor {
+             char  magic[JOURNAL_MAGIC_LEN];
+    unsigned int   sequence;
+    unsigned int   num_blocks;
+    unsigned int   checksum;
+} __attribute__ ((packed));
+
 #define FAT_AVAILABLE 0x00000000
 #define FAT_RESERVED  0x00000001
 #define FAT_LASTBLOCK 0xffffffff
@@ -34,6 +115,52 @@ struct superblock_entry {
 #define DIR_ENTRY_NORMALFILE 0x1
 #define DIR_ENTRY_DIRECTORY  0x2
 
+/*
+ * A store in progress claims an entry by writing it with status
+ * available and DIR_CLAIM_MAGIC at the start of the padding; the claim
+ * becomes the file when the store commits
+ */
+#define DIR_CLAIM_MAGIC "uvcl"
+#define DIR_CLAIM_MAGIC_LEN 4
+
+/*
+ * A normal file's padding caches the last block of its chain, then the
+ * low 16 bits of a checksum over start block, block count and tail, all
+ * in network order. Entries written by older tools fail the check and
+ * their chain is walked instead.
+ */
+#define DIR_TAIL_CHECK_MASK 0xffff
+
+/*
+ * uvicfs18 is uvicfs17 with an extent map per normal file. The padding
+ * holds the map's first block where uvicfs17 caches the tail, checked the
+ * same way. A map lists the file's blocks as runs, in order, in as many
+ * map blocks as it takes, each naming the next (0 ends the map); map
+ * blocks are allocated in the FAT as one-block chains. Files keep their
+ * FAT chains too, so the FAT stays the allocation map, but readers take
+ * a file's layout from its map in a few reads instead of walking the
+ * FAT. checksum is FNV-1a over the header and its count runs with the
+ * checksum field zero. An entry whose map does not check out is read by
+ * its chain.
+ */
+#define EXTENT_MAP_MAGIC "uvxm"
+#define EXTENT_MAP_MAGIC_LEN 4
+
+typedef struct extent_run extent_run_t;
+struct extent_run {
+    unsigned int   start;
+    unsigned int   length;
+} __attribute__ ((packed));
+
+typedef struct extent_map extent_map_t;
+struct extent_map {
+             char  magic[EXTENT_MAP_MAGIC_LEN];
+    unsigned int   count;
+    unsigned int   next;
+    unsigned int   checksum;
+    extent_run_t   runs[];
+} __attribute__ ((packed));
+
 typedef struct directory_entry directory_entry_t;
 struct directory_entry {
     unsigned char status;
@@ -46,4 +173,29 @@ struct directory_entry {
     unsigned char _padding[6];
 } __attribute__ ((packed));
 
+/*
+ * A subdirectory is an entry with status DIR_ENTRY_DIRECTORY whose chain
+ * holds a B+-tree of directory entries ordered by name. start_block is
+ * the root node, which never moves; the chain links every node, in no
+ * particular order, so the FAT accounts for them. num_blocks counts the
+ * nodes and file_size is num_blocks block sizes.
+ *
+ * A node is one block: a header the size of a directory entry, then up
+ * to block_size / SIZE_DIR_ENTRY - 1 records sorted by filename. Leaves
+ * (level 0) hold the directory's entries. Interior nodes hold one record
+ * per child, its filename a lower bound for the names below the child
+ * (the first record's is ignored) and its start_block the child node.
+ */
+#define DIR_NODE_MAGIC "uvdn"
+#define DIR_NODE_MAGIC_LEN 4
+
+typedef struct dir_node dir_node_t;
+struct dir_node {
+             char  magic[DIR_NODE_MAGIC_LEN];
+    unsigned short level;
+    unsigned short count;
+    unsigned char  _padding[SIZE_DIR_ENTRY - DIR_NODE_MAGIC_LEN - 4];
+    directory_entry_t records[];
+} __attribute__ ((packed));
+
 #endif
@@ -2,19 +2,11 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <arpa/inet.h>
 #include <string.h>
-#include "disk.h"
+#include "uvfs.h"
 
 /************************ STRUCT *******************************/
 
-typedef struct diskimage diskimage_t;
-struct diskimage {
-    char * imagename;
-    superblock_entry_t * sb;
-} __attribute__ ((packed));
-
-
 typedef struct datetime datetime_t;
 struct datetime {
     short year;
@@ -28,116 +20,59 @@ struct datetime {
 
 /************************* FUNCTION PROTOTYPES ****************************/
 
-char *month_to_string(short m);
-void unpack_datetime(unsigned char *time, short *year, short *month, short *day, short *hour, short *minute, short *second);
-void sseek(FILE * f, int len, int origin);
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f);
-void convertToNet(superblock_entry_t * sb);
-void readRootDirectory(diskimage_t * image, FILE * f);
+void readRootDirectory(uvfs_image_t * image);
+void readDirectory(uvfs_image_t * image, const char * path);
+void listEntry(const directory_entry_t * entry, void * arg);
 void printDirectoryEntry(directory_entry_t de, datetime_t dt);
-void convertToNetDE(directory_entry_t * de);
 void convertToNetDT(datetime_t * dt);
 
 /************************* FUNCTION IMPLEMENTATIONS *************************/
 
-char *month_to_string(short m) {
-    switch(m) {
-    case 1: return "Jan";
-    case 2: return "Feb";
-    case 3: return "Mar";
-    case 4: return "Apr";
-    case 5: return "May";
-    case 6: return "Jun";
-    case 7: return "Jul";
-    case 8: return "Aug";
-    case 9: return "Sep";
-    case 10: return "Oct";
-    case 11: return "Nov";
-    case 12: return "Dec";
-    default: return "?!?";
-    }
-}
-
-void unpack_datetime(unsigned char *time, short *year, short *month, 
-    short *day, short *hour, short *minute, short *second)
-{
-    assert(time != NULL);
-
-    memcpy(year, time, 2);
-    *year = htons(*year);
-
-    *month = (unsigned short)(time[2]);
-    *day = (unsigned short)(time[3]);
-    *hour = (unsigned short)(time[4]);
-    *minute = (unsigned short)(time[5]);
-    *second = (unsigned short)(time[6]);
-}
-
 /*
- * Safe seek
- * Runs fseek with input params and handles errors
+ * Reads and prints out each entry in the root directory
  */
-void sseek(FILE * f, int len, int origin)
+void readRootDirectory(uvfs_image_t * image)
 {
-    if(0 != fseek(f, len, origin))
+    int i;
+    // for each directory entry of root
+    for(i = 0; i < image->dir_entries; i++)
     {
-        fprintf(stderr, "Seek failed.\n");
-        exit(1);
+        if(image->dir[i].status == DIR_ENTRY_AVAILABLE)
+            continue;
+
+        listEntry(&image->dir[i], NULL);
     }
 }
+
 /*
- * Safe read
- * Runs fread with input params and handles error
+ * Reads and prints out each entry of the subdirectory at path, in name order
  */
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f)
+void readDirectory(uvfs_image_t * image, const char * path)
 {
-    if( fread(buffer, sizeofelements, num, f) != num )
+    directory_entry_t de;
+
+    if(!uvfs_lookup(image, path, &de) || de.status != DIR_ENTRY_DIRECTORY)
     {
-        fprintf(stderr, "Read failed.\n");
+        fprintf(stderr, "Directory not found on specified image.\n");
         exit(1);
     }
-}
 
-/*
- * Converts superblock to network byte order
- */
-void convertToNet(superblock_entry_t * sb)
-{
-    sb->block_size = htons(sb->block_size);
-    sb->num_blocks = htonl(sb->num_blocks);
-    sb->fat_start = htonl(sb->fat_start);
-    sb->fat_blocks = htonl(sb->fat_blocks);
-    sb->dir_start = htonl(sb->dir_start);
-    sb->dir_blocks = htonl(sb->dir_blocks);
+    uvfs_dir_list(image, ntohl(de.start_block), listEntry, NULL);
 }
 
 /*
- * Reads and prints out each entry in the root directory
+ * Prints one entry as it is on disk
  */
-void readRootDirectory(diskimage_t * image, FILE * f)
+void listEntry(const directory_entry_t * entry, void * arg)
 {
-    int i, j;
-    // for each block of root
-    for(i = 0; i < image->sb->dir_blocks; i++)
-    {
-        // for each directory entry of block
-        for(j = 0; j < image->sb->block_size/SIZE_DIR_ENTRY; j++)
-        {
-            sseek(f, ((image->sb->dir_start + i) * image->sb->block_size + j * SIZE_DIR_ENTRY), SEEK_SET);
-            directory_entry_t de;
-            datetime_t dt;
-            sread(&de, sizeof(directory_entry_t), 1, f);
+    directory_entry_t de = *entry;
+    datetime_t dt;
 
-            if(de.status == DIR_ENTRY_AVAILABLE)
-                continue;
+    convertToNetDE(&de);
 
-            convertToNetDE(&de);
+    unpack_datetime(de.modify_time, &dt.year, &dt.month, &dt.day, &dt.hour, &dt.minute, &dt.second);
 
-            unpack_datetime(de.modify_time, &dt.year, &dt.month, &dt.day, &dt.hour, &dt.minute, &dt.second);
-
-            printDirectoryEntry(de, dt);
-        }
-    }
+    printDirectoryEntry(de, dt);
 }
 
 void printDirectoryEntry(directory_entry_t de, datetime_t dt)
@@ -150,13 +85,6 @@ void printDirectoryEntry(directory_entry_t de, datetime_t dt)
         dt.second, de.filename);
 }
 
-void convertToNetDE(directory_entry_t * de)
-{
-    de->start_block = htonl(de->start_block);
-    de->num_blocks = htonl(de->num_blocks);
-    de->file_size = htonl(de->file_size);
-}
-
 void convertToNetDT(datetime_t * dt)
 {
     //dt->year = htons(dt->year);
@@ -170,13 +98,12 @@ void convertToNetDT(datetime_t * dt)
 /******************** MAIN ************************/
 
 int main(int argc, char *argv[]) {
-    superblock_entry_t sb;
     int  i;
     char *imagename = NULL;
-    FILE *f;
+    char *server = NULL;
+    char *dirname = NULL;
 
-    diskimage_t image;
-    image.sb = &sb;
+    uvfs_image_t image;
 
 /******************* ZASTRE ***********************/
 
@@ -184,42 +111,45 @@ int main(int argc, char *argv[]) {
         if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
             imagename = argv[i+1];
             i++;
+        } else if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
+            server = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--dir") == 0 && i+1 < argc) {
+            dirname = argv[i+1];
+            i++;
         }
     }
 
-    if (imagename == NULL)
+    // the server only lists the root directory
+    if (imagename == NULL || (server != NULL && dirname != NULL))
     {
-        fprintf(stderr, "usage: lsuvfs --image <imagename>\n");
+        fprintf(stderr, "usage: lsuvfs --image <imagename> [--dir <path> | --server <socket path>]\n");
         exit(1);
     }
 
 /******************** END Z *********************/
 
-    if( (f = fopen(imagename, "rb+")) == NULL)
-    {
-        fprintf(stderr, "Specified image could not be opened.\n");
-        exit(1);
-    }
+    // the server sends the used entries; list them as if they were the directory
+    if (server != NULL) {
+        uint64_t len;
 
-    image.imagename = imagename;
-    sseek(f, 0L, SEEK_SET);
-
-    // read in super block
-    sread(image.sb, sizeof(superblock_entry_t), 1, f);
-
-    // validate image
-    if(strncmp(image.sb->magic, FILE_SYSTEM_ID, 8) != 0)
-    {
-        fprintf(stderr, "Image did not match expected format.\n");
-        exit(1);
+        image.dir = uvfs_client_call(server, UVFSD_LS, imagename, NULL, 0, 0, -1, -1, &len);
+        image.dir_entries = len / sizeof(directory_entry_t);
+        readRootDirectory(&image);
+        free((void *)image.dir);
+        return 0;
     }
 
-    convertToNet(image.sb);
+    uvfs_open(&image, imagename, UVFS_RDONLY);
 
-    readRootDirectory(&image, f);
+    uvfs_lock_metadata(&image, UVFS_LOCK_SHARED);
+    if (dirname != NULL)
+        readDirectory(&image, dirname);
+    else
+        readRootDirectory(&image);
+    uvfs_lock_metadata(&image, UVFS_LOCK_NONE);
 
-    if(f)
-        fclose(f);
+    uvfs_close(&image);
 
     return 0; 
 }
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+#define FAT_CACHE_MB 8
+
+/*************************** MAIN ***************************/
+
+int main(int argc, char *argv[]) {
+    int  i;
+    char *imagename = NULL;
+
+    uvfs_image_t image;
+    uvfs_store_t store;
+
+    memset(&store, 0, sizeof(store));
+
+/******************* ZASTRE ***********************/
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            imagename = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--file") == 0 && i+1 < argc) {
+            uvfs_store_add(&store, argv[i+1], NULL);
+            store.jobs[store.num_jobs - 1].mode = UVFS_STORE_REMOVE;
+            i++;
+        }
+    }
+
+    if (imagename == NULL || store.num_jobs == 0)
+    {
+        fprintf(stderr, "usage: rmuvfs --image <imagename> --file <filename in image> [--file ...]\n");
+        exit(1);
+    }
+
+/******************** END Z *********************/
+
+    // removes are store jobs with no data: every file is checked and
+    // claimed before any is removed, and all go in one commit
+    uvfs_open(&image, imagename, UVFS_RDWR);
+
+    uvfs_store_load(&store, &image, FAT_CACHE_MB << 20, 1);
+    uvfs_store_run(&store, 0);
+    uvfs_store_destroy(&store);
+
+    uvfs_close(&image);
+
+    return 0;
+}
@@ -1,130 +1,452 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <arpa/inet.h>
 #include <string.h>
-#include "disk.h"
+#include <time.h>
+#include "uvfs.h"
+
+#define BENCH_SECONDS 0.25
+#define HISTOGRAM_BUCKETS 32            // free extents of 2^k to 2^(k+1)-1 blocks
 
 /************************ IMAGE STRUCT *******************************/
 
 typedef struct diskimage diskimage_t;
 struct diskimage {
-    char * imagename;
-    superblock_entry_t * sb;
+    uvfs_image_t * uvfs;
     unsigned int free_blocks;
     unsigned int resv_blocks;
     unsigned int alloc_blocks;
-} __attribute__ ((packed));
+};
+
+/************************ LAYOUT STRUCTS *******************************/
+
+/*
+ * A file and the extents its blocks lie in
+ */
+typedef struct layout_file layout_file_t;
+struct layout_file {
+    char * path;
+    unsigned int blocks;
+    int extents;                        // -1 if its chain is damaged
+};
+
+/*
+ * Where files and free space lie on an image. The fragmentation score
+ * is the share of the places a file could be split that it is: 0 when
+ * every file is one extent, 1 when no two blocks of a file are adjacent.
+ * Files with damaged chains are listed but left out of the score.
+ */
+typedef struct layout layout_t;
+struct layout {
+    layout_file_t * files;
+    int num_files;
+    int cap_files;
+    int damaged_files;
+    unsigned long file_blocks;
+    unsigned long file_extents;
+    unsigned long free_blocks;
+    unsigned long free_extents;
+    unsigned long histogram[HISTOGRAM_BUCKETS];
+    unsigned int largest_free;
+    unsigned int largest_free_start;
+};
+
+/*
+ * A subdirectory being walked, for the entries uvfs_dir_list passes
+ */
+typedef struct layout_dir layout_dir_t;
+struct layout_dir {
+    const uvfs_image_t * uvfs;
+    layout_t * layout;
+    const char * path;
+    uvfs_dir_path_t at;
+};
 
 /************************* FUNCTION PROTOTYPES ****************************/
 
-void sseek(FILE * f, int len, int origin);
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f);
-void convertToNet(superblock_entry_t * sb);
 void print_image(diskimage_t image);
-void read_FAT(diskimage_t * image, FILE * f);
+void read_FAT(diskimage_t * image);
+int  verify_summary(diskimage_t * image);
+void bench_FAT(diskimage_t * image);
+double now_seconds(void);
+void layout_entry(const uvfs_image_t * uvfs, layout_t * layout, const directory_entry_t * de, const char * dirname,
+    const uvfs_dir_path_t * parent);
+void layout_dir_entry(const directory_entry_t * de, void * arg);
+int  chain_extents(const uvfs_image_t * uvfs, unsigned int block, unsigned int num_blocks);
+void read_layout(const uvfs_image_t * uvfs, layout_t * layout);
+double fragmentation(const layout_t * layout);
+void print_layout(const layout_t * layout);
+void print_json_string(const char * s);
+void print_layout_json(diskimage_t image, const layout_t * layout);
+void free_layout(layout_t * layout);
 
 /************************* FUNCTION IMPLEMENTATIONS *************************/
 
 /*
- * Safe seek
- * Runs fseek with input params and handles errors
+ * Print image as per assignment spec
  */
-void sseek(FILE * f, int len, int origin)
+void print_image(diskimage_t image)
 {
-    if(0 != fseek(f, len, origin))
+    superblock_entry_t * sb = &image.uvfs->sb;
+
+    printf("%.*s (%s)\n", FILE_SYSTEM_ID_LEN, sb->magic, image.uvfs->imagename);
+    printf("\n-------------------------------------------------\n");
+    printf("  Bsz   Bcnt  FATst FATcnt  DIRst DIRcnt\n");
+    printf("%5d  %5d  %5d  %5d  %5d  %5d\n", sb->block_size, sb->num_blocks, sb->fat_start,
+        sb->fat_blocks, sb->dir_start, sb->dir_blocks);
+    printf("\n-------------------------------------------------\n");
+    printf(" Free   Resv  Alloc\n");
+    printf("%5d  %5d  %5d\n", image.free_blocks, image.resv_blocks, image.alloc_blocks);
+}
+
+/*
+ * Count FAT entries by status into image, from the allocation summary
+ * when the image carries a clean one and from a full FAT scan otherwise
+ */
+void read_FAT(diskimage_t * image)
+{
+    uvfs_census_t census;
+
+    if(uvfs_summary_read(image->uvfs, &census) != UVFS_SUMMARY_VALID)
+        uvfs_fat_census(image->uvfs, &census);
+
+    image->free_blocks = census.free_blocks;
+    image->resv_blocks = census.resv_blocks;
+    image->alloc_blocks = census.alloc_blocks;
+}
+
+/*
+ * Compares the allocation summary against a full FAT scan.
+ * Returns 0 if they agree or there is no summary, 1 on mismatch.
+ */
+int verify_summary(diskimage_t * image)
+{
+    uvfs_census_t summary, scan;
+    int state = uvfs_summary_read(image->uvfs, &summary);
+
+    uvfs_fat_census(image->uvfs, &scan);
+
+    printf("\n-------------------------------------------------\n");
+    if(state == UVFS_SUMMARY_ABSENT)
     {
-        fprintf(stderr, "Seek failed.\n");
-        exit(1);
+        printf("No allocation summary; counts are from a FAT scan.\n");
+        return 0;
+    }
+    if(state == UVFS_SUMMARY_STALE)
+    {
+        printf("Allocation summary is stale; counts are from a FAT scan.\n");
+        return 1;
+    }
+    if(summary.free_blocks != scan.free_blocks || summary.resv_blocks != scan.resv_blocks ||
+        summary.alloc_blocks != scan.alloc_blocks)
+    {
+        printf("Allocation summary does not match FAT:\n");
+        printf(" Free   Resv  Alloc\n");
+        printf("%5d  %5d  %5d  (summary)\n", summary.free_blocks, summary.resv_blocks, summary.alloc_blocks);
+        printf("%5d  %5d  %5d  (FAT)\n", scan.free_blocks, scan.resv_blocks, scan.alloc_blocks);
+        return 1;
+    }
+    printf("Allocation summary matches FAT.\n");
+    return 0;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Times every census kernel supported here over the FAT and prints
+ * entries/second for each
+ */
+void bench_FAT(diskimage_t * image)
+{
+    size_t n = image->uvfs->sb.num_blocks;
+    int kernel;
+
+    printf("\n-------------------------------------------------\n");
+    printf(" Kernel         Entries/s   Passes\n");
+
+    for(kernel = UVFS_CENSUS_SCALAR; kernel <= UVFS_CENSUS_AVX2; kernel++)
+    {
+        if(!uvfs_census_supported(kernel))
+            continue;
+
+        size_t nfree = 0, nresv = 0;
+        unsigned long passes = 0;
+        double start = now_seconds(), elapsed;
+
+        do {
+            uvfs_count_fat(kernel, image->uvfs->fat, n, &nfree, &nresv);
+            passes++;
+        } while((elapsed = now_seconds() - start) < BENCH_SECONDS);
+
+        printf(" %-6s  %15.0f  %7lu\n", uvfs_census_name(kernel), passes * n / elapsed, passes);
     }
 }
+
 /*
- * Safe read
- * Runs fread with input params and handles error
+ * Adds the file de (network byte order) in the directory whose path is
+ * dirname, parent, to layout, or everything under it if it is a directory
  */
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f)
+void layout_entry(const uvfs_image_t * uvfs, layout_t * layout, const directory_entry_t * de, const char * dirname,
+    const uvfs_dir_path_t * parent)
 {
-    if( fread(buffer, sizeofelements, num, f) != num )
+    size_t len = strlen(dirname) + DIR_FILENAME_MAX + 2;
+    char * path = malloc(len);
+    directory_entry_t host = *de;
+    layout_file_t * file;
+
+    if(path == NULL)
     {
-        fprintf(stderr, "Read failed.\n");
+        fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
+    snprintf(path, len, "%s%s%.*s", dirname, dirname[0] ? "/" : "", DIR_FILENAME_MAX, de->filename);
+
+    if(de->status == DIR_ENTRY_DIRECTORY)
+    {
+        layout_dir_t dir = { uvfs, layout, path, { ntohl(de->start_block), parent } };
+
+        uvfs_dir_enter(&dir.at);
+        uvfs_dir_list(uvfs, ntohl(de->start_block), layout_dir_entry, &dir);
+        free(path);
+        return;
+    }
+
+    if(layout->num_files == layout->cap_files)
+    {
+        layout->cap_files = layout->cap_files ? layout->cap_files * 2 : 64;
+        if((layout->files = realloc(layout->files, layout->cap_files * sizeof(layout_file_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    file = &layout->files[layout->num_files++];
+    convertToHostDE(&host);
+    file->path = path;
+    file->blocks = host.num_blocks;
+    if((file->extents = chain_extents(uvfs, host.start_block, host.num_blocks)) < 0)
+    {
+        layout->damaged_files++;
+        return;
+    }
+    layout->file_blocks += file->blocks;
+    layout->file_extents += file->extents;
+}
+
+/*
+ * Returns the extents of the chain from block, which should be
+ * num_blocks long, or -1 if it breaks off, runs on or loops
+ */
+int chain_extents(const uvfs_image_t * uvfs, unsigned int block, unsigned int num_blocks)
+{
+    unsigned int n, prev = 0;
+    int extents = 0;
+
+    for(n = 0; n < num_blocks; n++)
+    {
+        if(block == FAT_AVAILABLE || block == FAT_RESERVED || block >= uvfs->sb.num_blocks)
+            return -1;
+        if(n == 0 || block != prev + 1)
+            extents++;
+        prev = block;
+        block = uvfs_fat_entry(uvfs, block);
+    }
+    return num_blocks > 0 && block == FAT_LASTBLOCK ? extents : -1;
+}
+
+void layout_dir_entry(const directory_entry_t * de, void * arg)
+{
+    layout_dir_t * dir = arg;
+
+    layout_entry(dir->uvfs, dir->layout, de, dir->path, &dir->at);
 }
 
 /*
- * Converts superblock to network byte order
+ * Fills layout in one pass over the FAT, for the free extents, and one
+ * over the directory tree, for each file's extents (from its extent map
+ * if it has a good one, otherwise from its chain)
  */
-void convertToNet(superblock_entry_t * sb)
+void read_layout(const uvfs_image_t * uvfs, layout_t * layout)
 {
-    sb->block_size = htons(sb->block_size);
-    sb->num_blocks = htonl(sb->num_blocks);
-    sb->fat_start = htonl(sb->fat_start);
-    sb->fat_blocks = htonl(sb->fat_blocks);
-    sb->dir_start = htonl(sb->dir_start);
-    sb->dir_blocks = htonl(sb->dir_blocks);
+    unsigned int b, run = 0;
+    int i, k;
+
+    memset(layout, 0, sizeof(layout_t));
+
+    for(b = 0; b <= uvfs->sb.num_blocks; b++)
+    {
+        if(b < uvfs->sb.num_blocks && uvfs_fat_entry(uvfs, b) == FAT_AVAILABLE)
+        {
+            run++;
+            continue;
+        }
+        if(run == 0)
+            continue;
+
+        for(k = 0; k < HISTOGRAM_BUCKETS - 1 && run >> (k + 1) != 0; k++)
+            ;
+        layout->histogram[k]++;
+        layout->free_blocks += run;
+        layout->free_extents++;
+        if(run > layout->largest_free)
+        {
+            layout->largest_free = run;
+            layout->largest_free_start = b - run;
+        }
+        run = 0;
+    }
+
+    for(i = 0; i < uvfs->dir_entries; i++)
+    {
+        if(uvfs->dir[i].status == DIR_ENTRY_NORMALFILE || uvfs->dir[i].status == DIR_ENTRY_DIRECTORY)
+            layout_entry(uvfs, layout, &uvfs->dir[i], "", NULL);
+    }
 }
 
 /*
- * Print image as per assignment spec
+ * Returns the layout's fragmentation score, from 0 to 1
  */
-void print_image(diskimage_t image)
+double fragmentation(const layout_t * layout)
 {
+    unsigned long files = layout->num_files - layout->damaged_files;
+    unsigned long joins = layout->file_blocks - files;
+
+    return joins == 0 ? 0.0 : (double)(layout->file_extents - files) / joins;
+}
+
+/*
+ * Print the layout report after the counts
+ */
+void print_layout(const layout_t * layout)
+{
+    int i, k;
 
-    printf("%s (%s)\n", image.sb->magic, image.imagename);
     printf("\n-------------------------------------------------\n");
-    printf("  Bsz   Bcnt  FATst FATcnt  DIRst DIRcnt\n");
-    printf("%5d  %5d  %5d  %5d  %5d  %5d\n", image.sb->block_size, image.sb->num_blocks, image.sb->fat_start,
-        image.sb->fat_blocks, image.sb->dir_start, image.sb->dir_blocks);
+    printf(" Extents  Blocks  File\n");
+    for(i = 0; i < layout->num_files; i++)
+    {
+        if(layout->files[i].extents < 0)
+            printf("%8s  %6u  %s (chain damaged)\n", "-", layout->files[i].blocks, layout->files[i].path);
+        else
+            printf("%8d  %6u  %s\n", layout->files[i].extents, layout->files[i].blocks, layout->files[i].path);
+    }
+
     printf("\n-------------------------------------------------\n");
-    printf(" Free   Resv  Alloc\n");
-    printf("%5d  %5d  %5d\n", image.free_blocks, image.resv_blocks, image.alloc_blocks);
+    printf("        Free blocks  Extents\n");
+    for(k = 0; k < HISTOGRAM_BUCKETS; k++)
+    {
+        if(layout->histogram[k] == 0)
+            continue;
+        if(k == 0)
+            printf("  %17u  %7lu\n", 1, layout->histogram[k]);
+        else
+            printf("  %8u-%-8u  %7lu\n", 1u << k, (unsigned int)((2ul << k) - 1), layout->histogram[k]);
+    }
+
+    printf("\n-------------------------------------------------\n");
+    if(layout->largest_free > 0)
+        printf("Largest free run: %u blocks at block %u\n", layout->largest_free, layout->largest_free_start);
+    else
+        printf("Largest free run: none\n");
+    printf("Fragmentation: %.1f%% (%lu extents in %d files)\n", fragmentation(layout) * 100,
+        layout->file_extents, layout->num_files - layout->damaged_files);
+    if(layout->damaged_files > 0)
+        printf("Damaged chains: %d files, not scored\n", layout->damaged_files);
 }
 
 /*
- * Read FAT table information into image
+ * Print s as a JSON string
  */
-void read_FAT(diskimage_t * image, FILE * f)
+void print_json_string(const char * s)
 {
-    int i,j;
-    // for each block of the FAT table
-    for(i = 0; i < image->sb->fat_blocks; i++)
-    {
-        //sseek(f, (image->sb->fat_start + i) * image->sb->block_size, SEEK_SET);
-        // for each FAT entry in block
-        for(j = 0;
-            j < image->sb->block_size/SIZE_FAT_ENTRY && 
-            i*image->sb->block_size/SIZE_FAT_ENTRY + j < image->sb->num_blocks; 
-            j++)
-        {
-            //ensure looking at FAT entry
-            sseek(f, (image->sb->fat_start + i) * image->sb->block_size + j * SIZE_FAT_ENTRY, SEEK_SET);
+    putchar('"');
+    for(; *s != '\0'; s++)
+    {
+        if(*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned char)*s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/*
+ * Print the counts and the layout report as one JSON object
+ */
+void print_layout_json(diskimage_t image, const layout_t * layout)
+{
+    superblock_entry_t * sb = &image.uvfs->sb;
+    int i, k, first = 1;
 
-            unsigned long int status;
+    printf("{\n  \"image\": ");
+    print_json_string(image.uvfs->imagename);
+    printf(",\n  \"magic\": \"%.*s\",\n", FILE_SYSTEM_ID_LEN, sb->magic);
+    printf("  \"block_size\": %d,\n  \"num_blocks\": %u,\n", sb->block_size, sb->num_blocks);
+    printf("  \"free_blocks\": %u,\n  \"resv_blocks\": %u,\n  \"alloc_blocks\": %u,\n",
+        image.free_blocks, image.resv_blocks, image.alloc_blocks);
 
-            sread(&status, sizeof(unsigned long int), 1, f);
-            status = htonl(status);
+    printf("  \"files\": [");
+    for(i = 0; i < layout->num_files; i++)
+    {
+        printf("%s\n    {\"path\": ", i ? "," : "");
+        print_json_string(layout->files[i].path);
+        if(layout->files[i].extents < 0)
+            printf(", \"blocks\": %u, \"extents\": null, \"damaged\": true}", layout->files[i].blocks);
+        else
+            printf(", \"blocks\": %u, \"extents\": %d, \"damaged\": false}", layout->files[i].blocks,
+                layout->files[i].extents);
+    }
+    printf("%s],\n", layout->num_files ? "\n  " : "");
 
-            if(status == FAT_AVAILABLE)
-                image->free_blocks++;
-            else if(status == FAT_RESERVED)
-                image->resv_blocks++;
-            else
-                image->alloc_blocks++;
-        }
+    printf("  \"free_extents\": %lu,\n  \"free_histogram\": [", layout->free_extents);
+    for(k = 0; k < HISTOGRAM_BUCKETS; k++)
+    {
+        if(layout->histogram[k] == 0)
+            continue;
+        printf("%s\n    {\"min\": %u, \"max\": %u, \"extents\": %lu}", first ? "" : ",", 1u << k,
+            (unsigned int)((2ul << k) - 1), layout->histogram[k]);
+        first = 0;
     }
+    printf("%s],\n", first ? "" : "\n  ");
+
+    printf("  \"largest_free_run\": %u,\n  \"largest_free_start\": %u,\n", layout->largest_free,
+        layout->largest_free_start);
+    printf("  \"file_extents\": %lu,\n  \"damaged_files\": %d,\n  \"fragmentation\": %.4f\n}\n",
+        layout->file_extents, layout->damaged_files, fragmentation(layout));
+}
+
+void free_layout(layout_t * layout)
+{
+    int i;
+
+    for(i = 0; i < layout->num_files; i++)
+        free(layout->files[i].path);
+    free(layout->files);
 }
 
 /************************* MAIN ****************************/
 
 int main(int argc, char *argv[]) {
-    superblock_entry_t sb;
+    uvfs_image_t uvfs;
     int  i;
     char *imagename = NULL;
-    FILE  *f;
-    //int   *fat_data;
+    char *server = NULL;
+    int  bench = 0;
+    int  verify = 0;
+    int  layout = 0;
+    int  json = 0;
+    int  status = 0;
+    layout_t report;
 
     diskimage_t image;
-    image.sb = &sb;
+    image.uvfs = &uvfs;
     image.free_blocks = 0;
     image.resv_blocks = 0;
     image.alloc_blocks = 0;
@@ -135,44 +457,74 @@ int main(int argc, char *argv[]) {
         if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
             imagename = argv[i+1];
             i++;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[i], "--layout") == 0) {
+            layout = 1;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            layout = json = 1;
+        } else if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
+            server = argv[i+1];
+            i++;
         }
     }
 
-    if (imagename == NULL)
+    if (imagename == NULL || (server != NULL && (verify || bench || layout)) || (json && (verify || bench)))
     {
-        fprintf(stderr, "usage: statuvfs --image <imagename>\n");
+        fprintf(stderr, "usage: statuvfs --image <imagename> [--verify] [--bench] [--layout]\n" \
+            "       statuvfs --image <imagename> --json\n" \
+            "       statuvfs --image <imagename> --server <socket path>\n");
         exit(1);
     }
 
 /******************** END Z *********************/
 
-    if( (f = fopen(imagename, "rb+")) == NULL)
-    {
-        fprintf(stderr, "Specified image could not be opened.\n");
-        exit(1);
+    // the server keeps the counts current; only the formatting is local
+    if (server != NULL) {
+        uvfsd_stat_t * st = uvfs_client_call(server, UVFSD_STAT, imagename, NULL,
+            0, 0, -1, -1, NULL);
+
+        uvfs.imagename = imagename;
+        uvfs.sb = st->sb;
+        image.free_blocks = st->free_blocks;
+        image.resv_blocks = st->resv_blocks;
+        image.alloc_blocks = st->alloc_blocks;
+        print_image(image);
+        free(st);
+        return 0;
     }
 
-    image.imagename = imagename;
-    sseek(f, 0L, SEEK_SET);
+    uvfs_open(&uvfs, imagename, UVFS_RDONLY);
 
-    // read in super block
-    sread(image.sb, sizeof(superblock_entry_t), 1, f);
+    uvfs_lock_metadata(&uvfs, UVFS_LOCK_SHARED);
 
-    // validate image
-    if(strncmp(image.sb->magic, FILE_SYSTEM_ID, 8) != 0)
-    {
-        fprintf(stderr, "Image did not match expected format.\n");
-        exit(1);
-    }
+    read_FAT(&image);
+
+    if(layout)
+        read_layout(&uvfs, &report);
+
+    if(json)
+        print_layout_json(image, &report);
+    else
+        print_image(image);
+
+    if(layout && !json)
+        print_layout(&report);
+
+    if(verify)
+        status = verify_summary(&image);
 
-    convertToNet(image.sb);
+    uvfs_lock_metadata(&uvfs, UVFS_LOCK_NONE);
 
-    read_FAT(&image, f);
+    if(layout)
+        free_layout(&report);
 
-    print_image(image);
+    if(bench)
+        bench_FAT(&image);
 
-    if(f)
-        fclose(f);
+    uvfs_close(&uvfs);
 
-    return 0; 
+    return status; 
 }
@@ -1,357 +1,255 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
-#include "disk.h"
+#include <unistd.h>
+#include "uvfs.h"
 
-/************************ STRUCT *******************************/
-
-typedef struct diskimage diskimage_t;
-struct diskimage {
-    char * imagename;
-    superblock_entry_t * sb;
-    FILE * f;
-} __attribute__ ((packed));
+#define FAT_CACHE_MB 8
+#define MANIFEST_LINE_MAX 4096
 
 /************************* FUNCTION PROTOTYPES ****************************/
 
-void                pack_current_datetime(unsigned char *entry);
-int                 next_free_block(int *FAT, int max_blocks);
-void                sseek(FILE * f, int len, int origin);
-void                sread(void * buffer, size_t sizeofelements, size_t num, FILE *f);
-void                swrite(void * buffer, size_t sizeofelements, size_t num, FILE *f);
-void                convertToNet(superblock_entry_t * sb);
-void                convertToNetDE(directory_entry_t * de);
-void                convertToHostDE(directory_entry_t * de);
-unsigned int        findFileOnDisk(diskimage_t * image, char * filename);
-unsigned long int   read_fat_entry(diskimage_t * image, unsigned long int entry);
-void                write_file_to_image(diskimage_t * image, char * filename, FILE * src_file);
-void                read_fat(diskimage_t * image, int * FAT);
-void                write_fat(diskimage_t * t, int * FAT);
+void                read_manifest(uvfs_store_t * store, char * manifest);
+void                add_directory(uvfs_store_t * store, char * dirname);
+int                 compare_jobs(const void * a, const void * b);
 
 /************************* FUNCTION IMPLEMENTATIONS *************************/
 
 /*
- * Based on http://bit.ly/2vniWNb
+ * Adds one job per manifest line of the form
+ *   <filename in image> <filename on host>
+ * Blank lines and lines starting with '#' are skipped.
  */
-void pack_current_datetime(unsigned char *entry) {
-    assert(entry);
-
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-
-    unsigned short year   = tm.tm_year + 1900;
-    unsigned char  month  = (unsigned char)(tm.tm_mon + 1);
-    unsigned char  day    = (unsigned char)(tm.tm_mday);
-    unsigned char  hour   = (unsigned char)(tm.tm_hour);
-    unsigned char  minute = (unsigned char)(tm.tm_min);
-    unsigned char  second = (unsigned char)(tm.tm_sec);
-
-    year = htons(year);
-
-    memcpy(entry, &year, 2);
-    entry[2] = month;
-    entry[3] = day;
-    entry[4] = hour;
-    entry[5] = minute;
-    entry[6] = second; 
-}
-
-/*
- * Returns next available block
- */
-int next_free_block(int *FAT, int max_blocks) {
-    assert(FAT != NULL);
-
-    int i;
-
-    for (i = 0; i < max_blocks; i++) {
-        if (FAT[i] == FAT_AVAILABLE) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-/*
- * Safe seek
- * Runs fseek with input params and handles errors
- */
-void sseek(FILE * f, int len, int origin)
+void read_manifest(uvfs_store_t * store, char * manifest)
 {
-    if(0 != fseek(f, len, origin))
-    {
-        fprintf(stderr, "Seek failed.\n");
-        exit(1);
-    }
-}
+    char line[MANIFEST_LINE_MAX];
+    FILE * f;
 
-/*
- * Safe read
- * Runs fread with input params and handles error
- */
-void sread(void * buffer, size_t sizeofelements, size_t num, FILE *f)
-{
-    if( fread(buffer, sizeofelements, num, f) != num )
+    if((f = fopen(manifest, "r")) == NULL)
     {
-        fprintf(stderr, "Read failed.\n");
+        fprintf(stderr, "Specified manifest could not be opened.\n");
         exit(1);
     }
-}
 
-/*
- * Safe write
- * Runs fwrite with input params and handles error
- */
-void swrite(void * buffer, size_t sizeofelements, size_t num, FILE *f)
-{
-    if ( fwrite(buffer, sizeofelements, num, f) != num )
+    while(fgets(line, sizeof(line), f) != NULL)
     {
-        fprintf(stderr, "Write failed.\n");
-        exit(1);
-    }
-}
+        char * name = line, * source;
 
-/*
- * Converts superblock to network byte order
- */
-void convertToNet(superblock_entry_t * sb)
-{
-    sb->block_size = htons(sb->block_size);
-    sb->num_blocks = htonl(sb->num_blocks);
-    sb->fat_start = htonl(sb->fat_start);
-    sb->fat_blocks = htonl(sb->fat_blocks);
-    sb->dir_start = htonl(sb->dir_start);
-    sb->dir_blocks = htonl(sb->dir_blocks);
-}
+        line[strcspn(line, "\r\n")] = '\0';
+        while(isspace((unsigned char)*name))
+            name++;
+        if(*name == '\0' || *name == '#')
+            continue;
 
-/*
- * Convert directory entry to network byte order
- */
-void convertToNetDE(directory_entry_t * de)
-{
-    de->start_block = htonl(de->start_block);
-    de->num_blocks = htonl(de->num_blocks);
-    de->file_size = htonl(de->file_size);
-}
+        source = name + strcspn(name, " \t");
+        if(*source != '\0')
+            *source++ = '\0';
+        while(isspace((unsigned char)*source))
+            source++;
 
-/*
- * Locates filename on image.
- * Returns location of first block or 0xffffffff if end of file or 0 if not found.
- */
-unsigned int findFileOnDisk(diskimage_t * image, char * filename)
-{
-    int i, j;
-    // for each block of root
-    for(i = 0; i < image->sb->dir_blocks; i++)
-    {
-        // for each directory entry of block
-        for(j = 0; j < image->sb->block_size/SIZE_DIR_ENTRY; j++)
+        if(*source == '\0')
         {
-            sseek(image->f, ((image->sb->dir_start + i) * image->sb->block_size + j * SIZE_DIR_ENTRY), SEEK_SET);
-            directory_entry_t de;
-            sread(&de, sizeof(directory_entry_t), 1, image->f);
-
-            if(de.status == DIR_ENTRY_AVAILABLE || strcmp(de.filename, filename) != 0)
-                continue;
-
-            convertToNetDE(&de);
-            return de.start_block;
+            fprintf(stderr, "Manifest line for %s has no source.\n", name);
+            exit(1);
         }
+
+        uvfs_store_add(store, strdup(name), strdup(source));
     }
-    return 0;
+
+    fclose(f);
 }
 
 /*
- * Writes src file to the specified image under filename
+ * Adds a job for every regular file in dirname, stored under its own name
  */
-void write_file_to_image(diskimage_t * image, char * filename, FILE * src_file)
+void add_directory(uvfs_store_t * store, char * dirname)
 {
+    DIR * dir;
+    struct dirent * d;
+    struct stat st;
+    int first = store->num_jobs;
 
-    // find where to write de
-    unsigned long int de_write_byte = 0;
-    int i, j;
-    // for each block of root
-    for(i = 0; i < image->sb->dir_blocks; i++)
-    {
-        // for each directory entry of block
-        for(j = 0; j < image->sb->block_size/SIZE_DIR_ENTRY; j++)
-        {
-            sseek(image->f, ((image->sb->dir_start + i) * image->sb->block_size + j * SIZE_DIR_ENTRY), SEEK_SET);
-            directory_entry_t de;
-            sread(&de, sizeof(directory_entry_t), 1, image->f);
-
-            if(de.status == DIR_ENTRY_AVAILABLE)
-            {
-                de_write_byte = (image->sb->dir_start + i) * image->sb->block_size + j * SIZE_DIR_ENTRY;
-                break;
-            }
-        }
-        if(de_write_byte != 0)
-            break;
-    }
-
-    // read in FAT
-    int FAT[image->sb->fat_blocks * image->sb->block_size / SIZE_FAT_ENTRY];
-    read_fat(image, FAT);
-
-    if(de_write_byte == 0)
+    if((dir = opendir(dirname)) == NULL)
     {
-        fprintf(stderr, "No room for directory entry.\n");
+        fprintf(stderr, "Specified source file could not be found.\n");
         exit(1);
     }
 
-    // for reading and writing file
-    unsigned char write_buffer[image->sb->block_size + 1];
-
-    // begin prepping de
-    directory_entry_t de;
-    de.status = DIR_ENTRY_NORMALFILE;
-    sseek(image->f, image->sb->fat_start * image->sb->block_size, SEEK_SET);
-    de.start_block = next_free_block(FAT, image->sb->num_blocks);
-
-    // strncpy(&de._padding, "0xff0xff0xff0xff0xff0xff", 6);
-
-    de.num_blocks = 0;
-    strcpy(de.filename, filename);
-
-    int bytes_read;
-    unsigned int write_block = de.start_block;
-    unsigned int next_block;
-
-    sseek(src_file, 0L, SEEK_SET);
-
-    while( (bytes_read = fread(&write_buffer, 1, image->sb->block_size, src_file)) > 0)
+    while((d = readdir(dir)) != NULL)
     {
-        write_buffer[bytes_read] = '\0';
+        char * path = malloc(strlen(dirname) + strlen(d->d_name) + 2);
 
-        FAT[write_block] = ntohl(FAT_RESERVED);
-        next_block = next_free_block(FAT, image->sb->num_blocks);
-        FAT[write_block] = ntohl(next_block);
-        
-        if(next_block == 0)
+        sprintf(path, "%s/%s", dirname, d->d_name);
+        if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
         {
-            fprintf(stderr, "Not enough room for file.\n");
-            exit(1);
+            free(path);
+            continue;
         }
-
-        //printf("%s", write_buffer);
-        //printf("Saving %x to %x\n", next_block, write_block);
-        
-        sseek(image->f, write_block * image->sb->block_size, SEEK_SET);
-        swrite(&write_buffer, sizeof(char), bytes_read, image->f);
-
-        write_block = next_block;
-        de.num_blocks++;
+        uvfs_store_add(store, strdup(d->d_name), path);
     }
+    closedir(dir);
 
-    // end file and write FAT back to disk
-    FAT[write_block] = FAT_LASTBLOCK;
-    write_fat(image, FAT);
-
-    // finish up and write de
-    de.file_size = (de.num_blocks - 1) * image->sb->block_size + bytes_read;
-    pack_current_datetime(de.create_time);
-    pack_current_datetime(de.modify_time);
-
-    sseek(image->f, de_write_byte, SEEK_SET);
-    convertToHostDE(&de);
-    swrite(&de, sizeof(de), 1, image->f);
-}
-
-void convertToHostDE(directory_entry_t * de)
-{
-    de->start_block = ntohl(de->start_block);
-    de->num_blocks = ntohl(de->num_blocks);
-    de->file_size = ntohl(de->file_size);
-}
-
-void read_fat(diskimage_t * image, int * FAT)
-{
-    sseek(image->f, image->sb->fat_start * image->sb->block_size, SEEK_SET);
-    sread(FAT, sizeof(int), image->sb->fat_blocks * image->sb->block_size / SIZE_FAT_ENTRY, image->f);
+    // readdir order is arbitrary; store in name order
+    qsort(store->jobs + first, store->num_jobs - first, sizeof(uvfs_store_job_t), compare_jobs);
 }
 
-void write_fat(diskimage_t * image, int * FAT)
+int compare_jobs(const void * a, const void * b)
 {
-    sseek(image->f, image->sb->fat_start * image->sb->block_size, SEEK_SET);
-    swrite(FAT, sizeof(int), image->sb->fat_blocks * image->sb->block_size / SIZE_FAT_ENTRY, image->f);
+    return strcmp(((const uvfs_store_job_t *)a)->filename, ((const uvfs_store_job_t *)b)->filename);
 }
 
 /*************************** MAIN ***************************/
 
 int main(int argc, char *argv[]) {
-    superblock_entry_t sb;
     int  i;
     char *imagename  = NULL;
-    char *filename   = NULL;
-    char *sourcename = NULL;
-    FILE * src_file;
-
-    diskimage_t image;
-    image.sb = &sb;
+    char *server     = NULL;
+    int  num_files   = 0;
+    int  num_sources = 0;
+    int  dir_index   = 0;
+    int  extents     = 0;
+    int  mode        = UVFS_STORE_CREATE;
+    unsigned int journal_blocks = 0;
+    double fat_cache_mb = FAT_CACHE_MB;
+    int  cache_stats = 0;
+    int  queue_depth = 1;
+    int  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    uvfs_image_t image;
+    uvfs_store_t store;
+
+    memset(&store, 0, sizeof(store));
 
 /******************* ZASTRE ***********************/
 
+    // --file/--source pairs are matched in order; a --source naming a
+    // directory with no --file of its own stores everything in it
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
             imagename = argv[i+1];
             i++;
         } else if (strcmp(argv[i], "--file") == 0 && i+1 < argc) {
-            filename = argv[i+1];
+            if (num_files == store.num_jobs)
+                uvfs_store_add(&store, NULL, NULL);
+            store.jobs[num_files++].filename = argv[i+1];
             i++;
         } else if (strcmp(argv[i], "--source") == 0 && i+1 < argc) {
-            sourcename = argv[i+1];
+            struct stat st;
+            if (num_sources == num_files && stat(argv[i+1], &st) == 0 && S_ISDIR(st.st_mode)) {
+                add_directory(&store, argv[i+1]);
+                num_files = num_sources = store.num_jobs;
+            } else {
+                if (num_sources == store.num_jobs)
+                    uvfs_store_add(&store, NULL, NULL);
+                store.jobs[num_sources++].sourcename = argv[i+1];
+            }
+            i++;
+        } else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc) {
+            read_manifest(&store, argv[i+1]);
+            num_files = num_sources = store.num_jobs;
+            i++;
+        } else if (strcmp(argv[i], "--append") == 0) {
+            mode = UVFS_STORE_APPEND;
+        } else if (strcmp(argv[i], "--replace") == 0) {
+            mode = UVFS_STORE_REPLACE;
+        } else if (strcmp(argv[i], "--dir-index") == 0) {
+            dir_index = 1;
+        } else if (strcmp(argv[i], "--fat-cache-mb") == 0 && i+1 < argc) {
+            fat_cache_mb = atof(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = 1;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i+1 < argc) {
+            queue_depth = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
+            server = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            num_threads = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "--extents") == 0) {
+            extents = 1;
+        } else if (strcmp(argv[i], "--journal") == 0 && i+1 < argc) {
+            journal_blocks = atoi(argv[i+1]);
             i++;
         }
     }
 
-    if (imagename == NULL || filename == NULL || sourcename == NULL) {
+    if (imagename == NULL || num_files != num_sources || num_files != store.num_jobs ||
+        (store.num_jobs == 0 && !dir_index && !journal_blocks && !extents) ||
+        (server != NULL && (store.num_jobs != 1 || dir_index || journal_blocks || extents ||
+            mode != UVFS_STORE_CREATE))) {
         fprintf(stderr, "usage: storuvfs --image <imagename> " \
             "--file <filename in image> " \
-            "--source <filename on host>\n");
+            "--source <filename on host> [--file ... --source ...]\n" \
+            "       storuvfs --image <imagename> --source <directory on host>\n" \
+            "       storuvfs --image <imagename> --batch <manifest>\n" \
+            "       [--append | --replace] [--dir-index] [--fat-cache-mb <size>] [--cache-stats] " \
+            "[--queue-depth <n>] [--threads <n>] [--journal <blocks>] [--extents]\n" \
+            "       storuvfs --image <imagename> --file <filename in image> " \
+            "--source <filename on host> --server <socket path>\n" \
+            "       --replace overwrites the file in place unless the image has a journal,\n" \
+            "       so a crash part way through can leave it half written\n");
         exit(1);
     }
+    if (num_threads < 1)
+        num_threads = 1;
+    for (i = 0; i < store.num_jobs; i++)
+        store.jobs[i].mode = mode;
 
 /********************* END Z **********************/
 
-    if( (image.f = fopen(imagename, "rb+")) == NULL )
-    {
-        fprintf(stderr, "Specified image could not be opened.\n");
-        exit(1);
-    }
+    // the server stores the data it is sent and keeps its view current
+    if (server != NULL) {
+        struct stat st;
+        int fd;
 
-    if( (src_file = fopen(sourcename, "rb+")) == NULL )
-    {
-        fprintf(stderr, "Specified source file could not be found.\n");
-    }
- 
-    image.imagename = imagename;
-    sseek(image.f, 0L, SEEK_SET);
-    // read in super block
-    sread(image.sb, sizeof(superblock_entry_t), 1, image.f);
-
-    // validate image
-    if(strncmp(image.sb->magic, FILE_SYSTEM_ID, 8) != 0)
-    {
-        fprintf(stderr, "Image did not match expected format.\n");
-        exit(1);
+        if ((fd = open(store.jobs[0].sourcename, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "Specified source file could not be found.\n");
+            exit(1);
+        }
+        uvfs_client_call(server, UVFSD_STORE, imagename, store.jobs[0].filename,
+            0, st.st_size, fd, -1, NULL);
+        close(fd);
+        free(store.jobs);
+        return 0;
     }
 
-    convertToNet(image.sb);
+    uvfs_open(&image, imagename, UVFS_RDWR);
 
-    // check file doesn't already exist
-    if(findFileOnDisk(&image, filename) != 0)
-    {
-        fprintf(stderr, "File already on specified image.\n");
-        exit(1);
+    // metadata changes from here on are journalled
+    if(journal_blocks)
+        uvfs_journal_create(&image, journal_blocks);
+
+    // and give every file an extent map before storing anything
+    if(extents) {
+        uvfs_store_t convert;
+
+        memset(&convert, 0, sizeof(convert));
+        uvfs_store_load(&convert, &image, fat_cache_mb * (1 << 20), queue_depth);
+        uvfs_store_extents(&convert);
+        uvfs_store_destroy(&convert);
     }
 
-    write_file_to_image(&image, filename, src_file);
+    if(store.num_jobs > 0 || dir_index) {
+        uvfs_store_load(&store, &image, fat_cache_mb * (1 << 20), queue_depth);
+        store.num_threads = num_threads;
+        uvfs_store_run(&store, dir_index);
+
+        if(cache_stats)
+            fprintf(stderr, "FAT cache: %lu hits, %lu misses\n", store.fat.hits, store.fat.misses);
 
-    return 0; 
+        uvfs_store_destroy(&store);
+    }
+    uvfs_close(&image);
+
+    return 0;
 }
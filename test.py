@@ -2,11 +2,17 @@
 
 # git stash && git pull && make && chmod 700 test.py && ./test.py
 
+import json
+import fcntl
 import os
+import re
+import resource
 import sys
 import shutil
+import struct
 import unittest
 import subprocess
+import time
 
 ################################################################################
 # CONFIGURATION
@@ -21,6 +27,11 @@ statuvfs = "./statuvfs"
 lsuvfs   = "./lsuvfs"
 catuvfs  = "./catuvfs"
 storuvfs = "./storuvfs"
+rmuvfs   = "./rmuvfs"
+uvfsextract = "./uvfsextract"
+uvfsd    = "./uvfsd"
+uvfsdefrag = "./uvfsdefrag"
+uvfsck   = "./uvfsck"
 # set to false if the diff output is not enough to figure out why a test
 # is failing
 cleanup = True
@@ -113,6 +124,23 @@ class TestUvfs(unittest.TestCase):
                 stdout=fnull, stderr=fnull
             ))
 
+    def test_statuvfs_bench(self):
+        output = subprocess.check_output(
+            [statuvfs, '--image', imageDir + '/disk03.img', '--bench']
+        ).decode()
+        self.assertIn('Entries/s', output)
+        self.assertIn('scalar', output)
+
+    def test_statuvfs_verify_summary_after_store(self):
+        image = testDir + '/disk04X.img'
+        shutil.copy(imageDir + '/disk04X.img', image)
+        subprocess.call([storuvfs, '--image', image, '--file', 'verify_digits.txt',
+            '--source', imageDir + '/originals/digits.txt'])
+        output = subprocess.check_output(
+            [statuvfs, '--image', image, '--verify']
+        ).decode()
+        self.assertIn('matches FAT', output)
+
     def lsuvfs_test(self, image, index=None):
         with open(imageDir + '/LS_output.txt') as file:
             source = (file
@@ -207,6 +235,83 @@ class TestUvfs(unittest.TestCase):
     def test_catuvfs_disk05_sonnet018(self):
         self.catuvfs_test('disk05.img', 'sonnet018.txt')
 
+    def catuvfs_range_test(self, image, filename, offset, length, index=None):
+        with open(imageDir + '/originals/' + filename, 'rb') as file:
+            expected = file.read()[offset:offset + length]
+        args = [catuvfs, '--image', imageDir + '/' + image, '--file', filename,
+            '--offset', str(offset), '--length', str(length)]
+        if index is not None:
+            args += ['--index', index]
+        self.assertEqual(expected, subprocess.check_output(args))
+
+    def test_catuvfs_disk05_macbeth_range(self):
+        self.catuvfs_range_test('disk05.img', 'macbeth.txt', 50000, 1234)
+    def test_catuvfs_disk05_random01_tail(self):
+        self.catuvfs_range_test('disk05.img', 'random01.bin', 314000, 1000)
+    def test_catuvfs_disk05_random01_range_cached_index(self):
+        index = testDir + '/random01.uvix'
+        self.catuvfs_range_test('disk05.img', 'random01.bin', 4096, 70000, index)
+        self.assertTrue(os.path.isfile(index))
+        self.catuvfs_range_test('disk05.img', 'random01.bin', 200000, 513, index)
+    def test_catuvfs_disk05_random01_corrupt_index(self):
+        index = testDir + '/random01.uvix'
+        self.catuvfs_range_test('disk05.img', 'random01.bin', 0, 1000, index)
+        # the key still matches, the last extent no longer does
+        with open(index, 'r+b') as file:
+            data = bytearray(file.read())
+            start, length = struct.unpack('=II', data[-8:])
+            data[-8:] = struct.pack('=II', start + 1, length)
+            file.seek(0)
+            file.write(data)
+        self.catuvfs_range_test('disk05.img', 'random01.bin', 300000, 14000, index)
+
+    def test_catuvfs_disk05_broken_chain(self):
+        image = testDir + '/disk05.img'
+        shutil.copy(imageDir + '/disk05.img', image)
+        with open(image, 'rb') as file:
+            data = file.read()
+        bs, _, fat, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+        for i in range(dir_blocks * bs // 64):
+            de = data[dir_start * bs + i * 64:dir_start * bs + (i + 1) * 64]
+            if de[0] != 0 and de[27:58].rstrip(b'\x00') == b'macbeth.txt':
+                start = struct.unpack('>I', de[1:5])[0]
+        # a free or reserved mark inside the chain ends the read, rather
+        # than being followed to the superblock and FAT
+        for mark in [0, 1]:
+            with open(image, 'r+b') as file:
+                file.seek(fat * bs + 4 * start)
+                file.write(struct.pack('>I', mark))
+            proc = subprocess.Popen([catuvfs, '--image', image, '--file', 'macbeth.txt'],
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            out, err = proc.communicate()
+            self.assertEqual(1, proc.returncode)
+            self.assertEqual(b'', out)
+            self.assertEqual(b'Corrupt FAT chain.\n', err)
+
+    def test_catuvfs_disk05_cache_stats(self):
+        with open(imageDir + '/originals/macbeth.txt', 'rb') as file:
+            expected = file.read()
+        # every page of the file is counted, whichever way it is read
+        for queue in [[], ['--queue-depth', '4']]:
+            proc = subprocess.Popen([catuvfs, '--image', imageDir + '/disk05.img',
+                '--file', 'macbeth.txt', '--cache-stats'] + queue,
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            out, err = proc.communicate()
+            self.assertEqual(expected, out)
+            hits, misses = re.match(r'^Cache: (\d+) hits, (\d+) misses', err.decode()).groups()
+            self.assertGreaterEqual(int(hits) + int(misses), len(expected) // 4096)
+
+    def catuvfs_queued_test(self, image, filename, depth):
+        with open(imageDir + '/originals/' + filename, 'rb') as file:
+            self.assertEqual(file.read(), subprocess.check_output([catuvfs,
+                '--image', imageDir + '/' + image, '--file', filename,
+                '--queue-depth', str(depth)]))
+
+    def test_catuvfs_disk05_random01_queued(self):
+        self.catuvfs_queued_test('disk05.img', 'random01.bin', 8)
+    def test_catuvfs_disk05_macbeth_queued(self):
+        self.catuvfs_queued_test('disk05.img', 'macbeth.txt', 3)
+
     def test_catuvfs_exit_1_no_args(self):
         with open(os.devnull, 'w') as fnull:
             self.assertEqual(1, subprocess.call(
@@ -231,6 +336,53 @@ class TestUvfs(unittest.TestCase):
                 stdout=fnull, stderr=fnull
             ))
 
+    def uvfsextract_test(self, image, threads):
+        dest = testDir + '/extract_' + str(threads)
+        self.assertEqual(0, subprocess.call([uvfsextract,
+            '--image', imageDir + '/' + image,
+            '--dir', dest,
+            '--threads', str(threads)
+        ]))
+        names = sorted(os.listdir(dest))
+        self.assertIn('macbeth.txt', names)
+        for name in names:
+            with open(dest + '/' + name, 'rb') as file:
+                self.assertEqual(subprocess.check_output(
+                    [catuvfs, '--image', imageDir + '/' + image, '--file', name]
+                ), file.read())
+
+    def test_uvfsextract_disk05_one_thread(self):
+        self.uvfsextract_test('disk05.img', 1)
+    def test_uvfsextract_disk05_threads(self):
+        self.uvfsextract_test('disk05.img', 8)
+
+    def test_uvfsextract_many_files(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        manifest = testDir + '/manifest'
+        with open(manifest, 'w') as file:
+            for i in range(200):
+                file.write('d/f%03d.txt %s/originals/digits_short.txt\n' % (i, imageDir))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--batch', manifest]))
+        # more files than the extract may hold open at once
+        def limit():
+            resource.setrlimit(resource.RLIMIT_NOFILE, (64, 64))
+        dest = testDir + '/many'
+        self.assertEqual(0, subprocess.call([uvfsextract, '--image', image, '--dir', dest,
+            '--threads', '4'], preexec_fn=limit))
+        with open(imageDir + '/originals/digits_short.txt', 'rb') as file:
+            expected = file.read()
+        self.assertEqual(200, len(os.listdir(dest + '/d')))
+        for name in os.listdir(dest + '/d'):
+            with open(dest + '/d/' + name, 'rb') as file:
+                self.assertEqual(expected, file.read())
+
+    def test_uvfsextract_exit_1_no_args(self):
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(1, subprocess.call(
+                [uvfsextract], stdout=fnull, stderr=fnull
+            ))
+
     def storuvfs_test(self, image, filename, source=None):
         if source is None:
             source = imageDir + '/originals/' + filename
@@ -287,6 +439,700 @@ class TestUvfs(unittest.TestCase):
     def test_storuvfs_disk05X_sonnet018(self):
         self.storuvfs_test('disk05X.img', 'sonnet018.txt')
 
+    def test_storuvfs_dir_index(self):
+        image = testDir + '/disk03X.img'
+        shutil.copy(imageDir + '/disk03X.img', image)
+        self.assertEqual(0, subprocess.call(
+            [storuvfs, '--image', image, '--dir-index']
+        ))
+        for name in ['digits_short.txt', 'alphabet_short.txt']:
+            source = imageDir + '/originals/' + name
+            subprocess.call([storuvfs, '--image', image, '--file', name,
+                '--source', source])
+            with open(source, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output(
+                    [catuvfs, '--image', image, '--file', name]
+                ))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(1, subprocess.call(
+                [storuvfs, '--image', image, '--file', 'digits_short.txt',
+                    '--source', './test.py'],
+                stdout=fnull, stderr=fnull
+            ))
+            self.assertEqual(1, subprocess.call(
+                [catuvfs, '--image', image, '--file', 'digits.txt'],
+                stdout=fnull, stderr=fnull
+            ))
+
+    def test_storuvfs_large_image(self):
+        # sparse image whose only free blocks lie past 4 GiB
+        bs, num_blocks, first_free = 4096, 1600000, 1100000
+        fat_blocks = (num_blocks * 4 + bs - 1) // bs
+        image = testDir + '/large.img'
+        with open(image, 'wb') as file:
+            file.write(struct.pack('>8sHIIIII', b'uvicfs17', bs, num_blocks,
+                1, fat_blocks, 1 + fat_blocks, 1))
+            file.seek(bs)
+            file.write(struct.pack('>I', 1) * first_free)
+            file.truncate(num_blocks * bs)
+        name = 'random01.bin'
+        with open(imageDir + '/originals/' + name, 'rb') as file:
+            expected = file.read()
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', name, '--source', imageDir + '/originals/' + name]))
+        self.assertEqual(expected, subprocess.check_output(
+            [catuvfs, '--image', image, '--file', name]))
+        self.assertEqual(0, subprocess.call([uvfsextract, '--image', image,
+            '--dir', testDir + '/large']))
+        with open(testDir + '/large/' + name, 'rb') as file:
+            self.assertEqual(expected, file.read())
+
+    def test_storuvfs_large_file_threads(self):
+        # past the size copied by threads, ending mid block
+        bs, num_blocks = 4096, 40000
+        fat_blocks = (num_blocks * 4 + bs - 1) // bs
+        image = testDir + '/threads.img'
+        with open(image, 'wb') as file:
+            file.write(struct.pack('>8sHIIIII', b'uvicfs17', bs, num_blocks,
+                1, fat_blocks, 1 + fat_blocks, 1))
+            file.seek(bs)
+            file.write(struct.pack('>I', 1) * (2 + fat_blocks))
+            file.truncate(num_blocks * bs)
+        source = testDir + '/large.bin'
+        expected = os.urandom((70 << 20) + 123)
+        with open(source, 'wb') as file:
+            file.write(expected)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'large.bin', '--source', source, '--threads', '4']))
+        self.assertEqual(expected, subprocess.check_output(
+            [catuvfs, '--image', image, '--file', 'large.bin']))
+
+    def test_storuvfs_append(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        with open(imageDir + '/originals/digits.txt', 'rb') as file:
+            expected = file.read()
+        # empty, within the last block, filling it exactly, and spilling
+        for size in [0, 1, 100, 4000]:
+            piece = os.urandom(size)
+            with open(testDir + '/piece', 'wb') as file:
+                file.write(piece)
+            expected += piece
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--append',
+                '--file', 'digits.txt', '--source', testDir + '/piece']))
+        self.assertEqual(expected, subprocess.check_output(
+            [catuvfs, '--image', image, '--file', 'digits.txt']))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+            self.assertEqual(1, subprocess.call([storuvfs, '--image', image, '--append',
+                '--file', 'missing.txt', '--source', testDir + '/piece'], stderr=fnull))
+
+    def test_storuvfs_append_empty(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        open(testDir + '/piece', 'wb').close()
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'e.txt', '--source', testDir + '/piece']))
+        # an empty file's one block is all room, then the rest spills over
+        expected = b''
+        for size in [6, 1000]:
+            piece = os.urandom(size)
+            with open(testDir + '/piece', 'wb') as file:
+                file.write(piece)
+            expected += piece
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--append',
+                '--file', 'e.txt', '--source', testDir + '/piece']))
+            self.assertEqual(expected, subprocess.check_output(
+                [catuvfs, '--image', image, '--file', 'e.txt']))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+
+    def test_storuvfs_replace(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        # growing past the old chain, shrinking within it, and a new name
+        for name, size in [('digits.txt', 30000), ('digits.txt', 700), ('fresh.txt', 10)]:
+            data = os.urandom(size)
+            with open(testDir + '/piece', 'wb') as file:
+                file.write(data)
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--replace',
+                '--file', name, '--source', testDir + '/piece']))
+            self.assertEqual(data, subprocess.check_output(
+                [catuvfs, '--image', image, '--file', name]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+
+    def test_storuvfs_fat_writeback(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        def fat_blocks():
+            with open(image, 'rb') as file:
+                data = file.read()
+            bs, _, fat, fat_blocks, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+            starts = {}
+            for i in range(dir_blocks * bs // 64):
+                de = data[dir_start * bs + i * 64:dir_start * bs + (i + 1) * 64]
+                if de[0] != 0:
+                    starts[de[27:58].rstrip(b'\x00')] = struct.unpack('>I', de[1:5])[0]
+            return [data[(fat + b) * bs:(fat + b + 1) * bs] for b in range(fat_blocks)], bs, starts
+        before, bs, _ = fat_blocks()
+        with open(testDir + '/piece', 'wb') as file:
+            file.write(b'one block')
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'tiny.txt', '--source', testDir + '/piece']))
+
+        # a one block file changes one FAT entry, and only its block is written
+        after, _, starts = fat_blocks()
+        touched = starts[b'tiny.txt'] * 4 // bs
+        self.assertNotEqual(before[touched], after[touched])
+        self.assertEqual(before[:touched] + before[touched + 1:], after[:touched] + after[touched + 1:])
+
+    def test_storuvfs_best_fit(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        # holes of 4, 2 and 6 blocks between files that stay
+        for i, blocks in enumerate([4, 1, 2, 1, 6, 1]):
+            with open(testDir + '/piece', 'wb') as file:
+                file.write(os.urandom(blocks * 512))
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', 'h%d' % i, '--source', testDir + '/piece']))
+        for i in [0, 2, 4]:
+            self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'h%d' % i]))
+
+        def layout():
+            with open(image, 'rb') as file:
+                data = file.read()
+            bs, nb, fat, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+            table = struct.unpack('>%dI' % nb, data[fat * bs:fat * bs + 4 * nb])
+            runs, b = [], 0
+            while b < nb:
+                n = 0
+                while b + n < nb and table[b + n] == 0:
+                    n += 1
+                if n > 0:
+                    runs.append((n, b))
+                b += n + 1
+            starts = {}
+            for i in range(dir_blocks * bs // 64):
+                de = data[dir_start * bs + i * 64:dir_start * bs + (i + 1) * 64]
+                if de[0] != 0:
+                    starts[de[27:58].rstrip(b'\x00')] = struct.unpack('>I', de[1:5])[0]
+            return table, runs, starts
+
+        # each file goes whole into the smallest run that holds it
+        for name, blocks in [(b'fit3', 3), (b'fit2', 2), (b'fit5', 5)]:
+            _, runs, _ = layout()
+            expected = min(run for run in runs if run[0] >= blocks)[1]
+            data = os.urandom(blocks * 512)
+            with open(testDir + '/piece', 'wb') as file:
+                file.write(data)
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', name.decode(), '--source', testDir + '/piece']))
+            table, _, starts = layout()
+            chain = [starts[name]]
+            while table[chain[-1]] != 0xffffffff:
+                chain.append(table[chain[-1]])
+            self.assertEqual(list(range(expected, expected + blocks)), chain)
+            self.assertEqual(data, subprocess.check_output(
+                [catuvfs, '--image', image, '--file', name.decode()]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+
+    def test_rmuvfs(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--dir-index']))
+        before = subprocess.check_output([statuvfs, '--image', image])
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'extra.txt', '--source', imageDir + '/originals/digits.txt']))
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'extra.txt']))
+        # the blocks come back and the name is gone, from the table too
+        self.assertEqual(before, subprocess.check_output([statuvfs, '--image', image]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+            self.assertEqual(1, subprocess.call([catuvfs, '--image', image, '--file', 'extra.txt'],
+                stderr=fnull))
+            self.assertEqual(1, subprocess.call([rmuvfs, '--image', image, '--file', 'extra.txt'],
+                stderr=fnull))
+        self.assertNotIn(b'extra.txt', subprocess.check_output([lsuvfs, '--image', image]))
+
+    def test_storuvfs_subdirectories(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = imageDir + '/originals/digits.txt'
+        # enough names to split the 256 byte blocks' nodes a few levels deep
+        names = ['f%03d' % i for i in range(40)]
+        args = []
+        for name in reversed(names):
+            args += ['--file', 'a/b/' + name, '--source', source]
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image] + args))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--file', 'a/c.txt',
+            '--source', source, '--dir-index']))
+        with open(source, 'rb') as file:
+            data = file.read()
+        for name in ['a/b/f000', 'a/b/f021', 'a/b/f039', 'a/c.txt']:
+            self.assertEqual(data, subprocess.check_output([catuvfs, '--image', image, '--file', name]))
+        listing = subprocess.check_output([lsuvfs, '--image', image, '--dir', 'a/b']).split(b'\n')[:-1]
+        self.assertEqual([name.encode() for name in names], [line.split()[-1] for line in listing])
+        self.assertIn(b' a\n', subprocess.check_output([lsuvfs, '--image', image]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+            self.assertEqual(1, subprocess.call([storuvfs, '--image', image, '--file', 'a/b/f007',
+                '--source', source], stderr=fnull))
+            self.assertEqual(1, subprocess.call([storuvfs, '--image', image, '--file', 'a/c.txt/d',
+                '--source', source], stderr=fnull))
+            self.assertEqual(1, subprocess.call([catuvfs, '--image', image, '--file', 'a/b'],
+                stderr=fnull))
+
+    def test_rmuvfs_directory(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = imageDir + '/originals/digits.txt'
+        before = subprocess.check_output([statuvfs, '--image', image])
+        args = []
+        for i in range(12):
+            args += ['--file', 'd/e/f%d' % i, '--source', source]
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image] + args))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(1, subprocess.call([rmuvfs, '--image', image, '--file', 'd'],
+                stderr=fnull))
+        # contents named first go in the same run as their directory
+        args = []
+        for i in range(12):
+            args += ['--file', 'd/e/f%d' % i]
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image] + args + ['--file', 'd/e', '--file', 'd']))
+        self.assertEqual(before, subprocess.check_output([statuvfs, '--image', image]))
+        self.assertNotIn(b' d\n', subprocess.check_output([lsuvfs, '--image', image]))
+
+    def test_storuvfs_extents(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = imageDir + '/originals/digits.txt'
+        names = subprocess.check_output([lsuvfs, '--image', image]).split(b'\n')[:-1]
+        names = [line.split()[-1].decode() for line in names]
+        before = [subprocess.check_output([catuvfs, '--image', image, '--file', name]) for name in names]
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--extents']))
+        converted = subprocess.check_output([statuvfs, '--image', image])
+        self.assertIn(b'uvicfs18', converted)
+        self.assertEqual(before, [subprocess.check_output([catuvfs, '--image', image, '--file', name])
+            for name in names])
+        with open(source, 'rb') as file:
+            data = file.read()
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--file', 'x/y.txt',
+            '--source', source]))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--append', '--file', 'x/y.txt',
+            '--source', source, '--file', names[0], '--source', source]))
+        self.assertEqual(data * 2, subprocess.check_output([catuvfs, '--image', image, '--file', 'x/y.txt']))
+        self.assertEqual(before[0] + data, subprocess.check_output([catuvfs, '--image', image,
+            '--file', names[0]]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'], stdout=fnull))
+        # the maps go with their files
+        original = testDir + '/extents-original'
+        with open(original, 'wb') as file:
+            file.write(before[0])
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'x/y.txt', '--file', 'x']))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--replace', '--file', names[0],
+            '--source', original]))
+        self.assertEqual(converted, subprocess.check_output([statuvfs, '--image', image]))
+
+    def test_uvfsdefrag(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = imageDir + '/originals/alphabet.txt'
+        with open(source, 'rb') as file:
+            data = file.read()
+        # appending to files in turn interleaves their blocks
+        names = ['frag%d' % i for i in range(6)] + ['d/frag6']
+        args = []
+        for name in names:
+            args += ['--file', name, '--source', source]
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image] + args))
+        for i in range(4):
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--append'] + args))
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'frag2']))
+        before = subprocess.check_output([statuvfs, '--image', image])
+        plan = subprocess.check_output([uvfsdefrag, '--image', image, '--dry-run'])
+        self.assertIn(b'Extents: 34 before, 10 after', plan)
+        self.assertEqual(before, subprocess.check_output([statuvfs, '--image', image]))
+        self.assertEqual(plan.replace(b'Would move', b'Moved'),
+            subprocess.check_output([uvfsdefrag, '--image', image]))
+        for name in names[:2] + names[3:]:
+            self.assertEqual(data * 5, subprocess.check_output([catuvfs, '--image', image, '--file', name]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'], stdout=fnull))
+        self.assertIn(b'Would move 0 of 10 files', subprocess.check_output([uvfsdefrag, '--image', image,
+            '--dry-run']))
+
+    def test_uvfsck(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        self.assertEqual(b'No problems found.\n', subprocess.check_output([uvfsck, '--image', image]))
+        with open(image, 'r+b') as file:
+            data = bytearray(file.read())
+            bs, nb, fat, _, dir_start, _ = struct.unpack('>HIIIII', data[8:30])
+            def entry(i):
+                return dir_start * bs + 64 * i
+            def fat_entry(b):
+                return struct.unpack('>I', data[fat * bs + 4 * b:fat * bs + 4 * b + 4])[0]
+            starts = [struct.unpack('>I', data[entry(i) + 1:entry(i) + 5])[0] for i in range(4)]
+            # a leaked block, alphabet_short.txt starting inside alphabet.txt,
+            # and digits_short.txt owning up to a block it does not have
+            data[fat * bs + 4 * (nb - 10):fat * bs + 4 * (nb - 9)] = struct.pack('>I', 0xffffffff)
+            data[entry(0) + 1:entry(0) + 5] = struct.pack('>I', fat_entry(starts[1]))
+            data[entry(2) + 5:entry(2) + 9] = struct.pack('>I', 2)
+            file.seek(0)
+            file.write(data)
+        proc = subprocess.Popen([uvfsck, '--image', image, '--threads', '4'], stdout=subprocess.PIPE)
+        report = proc.communicate()[0]
+        self.assertEqual(1, proc.returncode)
+        self.assertIn(b'alphabet_short.txt and alphabet.txt share block %d' % fat_entry(starts[1]), report)
+        self.assertIn(b'digits_short.txt: chain is 1 blocks, entry says 2', report)
+        self.assertIn(b'Block %d: allocated to nothing' % (nb - 10), report)
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([uvfsck, '--image', image, '--repair'], stdout=fnull))
+        self.assertEqual(b'No problems found.\n', subprocess.check_output([uvfsck, '--image', image]))
+        for name in ['alphabet.txt', 'digits_short.txt', 'digits.txt']:
+            with open(imageDir + '/originals/' + name, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output([catuvfs, '--image', image, '--file', name]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'], stdout=fnull))
+
+    def test_storuvfs_claim_slots(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'd/x', '--source', imageDir + '/originals/digits_short.txt']))
+        with open(image, 'rb') as file:
+            data = file.read()
+        bs, _, _, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+        for i in range(dir_blocks * bs // 64):
+            if data[dir_start * bs + i * 64] == 2:
+                root = struct.unpack('>I', data[dir_start * bs + i * 64 + 1:dir_start * bs + i * 64 + 5])[0]
+        def slot(name):
+            hash = 2166136261
+            for c in name:
+                hash = ((hash ^ c) * 16777619) & 0xffffffff
+            return (1 << 60) + 1 + (1 << 32) + ((root & 0x3fffffff) << 32 | hash)
+
+        # the two names' checksums agree in their low 24 bits; a store
+        # holding one leaves the other free
+        with open(image, 'r+b') as file:
+            fcntl.lockf(file, fcntl.LOCK_EX | fcntl.LOCK_NB, 1, slot(b'f28164.txt'))
+            with open(os.devnull, 'w') as fnull:
+                self.assertEqual(1, subprocess.call([storuvfs, '--image', image,
+                    '--file', 'd/f28164.txt', '--source', imageDir + '/originals/digits_short.txt'],
+                    stderr=fnull))
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', 'd/f69000.txt', '--source', imageDir + '/originals/digits_short.txt']))
+        with open(imageDir + '/originals/digits_short.txt', 'rb') as file:
+            self.assertEqual(file.read(), subprocess.check_output(
+                [catuvfs, '--image', image, '--file', 'd/f69000.txt']))
+
+    def test_uvfsck_damaged_dir(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        for name in ['d/f1', 'd/f2', 'd/f3', 'd/e/g']:
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', name, '--source', imageDir + '/originals/digits.txt']))
+        with open(image, 'r+b') as file:
+            data = file.read()
+            bs, _, _, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+            for i in range(dir_blocks * bs // 64):
+                if data[dir_start * bs + i * 64] == 2:
+                    root = struct.unpack('>I', data[dir_start * bs + i * 64 + 1:dir_start * bs + i * 64 + 5])[0]
+            file.seek(root * bs)
+            file.write(b'xxxx')
+
+        # reported, and what it holds is not taken for leaked blocks
+        for args in [[], ['--repair']]:
+            proc = subprocess.Popen([uvfsck, '--image', image] + args, stdout=subprocess.PIPE)
+            report = proc.communicate()[0]
+            self.assertEqual(1, proc.returncode)
+            self.assertIn(b'd: directory is damaged', report)
+            self.assertNotIn(b'allocated to nothing', report)
+        with open(image, 'r+b') as file:
+            file.seek(root * bs)
+            file.write(b'uvdn')
+        self.assertEqual(b'No problems found.\n', subprocess.check_output([uvfsck, '--image', image]))
+        with open(imageDir + '/originals/digits.txt', 'rb') as file:
+            self.assertEqual(file.read(), subprocess.check_output([catuvfs, '--image', image, '--file', 'd/e/g']))
+
+    def dir_cycle_image(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        for name in ['d/f1', 'd/f2', 'd/f3']:
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', name, '--source', imageDir + '/originals/digits.txt']))
+        with open(image, 'r+b') as file:
+            data = bytearray(file.read())
+            bs, _, _, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+            for i in range(dir_blocks * bs // 64):
+                if data[dir_start * bs + i * 64] == 2:
+                    root = struct.unpack('>I', data[dir_start * bs + i * 64 + 1:dir_start * bs + i * 64 + 5])[0]
+            def find(block, name):
+                level, count = struct.unpack('>HH', data[block * bs + 4:block * bs + 8])
+                for r in range(block * bs + 64, block * bs + 64 * (count + 1), 64):
+                    if level > 0:
+                        found = find(struct.unpack('>I', data[r + 1:r + 5])[0], name)
+                        if found:
+                            return found
+                    elif data[r + 27:r + 58].rstrip(b'\x00') == name:
+                        return r
+            # d/f1 becomes a directory whose tree is d's own
+            record = find(root, b'f1')
+            data[record:record + 5] = struct.pack('>BI', 2, root)
+            file.seek(0)
+            file.write(data)
+        return image
+
+    def test_dir_cycle_tools(self):
+        image = self.dir_cycle_image()
+        # walks down the tree stop at the loop instead of following it
+        for args in [[statuvfs, '--image', image, '--layout'],
+                [uvfsdefrag, '--image', image, '--dry-run'],
+                [uvfsextract, '--image', image, '--dir', testDir + '/cycle'],
+                [storuvfs, '--image', image, '--extents']]:
+            proc = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+            err = proc.communicate()[1]
+            self.assertEqual(1, proc.returncode)
+            self.assertEqual(b'Specified directory is damaged.\n', err)
+
+    def test_uvfsck_dir_cycle(self):
+        image = self.dir_cycle_image()
+        proc = subprocess.Popen([uvfsck, '--image', image], stdout=subprocess.PIPE)
+        report = proc.communicate()[0]
+        self.assertEqual(1, proc.returncode)
+        self.assertIn(b'd/f1: directory is d again', report)
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([uvfsck, '--image', image, '--repair'], stdout=fnull))
+        self.assertEqual(b'No problems found.\n', subprocess.check_output([uvfsck, '--image', image]))
+        with open(imageDir + '/originals/digits.txt', 'rb') as file:
+            self.assertEqual(file.read(), subprocess.check_output([catuvfs, '--image', image, '--file', 'd/f2']))
+
+    def test_statuvfs_layout(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = imageDir + '/originals/alphabet.txt'
+        args = []
+        for name in ['frag0', 'frag1', 'frag2', 'd/frag3']:
+            args += ['--file', name, '--source', source]
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image] + args))
+        for i in range(2):
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--append'] + args))
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'frag1']))
+        report = subprocess.check_output([statuvfs, '--image', image, '--layout'])
+        self.assertIn(b'       3      80  d/frag3\n', report)
+        self.assertIn(b'        16-31              3\n', report)
+        self.assertIn(b'Fragmentation: 1.8% (13 extents in 7 files)\n', report)
+        layout = json.loads(subprocess.check_output([statuvfs, '--image', image, '--json']).decode())
+        self.assertEqual([3, 3, 3], [f['extents'] for f in layout['files'] if 'frag' in f['path']])
+        self.assertEqual(4, layout['free_extents'])
+        self.assertEqual(layout['free_blocks'], layout['largest_free_run'] + 80)
+        self.assertAlmostEqual(6 / 334, layout['fragmentation'], places=4)
+
+    def test_statuvfs_layout_damaged_chain(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        # free the start block of alphabet.txt
+        with open(image, 'r+b') as file:
+            disk = bytearray(file.read())
+            bs, _, fat, _, dir_start, dir_blocks = struct.unpack('>HIIIII', disk[8:30])
+            entries = [e for e in range(dir_start * bs, (dir_start + dir_blocks) * bs, 64)
+                if disk[e + 27:e + 40] == b'alphabet.txt\0']
+            self.assertEqual(1, len(entries))
+            start = struct.unpack('>I', disk[entries[0] + 1:entries[0] + 5])[0]
+            disk[fat * bs + start * 4:fat * bs + start * 4 + 4] = struct.pack('>I', 0)
+            file.seek(0)
+            file.write(disk)
+        process = subprocess.run([statuvfs, '--image', image, '--layout'], stdout=subprocess.PIPE)
+        self.assertEqual(0, process.returncode)
+        self.assertRegex(process.stdout, rb'\n       -  +\d+  alphabet.txt \(chain damaged\)\n')
+        self.assertIn(b'Damaged chains: 1 files, not scored\n', process.stdout)
+        self.assertIn(b'Fragmentation: ', process.stdout)
+        layout = json.loads(subprocess.check_output([statuvfs, '--image', image, '--json']).decode())
+        files = {f['path']: f for f in layout['files']}
+        self.assertTrue(files['alphabet.txt']['damaged'])
+        self.assertIsNone(files['alphabet.txt']['extents'])
+        self.assertTrue(len(files) > 1)
+        self.assertTrue(all(not f['damaged'] for p, f in files.items() if p != 'alphabet.txt'))
+        self.assertEqual(1, layout['damaged_files'])
+
+    def test_uvfsdefrag_cached_index(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        source = testDir + '/big.txt'
+        index = testDir + '/big.uvix'
+        with open(imageDir + '/originals/digits.txt', 'rb') as file:
+            data = file.read()[:700]
+        with open(source, 'wb') as file:
+            file.write(data)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--file', 'big.txt', '--source', source]))
+        # spread big.txt's three blocks out as S, S+2, S+4
+        with open(image, 'r+b') as file:
+            disk = bytearray(file.read())
+            bs, _, fat, _, dir_start, _ = struct.unpack('>HIIIII', disk[8:30])
+            entry = dir_start * bs + 64 * 4
+            self.assertEqual(b'big.txt', bytes(disk[entry + 27:entry + 34]))
+            start = struct.unpack('>I', disk[entry + 1:entry + 5])[0]
+            blocks = [bytes(disk[(start + i) * bs:(start + i + 1) * bs]) for i in range(3)]
+            for i, (block, next) in enumerate([(start, start + 2), (start + 2, start + 4),
+                    (start + 4, 0xffffffff), (start + 1, 0), (start + 3, 0)]):
+                if i < 3:
+                    disk[block * bs:(block + 1) * bs] = blocks[i]
+                disk[fat * bs + 4 * block:fat * bs + 4 * block + 4] = struct.pack('>I', next)
+            file.seek(0)
+            file.write(disk)
+        args = [catuvfs, '--image', image, '--file', 'big.txt', '--index', index]
+        self.assertEqual(data, subprocess.check_output(args))
+        self.assertIn(b'Moved 1 of 5 files', subprocess.check_output([uvfsdefrag, '--image', image]))
+        self.assertEqual(data, subprocess.check_output(args))
+
+    def storuvfs_batch_test(self, image, args, names):
+        shutil.copy(imageDir + '/' + image, testDir + '/' + image)
+        image = testDir + '/' + image
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image] + args))
+        for name in names:
+            with open(imageDir + '/originals/' + name, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output(
+                    [catuvfs, '--image', image, '--file', name]
+                ))
+
+    def test_storuvfs_batch_manifest(self):
+        names = ['sonnet116.txt', 'graphic01.jpg', 'random01.bin']
+        manifest = testDir + '/manifest'
+        with open(manifest, 'w') as file:
+            file.write('# name source\n')
+            for name in names:
+                file.write(name + ' ' + imageDir + '/originals/' + name + '\n')
+        self.storuvfs_batch_test('disk05X.img', ['--batch', manifest], names)
+    def test_storuvfs_batch_pairs(self):
+        names = ['digits.txt', 'alphabet.txt']
+        args = []
+        for name in names:
+            args += ['--file', name, '--source', imageDir + '/originals/' + name]
+        self.storuvfs_batch_test('disk04X.img', args, names)
+    def test_storuvfs_batch_directory(self):
+        self.storuvfs_batch_test('disk05X.img',
+            ['--source', imageDir + '/originals'],
+            sorted(os.listdir(imageDir + '/originals')))
+
+    def test_storuvfs_batch_small_fat_cache(self):
+        # a two-block FAT cache forces write-back on eviction
+        self.storuvfs_batch_test('disk05X.img',
+            ['--source', imageDir + '/originals', '--fat-cache-mb', '0.001'],
+            sorted(os.listdir(imageDir + '/originals')))
+
+    def test_storuvfs_batch_queued(self):
+        self.storuvfs_batch_test('disk05X.img',
+            ['--source', imageDir + '/originals', '--queue-depth', '8'],
+            sorted(os.listdir(imageDir + '/originals')))
+
+    def test_storuvfs_concurrent(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        names = sorted(os.listdir(imageDir + '/originals'))
+        stores = [subprocess.Popen([storuvfs, '--image', image, '--file', name,
+            '--source', imageDir + '/originals/' + name]) for name in names]
+        with open(os.devnull, 'w') as fnull:
+            # racing for one name: exactly one store wins
+            racers = [subprocess.Popen([storuvfs, '--image', image, '--file', 'same.txt',
+                '--source', './test.py'], stderr=fnull) for i in range(4)]
+            self.assertEqual([0] * len(names), [p.wait() for p in stores])
+            self.assertEqual(1, [p.wait() for p in racers].count(0))
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+        for name in names:
+            with open(imageDir + '/originals/' + name, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output(
+                    [catuvfs, '--image', image, '--file', name]))
+
+    def test_storuvfs_journal(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        names = sorted(os.listdir(imageDir + '/originals'))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--journal', '32']))
+        stores = [subprocess.Popen([storuvfs, '--image', image, '--file', 'journal-' + name,
+            '--source', imageDir + '/originals/' + name]) for name in names]
+        self.assertEqual([0] * len(names), [p.wait() for p in stores])
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+        for name in names:
+            with open(imageDir + '/originals/' + name, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output(
+                    [catuvfs, '--image', image, '--file', 'journal-' + name]))
+
+    def test_storuvfs_journal_replace(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--journal', '32']))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+            '--file', 'swap.txt', '--source', imageDir + '/originals/digits.txt']))
+        def start_block():
+            with open(image, 'rb') as file:
+                data = file.read()
+            bs, _, _, _, dir_start, dir_blocks = struct.unpack('>HIIIII', data[8:30])
+            for i in range(dir_blocks * bs // 64):
+                de = data[dir_start * bs + i * 64:dir_start * bs + (i + 1) * 64]
+                if de[0] != 0 and de[27:58].rstrip(b'\x00') == b'swap.txt':
+                    return struct.unpack('>I', de[1:5])[0]
+        before, counts = start_block(), subprocess.check_output([statuvfs, '--image', image])
+
+        # the new data goes to a new chain and the old one is freed, so
+        # the file never holds a mix of the two
+        with open(imageDir + '/originals/digits.txt', 'rb') as file:
+            data = bytes(reversed(file.read()))
+        with open(testDir + '/piece', 'wb') as file:
+            file.write(data)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--replace',
+            '--file', 'swap.txt', '--source', testDir + '/piece']))
+        self.assertNotEqual(before, start_block())
+        self.assertEqual(counts, subprocess.check_output([statuvfs, '--image', image]))
+        self.assertEqual(data, subprocess.check_output(
+            [catuvfs, '--image', image, '--file', 'swap.txt']))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+
+    def test_storuvfs_journal_rollback(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--journal', '32']))
+        before = subprocess.check_output([statuvfs, '--image', image])
+
+        # leave behind what a store killed mid-copy would: a claimed entry
+        # whose chain is allocated but whose data never arrived
+        with open(image, 'r+b') as file:
+            magic, bs, num_blocks, fat_start, fat_blocks, dir_start, dir_blocks = \
+                struct.unpack('>8sHIIIII', file.read(30))
+            file.seek(fat_start * bs)
+            fat = struct.unpack('>%dI' % num_blocks, file.read(num_blocks * 4))
+            chain = [i for i, entry in enumerate(fat) if entry == 0][:3]
+            for block, next in zip(chain, chain[1:] + [0xffffffff]):
+                file.seek(fat_start * bs + block * 4)
+                file.write(struct.pack('>I', next))
+            for i in range(dir_blocks * bs // 64):
+                file.seek(dir_start * bs + i * 64)
+                if file.read(1) == b'\x00':
+                    file.seek(dir_start * bs + i * 64)
+                    file.write(struct.pack('>BIII14x31s4s2x', 0, chain[0], 3, 3 * bs,
+                        b'orphan', b'uvcl'))
+                    break
+
+        # the next writable open rolls it back
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--journal', '32']))
+        self.assertEqual(before, subprocess.check_output([statuvfs, '--image', image]))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([statuvfs, '--image', image, '--verify'],
+                stdout=fnull))
+
     def test_storuvfs_exit_1_no_args(self):
         with open(os.devnull, 'w') as fnull:
             self.assertEqual(1, subprocess.call(
@@ -317,5 +1163,82 @@ class TestUvfs(unittest.TestCase):
                 stdout=fnull, stderr=fnull
             ))
 
+    def start_uvfsd(self, args):
+        sock = testDir + '/uvfsd.sock'
+        server = subprocess.Popen([uvfsd, '--socket', sock] + args)
+        self.addCleanup(server.wait)
+        self.addCleanup(server.terminate)
+        for i in range(100):
+            if os.path.exists(sock):
+                break
+            time.sleep(0.05)
+        return sock
+
+    def test_uvfsd_matches_local(self):
+        image = imageDir + '/disk04.img'
+        sock = self.start_uvfsd(['--image', image])
+        for tool in [statuvfs, lsuvfs]:
+            self.assertEqual(
+                subprocess.check_output([tool, '--image', image]),
+                subprocess.check_output([tool, '--image', image, '--server', sock]))
+        for name in ['digits.txt', 'alphabet.txt']:
+            for extra in [[], ['--offset', '700', '--length', '5000']]:
+                self.assertEqual(
+                    subprocess.check_output([catuvfs, '--image', image, '--file', name] + extra),
+                    subprocess.check_output([catuvfs, '--image', image, '--file', name,
+                        '--server', sock] + extra))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(1, subprocess.call(
+                [catuvfs, '--image', image, '--file', 'missing.txt', '--server', sock],
+                stdout=fnull, stderr=fnull))
+            self.assertEqual(1, subprocess.call(
+                [lsuvfs, '--image', imageDir + '/disk03.img', '--server', sock],
+                stdout=fnull, stderr=fnull))
+            self.assertEqual(1, subprocess.call(
+                [storuvfs, '--image', image, '--file', 'test', '--source', './test.py',
+                    '--server', sock], stdout=fnull, stderr=fnull))
+
+    def test_uvfsd_store(self):
+        image = testDir + '/disk05X.img'
+        shutil.copy(imageDir + '/disk05X.img', image)
+        sock = self.start_uvfsd(['--image', image, '--writable'])
+        names = ['sonnet116.txt', 'random01.bin']
+        for name in names:
+            self.assertEqual(0, subprocess.call([storuvfs, '--image', image,
+                '--file', 'served-' + name, '--source', imageDir + '/originals/' + name,
+                '--server', sock]))
+        for name in names:
+            with open(imageDir + '/originals/' + name, 'rb') as file:
+                self.assertEqual(file.read(), subprocess.check_output(
+                    [catuvfs, '--image', image, '--file', 'served-' + name, '--server', sock]))
+        self.assertEqual(
+            subprocess.check_output([statuvfs, '--image', image]),
+            subprocess.check_output([statuvfs, '--image', image, '--server', sock]))
+
+    def test_uvfsd_other_writers(self):
+        image = testDir + '/disk04.img'
+        shutil.copy(imageDir + '/disk04.img', image)
+        sock = self.start_uvfsd(['--image', image])
+        digits = imageDir + '/originals/digits.txt'
+        with open(digits, 'rb') as file:
+            data = file.read()
+        def served(name):
+            return subprocess.check_output([catuvfs, '--image', image, '--file', name, '--server', sock])
+        self.assertNotEqual(data, served('alphabet.txt'))
+        # stores by other processes, then a defragmenter moving their blocks
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--file', 'new.txt', '--source', digits]))
+        self.assertEqual(data, served('new.txt'))
+        self.assertEqual(0, subprocess.call([storuvfs, '--image', image, '--replace', '--file', 'alphabet.txt',
+            '--source', digits]))
+        self.assertEqual(data, served('alphabet.txt'))
+        self.assertEqual(0, subprocess.call([rmuvfs, '--image', image, '--file', 'alphabet_short.txt']))
+        with open(os.devnull, 'w') as fnull:
+            self.assertEqual(0, subprocess.call([uvfsdefrag, '--image', image], stdout=fnull))
+        for name in ['new.txt', 'alphabet.txt', 'digits.txt']:
+            self.assertEqual(data, served(name))
+        self.assertEqual(
+            subprocess.check_output([statuvfs, '--image', image]),
+            subprocess.check_output([statuvfs, '--image', image, '--server', sock]))
+
 if __name__ == '__main__':
     unittest.main()
\ No newline at end of file
@@ -0,0 +1,535 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uvfs.h"
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Opens and maps imagename, validating the superblock and the layout it
+ * describes against the size of the image. Exits on any failure.
+ */
+void uvfs_open(uvfs_image_t * image, char * imagename, int mode)
+{
+    struct stat st;
+
+    assert(image != NULL);
+    memset(image, 0, sizeof(uvfs_image_t));
+
+    image->imagename = imagename;
+    image->writable = (mode == UVFS_RDWR);
+
+    if( (image->fd = open(imagename, image->writable ? O_RDWR : O_RDONLY)) < 0 ||
+        fstat(image->fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Specified image could not be opened.\n");
+        exit(1);
+    }
+
+    if(st.st_size < sizeof(superblock_entry_t))
+    {
+        fprintf(stderr, "Image did not match expected format.\n");
+        exit(1);
+    }
+
+    // the whole image is mapped, so it must fit the address space
+    if((uint64_t)st.st_size > SIZE_MAX)
+    {
+        fprintf(stderr, "Image too large to map.\n");
+        exit(1);
+    }
+
+    image->map_len = st.st_size;
+    image->map = mmap(NULL, image->map_len, PROT_READ, MAP_SHARED, image->fd, 0);
+    if(image->map == MAP_FAILED)
+    {
+        fprintf(stderr, "Specified image could not be opened.\n");
+        exit(1);
+    }
+
+    // validate image
+    memcpy(&image->sb, image->map, sizeof(superblock_entry_t));
+    image->extent_maps = strncmp(image->sb.magic, FILE_SYSTEM_ID_EXTENTS, FILE_SYSTEM_ID_LEN) == 0;
+    if(!image->extent_maps && strncmp(image->sb.magic, FILE_SYSTEM_ID, FILE_SYSTEM_ID_LEN) != 0)
+    {
+        fprintf(stderr, "Image did not match expected format.\n");
+        exit(1);
+    }
+
+    convertToNet(&image->sb);
+
+    // FAT and root directory must lie inside the image; trailing data
+    // blocks may be missing from truncated images (see uvfs_block_bytes)
+    uint64_t bs = image->sb.block_size;
+    if(bs < MIN_BLOCK_SIZE ||
+        image->sb.fat_blocks * bs / SIZE_FAT_ENTRY < image->sb.num_blocks ||
+        ((uint64_t)image->sb.fat_start + image->sb.fat_blocks) * bs > image->map_len ||
+        ((uint64_t)image->sb.dir_start + image->sb.dir_blocks) * bs > image->map_len)
+    {
+        fprintf(stderr, "Image did not match expected format.\n");
+        exit(1);
+    }
+
+    image->fat = (const uint32_t *)(image->map + (size_t)image->sb.fat_start * bs);
+    image->dir = (const directory_entry_t *)(image->map + (size_t)image->sb.dir_start * bs);
+    image->dir_entries = image->sb.dir_blocks * (bs / SIZE_DIR_ENTRY);
+
+    // a writer finishes whatever a crashed writer left in the journal
+    if(image->writable)
+        uvfs_journal_recover(image);
+}
+
+/*
+ * Unmaps and closes image
+ */
+void uvfs_close(uvfs_image_t * image)
+{
+    if(image->map != NULL && image->map != MAP_FAILED)
+        munmap(image->map, image->map_len);
+    if(image->fd >= 0)
+        close(image->fd);
+    image->map = NULL;
+    image->fd = -1;
+}
+
+/*
+ * Locates filename in the root directory, through the persistent name
+ * table when the image has a clean one and by scanning otherwise.
+ * Returns index of its directory entry or -1 if not found.
+ */
+int uvfs_find_entry(const uvfs_image_t * image, const char * filename)
+{
+    int i;
+
+    if(uvfs_dirtable_find(image, filename, &i))
+        return i;
+
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        const directory_entry_t * de = &image->dir[i];
+
+        if(de->status == DIR_ENTRY_AVAILABLE ||
+            strncmp(de->filename, filename, DIR_FILENAME_MAX) != 0)
+            continue;
+
+        return i;
+    }
+    return -1;
+}
+
+/*
+ * Returns index of the first available directory entry or -1 if full
+ */
+int uvfs_free_entry(const uvfs_image_t * image)
+{
+    int i;
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        if(image->dir[i].status == DIR_ENTRY_AVAILABLE)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Returns byte offset of directory entry index within the image
+ */
+off_t uvfs_dir_entry_offset(const uvfs_image_t * image, int index)
+{
+    return uvfs_block_offset(image, image->sb.dir_start) + (off_t)index * SIZE_DIR_ENTRY;
+}
+
+/*
+ * Resolves the FAT chain from start_block into runs of consecutive
+ * blocks. Returns the extents in chain order (caller frees) and their
+ * number in *num_extents. Exits on chains that leave the image, loop or
+ * run into a free or reserved mark, which are not block numbers.
+ */
+uvfs_extent_t * uvfs_file_extents(const uvfs_image_t * image, unsigned int start_block, int * num_extents)
+{
+    uvfs_extent_t * extents = NULL;
+    int n = 0, cap = 0;
+    unsigned int block = start_block, steps = 0;
+
+    while(block != FAT_LASTBLOCK)
+    {
+        if(block == FAT_AVAILABLE || block == FAT_RESERVED ||
+            block >= image->sb.num_blocks || ++steps > image->sb.num_blocks)
+        {
+            fprintf(stderr, "Corrupt FAT chain.\n");
+            exit(1);
+        }
+
+        if(n > 0 && extents[n - 1].start + extents[n - 1].length == block)
+        {
+            extents[n - 1].length++;
+        }
+        else
+        {
+            if(n == cap)
+            {
+                cap = cap ? cap * 2 : 16;
+                if((extents = realloc(extents, cap * sizeof(uvfs_extent_t))) == NULL)
+                {
+                    fprintf(stderr, "Out of memory.\n");
+                    exit(1);
+                }
+            }
+            extents[n].start = block;
+            extents[n].length = 1;
+            n++;
+        }
+
+        block = uvfs_fat_entry(image, block);
+    }
+
+    *num_extents = n;
+    return extents;
+}
+
+/*
+ * Safe positional write
+ * Writes len bytes at offset and handles errors; inside a journal
+ * transaction the write goes to the transaction instead
+ */
+void uvfs_pwrite(uvfs_image_t * image, const void * buffer, size_t len, off_t offset)
+{
+    assert(image->writable);
+
+    if(image->txn != NULL)
+    {
+        uvfs_journal_write(image, buffer, len, offset);
+        return;
+    }
+
+    const unsigned char * p = buffer;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(image->fd, p, len, offset);
+        if(n <= 0)
+        {
+            fprintf(stderr, "Write failed.\n");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/*
+ * Safe positional read
+ * Reads up to len bytes of fd at offset, stopping early only at end of
+ * file. Returns the bytes read; exits on errors.
+ */
+size_t uvfs_pread(int fd, void * buffer, size_t len, off_t offset)
+{
+    unsigned char * p = buffer;
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t n = pread(fd, p + done, len - done, offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+        {
+            fprintf(stderr, "Read failed.\n");
+            exit(1);
+        }
+        if(n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * FNV-1a over buffer
+ */
+unsigned int uvfs_checksum(const void * buffer, size_t len)
+{
+    const unsigned char * p = buffer;
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * The allocation summary only fits when block 0 has room after the
+ * superblock
+ */
+static int summary_fits(const uvfs_image_t * image)
+{
+    return image->sb.block_size >= SB_SUMMARY_OFFSET + sizeof(superblock_summary_t);
+}
+
+/*
+ * Reads the allocation summary extension into census.
+ * Returns UVFS_SUMMARY_VALID only for a clean summary with a good checksum.
+ */
+int uvfs_summary_read(const uvfs_image_t * image, uvfs_census_t * census)
+{
+    superblock_summary_t sum;
+
+    if(!summary_fits(image))
+        return UVFS_SUMMARY_ABSENT;
+
+    memcpy(&sum, image->map + SB_SUMMARY_OFFSET, sizeof(sum));
+    if(strncmp(sum.magic, SB_SUMMARY_MAGIC, SB_SUMMARY_MAGIC_LEN) != 0)
+        return UVFS_SUMMARY_ABSENT;
+
+    if(ntohl(sum.checksum) != uvfs_checksum(&sum, offsetof(superblock_summary_t, checksum)) ||
+        !(ntohl(sum.flags) & SB_SUMMARY_CLEAN))
+        return UVFS_SUMMARY_STALE;
+
+    census->free_blocks = ntohl(sum.free_blocks);
+    census->resv_blocks = ntohl(sum.resv_blocks);
+    census->alloc_blocks = ntohl(sum.alloc_blocks);
+
+    if((unsigned long)census->free_blocks + census->resv_blocks + census->alloc_blocks != image->sb.num_blocks)
+        return UVFS_SUMMARY_STALE;
+
+    return UVFS_SUMMARY_VALID;
+}
+
+/*
+ * Marks an existing summary stale before the FAT is modified so a store
+ * interrupted before uvfs_summary_commit is never trusted
+ */
+void uvfs_summary_begin(uvfs_image_t * image)
+{
+    superblock_summary_t sum;
+
+    if(!summary_fits(image))
+        return;
+
+    memcpy(&sum, image->map + SB_SUMMARY_OFFSET, sizeof(sum));
+    if(strncmp(sum.magic, SB_SUMMARY_MAGIC, SB_SUMMARY_MAGIC_LEN) != 0)
+        return;
+
+    sum.flags = htonl(0);
+    sum.checksum = htonl(uvfs_checksum(&sum, offsetof(superblock_summary_t, checksum)));
+    uvfs_pwrite(image, &sum, sizeof(sum), SB_SUMMARY_OFFSET);
+}
+
+/*
+ * Records census as the clean allocation summary, once the FAT changes it
+ * describes have been written
+ */
+void uvfs_summary_commit(uvfs_image_t * image, const uvfs_census_t * census)
+{
+    superblock_summary_t sum;
+
+    if(!summary_fits(image))
+        return;
+
+    memcpy(sum.magic, SB_SUMMARY_MAGIC, SB_SUMMARY_MAGIC_LEN);
+    sum.flags = htonl(SB_SUMMARY_CLEAN);
+    sum.free_blocks = htonl(census->free_blocks);
+    sum.resv_blocks = htonl(census->resv_blocks);
+    sum.alloc_blocks = htonl(census->alloc_blocks);
+    sum.checksum = htonl(uvfs_checksum(&sum, offsetof(superblock_summary_t, checksum)));
+    uvfs_pwrite(image, &sum, sizeof(sum), SB_SUMMARY_OFFSET);
+}
+
+/*
+ * Converts superblock to network byte order
+ */
+void convertToNet(superblock_entry_t * sb)
+{
+    sb->block_size = htons(sb->block_size);
+    sb->num_blocks = htonl(sb->num_blocks);
+    sb->fat_start = htonl(sb->fat_start);
+    sb->fat_blocks = htonl(sb->fat_blocks);
+    sb->dir_start = htonl(sb->dir_start);
+    sb->dir_blocks = htonl(sb->dir_blocks);
+}
+
+/*
+ * Convert directory entry to network byte order
+ */
+void convertToNetDE(directory_entry_t * de)
+{
+    de->start_block = htonl(de->start_block);
+    de->num_blocks = htonl(de->num_blocks);
+    de->file_size = htonl(de->file_size);
+}
+
+/*
+ * Convert directory entry to host byte order
+ */
+void convertToHostDE(directory_entry_t * de)
+{
+    de->start_block = ntohl(de->start_block);
+    de->num_blocks = ntohl(de->num_blocks);
+    de->file_size = ntohl(de->file_size);
+}
+
+static unsigned int tail_check(const directory_entry_t * de, uint32_t tail)
+{
+    uint32_t fields[3] = { de->start_block, de->num_blocks, tail };
+
+    return uvfs_checksum(fields, sizeof(fields)) & DIR_TAIL_CHECK_MASK;
+}
+
+/*
+ * Caches tail as the last block of de, an entry in network byte order
+ */
+void uvfs_set_tail(directory_entry_t * de, unsigned int tail)
+{
+    uint32_t net = htonl(tail);
+    uint16_t check = htons(tail_check(de, net));
+
+    memcpy(de->_padding, &net, sizeof(net));
+    memcpy(de->_padding + sizeof(net), &check, sizeof(check));
+}
+
+/*
+ * Records map as the first block of de's extent map, in the padding the
+ * tail takes on a uvicfs17 image
+ */
+void uvfs_set_map(directory_entry_t * de, unsigned int map)
+{
+    uvfs_set_tail(de, map);
+}
+
+/*
+ * Returns the first block of de's extent map, or 0 if the image has no
+ * maps or de's does not check out. de is in network byte order.
+ */
+unsigned int uvfs_entry_map(const uvfs_image_t * image, const directory_entry_t * de)
+{
+    uint32_t net;
+    uint16_t check;
+
+    if(!image->extent_maps || de->status != DIR_ENTRY_NORMALFILE)
+        return 0;
+
+    memcpy(&net, de->_padding, sizeof(net));
+    memcpy(&check, de->_padding + sizeof(net), sizeof(check));
+    if(ntohs(check) != tail_check(de, net) || ntohl(net) == 0 || ntohl(net) >= image->sb.num_blocks)
+        return 0;
+    return ntohl(net);
+}
+
+/*
+ * Returns the last block of de's chain, from the cached tail or the
+ * extent map if it is still good and by walking the chain otherwise, or
+ * FAT_LASTBLOCK if the chain is broken
+ */
+unsigned int uvfs_find_tail(const uvfs_image_t * image, const directory_entry_t * de)
+{
+    unsigned int block = ntohl(de->start_block), n;
+    uint32_t net;
+    uint16_t check;
+
+    if(image->extent_maps)
+    {
+        uvfs_extent_t * extents;
+        int num_extents;
+        unsigned int tail = FAT_LASTBLOCK;
+
+        n = uvfs_entry_map(image, de);
+        if(n != 0 && (extents = uvfs_map_extents(image, n, ntohl(de->num_blocks), &num_extents)) != NULL)
+        {
+            tail = extents[num_extents - 1].start + extents[num_extents - 1].length - 1;
+            free(extents);
+        }
+        if(tail != FAT_LASTBLOCK && uvfs_fat_entry(image, tail) == FAT_LASTBLOCK)
+            return tail;
+    }
+    else
+    {
+        memcpy(&net, de->_padding, sizeof(net));
+        memcpy(&check, de->_padding + sizeof(net), sizeof(check));
+        if(ntohs(check) == tail_check(de, net) && ntohl(net) < image->sb.num_blocks &&
+            uvfs_fat_entry(image, ntohl(net)) == FAT_LASTBLOCK)
+            return ntohl(net);
+    }
+
+    for(n = 0; block < image->sb.num_blocks && n < image->sb.num_blocks; n++)
+    {
+        unsigned int next = uvfs_fat_entry(image, block);
+
+        if(next == FAT_LASTBLOCK)
+            return block;
+        if(next == FAT_AVAILABLE || next == FAT_RESERVED)
+            break;
+        block = next;
+    }
+    return FAT_LASTBLOCK;
+}
+
+char *month_to_string(short m) {
+    switch(m) {
+    case 1: return "Jan";
+    case 2: return "Feb";
+    case 3: return "Mar";
+    case 4: return "Apr";
+    case 5: return "May";
+    case 6: return "Jun";
+    case 7: return "Jul";
+    case 8: return "Aug";
+    case 9: return "Sep";
+    case 10: return "Oct";
+    case 11: return "Nov";
+    case 12: return "Dec";
+    default: return "?!?";
+    }
+}
+
+void unpack_datetime(unsigned char *time, short *year, short *month,
+    short *day, short *hour, short *minute, short *second)
+{
+    assert(time != NULL);
+
+    memcpy(year, time, 2);
+    *year = htons(*year);
+
+    *month = (unsigned short)(time[2]);
+    *day = (unsigned short)(time[3]);
+    *hour = (unsigned short)(time[4]);
+    *minute = (unsigned short)(time[5]);
+    *second = (unsigned short)(time[6]);
+}
+
+/*
+ * Based on http://bit.ly/2vniWNb
+ */
+void pack_current_datetime(unsigned char *entry) {
+    assert(entry);
+
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+
+    unsigned short year   = tm.tm_year + 1900;
+    unsigned char  month  = (unsigned char)(tm.tm_mon + 1);
+    unsigned char  day    = (unsigned char)(tm.tm_mday);
+    unsigned char  hour   = (unsigned char)(tm.tm_hour);
+    unsigned char  minute = (unsigned char)(tm.tm_min);
+    unsigned char  second = (unsigned char)(tm.tm_sec);
+
+    year = htons(year);
+
+    memcpy(entry, &year, 2);
+    entry[2] = month;
+    entry[3] = day;
+    entry[4] = hour;
+    entry[5] = minute;
+    entry[6] = second;
+}
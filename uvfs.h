@@ -0,0 +1,491 @@
+#ifndef _UVFS_H_
+#define _UVFS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include "disk.h"
+
+/*
+ * libuvfs: shared image access for the uvfs tools.
+ *
+ * An image is opened once and mapped read-only into memory; the superblock
+ * is copied out in host byte order while the FAT, root directory and data
+ * blocks are exposed as views straight into the mapping (on-disk byte
+ * order). Modifications go through uvfs_pwrite so readers of the mapping
+ * see them without any extra copies.
+ */
+
+#define UVFS_RDONLY 0
+#define UVFS_RDWR   1
+
+#define UVFS_LOCK_NONE      0
+#define UVFS_LOCK_SHARED    1
+#define UVFS_LOCK_EXCLUSIVE 2
+
+#define UVFS_STORE_CREATE  0             // a new file
+#define UVFS_STORE_APPEND  1             // add to the end of an existing file
+#define UVFS_STORE_REPLACE 2             // overwrite a file, creating it if absent
+#define UVFS_STORE_REMOVE  3             // delete a file; there is no source
+
+/************************ IMAGE STRUCT *******************************/
+
+typedef struct uvfs_image uvfs_image_t;
+struct uvfs_image {
+    char * imagename;
+    int fd;
+    int writable;
+    unsigned char * map;
+    size_t map_len;
+    superblock_entry_t sb;              // host byte order
+    const uint32_t * fat;               // network byte order view
+    const directory_entry_t * dir;      // network byte order view
+    unsigned int dir_entries;
+    int dirtable_live;                  // persistent name table being maintained
+    void * txn;                         // open journal transaction, see uvfs_journal.c
+    int extent_maps;                    // uvicfs18: normal files carry extent maps
+};
+
+#define UVFS_CENSUS_SCALAR 0
+#define UVFS_CENSUS_SSE2   1
+#define UVFS_CENSUS_AVX2   2
+
+#define UVFS_SUMMARY_ABSENT -1
+#define UVFS_SUMMARY_STALE   0
+#define UVFS_SUMMARY_VALID   1
+
+typedef struct uvfs_census uvfs_census_t;
+struct uvfs_census {
+    unsigned int free_blocks;
+    unsigned int resv_blocks;
+    unsigned int alloc_blocks;
+};
+
+typedef struct uvfs_extent uvfs_extent_t;
+struct uvfs_extent {
+    unsigned int start;
+    unsigned int length;
+};
+
+#define UVFS_SEND_COPY_RANGE 0
+#define UVFS_SEND_SENDFILE   1
+#define UVFS_SEND_SPLICE     2
+#define UVFS_SEND_WRITE      3
+
+#define UVFS_SEND_WRITE_FAILED -1
+#define UVFS_SEND_SHORT        -2
+
+typedef struct uvfs_sender uvfs_sender_t;
+struct uvfs_sender {
+    int out_fd;
+    int method;
+};
+
+typedef struct uvfs_index uvfs_index_t;
+struct uvfs_index {
+    uvfs_extent_t * extents;            // chain order
+    unsigned int * first_block;         // logical block each extent starts at
+    int num_extents;
+};
+
+#define UVFS_READAHEAD_WINDOW (4 << 20)
+
+typedef struct uvfs_readahead uvfs_readahead_t;
+struct uvfs_readahead {
+    size_t window;                      // bytes kept advised past the reader
+    size_t ahead;                       // file offset advised up to
+};
+
+typedef struct uvfs_cachestat uvfs_cachestat_t;
+struct uvfs_cachestat {
+    unsigned long hits;                 // pages already in the page cache
+    unsigned long misses;
+};
+
+#define UVFS_AIO_SYNC  0
+#define UVFS_AIO_URING 1
+
+typedef struct uvfs_aio_op uvfs_aio_op_t;
+struct uvfs_aio_op {
+    int fd;
+    int write;
+    unsigned char * buffer;
+    size_t len;
+    off_t offset;
+    size_t done;                        // bytes transferred so far
+    int tag;                            // caller's name for the operation
+    int busy;
+};
+
+typedef struct uvfs_aio uvfs_aio_t;
+struct uvfs_aio {
+    int backend;
+    unsigned int depth;                 // most operations outstanding at once
+    uvfs_aio_op_t * ops;
+    int * ready;                        // finished ops not yet returned
+    unsigned int num_ready;
+    unsigned int unsubmitted;
+    void * ring;                        // io_uring state, see uvfs_aio.c
+};
+
+typedef struct uvfs_dirhash uvfs_dirhash_t;
+struct uvfs_dirhash {
+    uint32_t * slots;                   // on-image slot layout, see disk.h
+    unsigned int num_slots;
+    const directory_entry_t * dir;      // directory the slots index into
+    unsigned int dir_entries;
+    int first_free;                     // first available directory entry
+};
+
+typedef struct uvfs_extent_node uvfs_extent_node_t;
+struct uvfs_extent_node {
+    uvfs_extent_t extent;
+    int left;                           // -1 if none; links unused nodes
+    int right;
+    int height;
+};
+
+typedef struct uvfs_allocator uvfs_allocator_t;
+struct uvfs_allocator {
+    unsigned int num_blocks;
+    unsigned int free_blocks;
+    unsigned char * bitmap;             // bit set = block in use
+    uvfs_extent_node_t * nodes;         // AVL tree of free runs by (length, start)
+    int root;                           // -1 if there are no free runs
+    int unused;                         // list of unused nodes, -1 if none
+    unsigned int num_extents;
+    unsigned int cap_nodes;
+};
+
+typedef struct uvfs_fatframe uvfs_fatframe_t;
+struct uvfs_fatframe {
+    unsigned int block;                 // FAT block held, from fat_start
+    int dirty;
+    int prev;                           // LRU list, most recent first
+    int next;
+    int hash_next;                      // next frame in the same bucket
+    uint32_t * entries;                 // network byte order
+};
+
+typedef struct uvfs_fatcache uvfs_fatcache_t;
+struct uvfs_fatcache {
+    uvfs_image_t * image;
+    unsigned int entries_per_block;
+    int num_frames;
+    int used_frames;
+    uvfs_fatframe_t * frames;
+    unsigned char * data;               // num_frames blocks of entries
+    int * buckets;                      // frame chains by FAT block
+    unsigned int num_buckets;
+    int head;                           // most recently used frame
+    int tail;                           // least recently used frame
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/*
+ * One file to store: where it comes from and, once planned, the
+ * directory entry and extents it was given
+ */
+typedef struct uvfs_store_job uvfs_store_job_t;
+struct uvfs_store_job {
+    char * filename;
+    char * sourcename;
+    int src_fd;
+    size_t file_size;
+    unsigned int num_blocks;
+    uvfs_extent_t * extents;
+    int num_extents;
+    int de_index;
+    int mode;                           // UVFS_STORE_*
+    unsigned int tail;                  // where an existing chain is cut or extended
+    size_t old_size;
+    unsigned int old_blocks;
+    uvfs_extent_t * reuse;              // blocks a replaced file keeps
+    int num_reuse;
+    int relocate;                       // replaced into new blocks, old chain freed at commit
+    unsigned int old_map;               // extent map to free at commit, 0 if none
+    char * name;                        // last component of filename
+    unsigned int dir_block;             // its directory's root node, 0 for the root
+    directory_entry_t entry;            // in a subdirectory, network byte order
+    uint64_t slot;                      // claim, see uvfs_claim_slot
+    int claimed;
+};
+
+/*
+ * A subdirectory node a store run has changed, held until it is written
+ * with the FAT
+ */
+typedef struct uvfs_dirnode uvfs_dirnode_t;
+struct uvfs_dirnode {
+    unsigned int block;
+    unsigned char * data;               // a block, and room for one more record
+};
+
+/*
+ * Everything a store run changes, loaded once: the FAT through a bounded
+ * paging cache, a private copy of the root directory, the free extent
+ * allocator, the name index and the allocation counts. The directory copy
+ * keeps one dirty flag per image block and the cache tracks its own dirty
+ * FAT blocks, so commit writes back only the blocks the run touched.
+ */
+typedef struct uvfs_store uvfs_store_t;
+struct uvfs_store {
+    uvfs_image_t * image;
+    uvfs_fatcache_t fat;
+    uvfs_aio_t aio;                     // data copies
+    int num_threads;                    // copying large files
+    directory_entry_t * ROOT;            // network byte order
+    unsigned char * dir_dirty;          // one flag per directory block
+    uvfs_allocator_t alloc;
+    uvfs_dirhash_t names;
+    uvfs_census_t census;
+    int next_entry;                     // where to look for a free entry
+    unsigned int table_start;           // persistent name table, if rebuilt
+    unsigned int table_blocks;
+    uvfs_store_job_t * jobs;
+    int num_jobs;
+    int * touched;                      // root entries of directories made or grown
+    int num_touched;
+    uvfs_dirnode_t * nodes;             // sorted by block
+    int num_nodes;
+};
+
+/*
+ * Called by uvfs_dir_list with each entry of a directory
+ */
+typedef void (*uvfs_dir_fn)(const directory_entry_t * de, void * arg);
+
+/*
+ * A directory a walk down the tree is in, linked to the ones above it
+ */
+typedef struct uvfs_dir_path uvfs_dir_path_t;
+struct uvfs_dir_path {
+    unsigned int root;                  // its root node
+    const uvfs_dir_path_t * parent;     // NULL for a directory in the root
+};
+
+/*
+ * uvfsd protocol. A client connects to the server's Unix socket and sends
+ * one request header, then image_len bytes of image path, name_len bytes
+ * of file name and, for UVFSD_STORE, length bytes of file data. The
+ * server answers with one response header and length bytes of payload:
+ *
+ *   UVFSD_STAT   uvfsd_stat_t
+ *   UVFSD_LS     the used root directory entries, on-disk byte order
+ *   UVFSD_CAT    the requested bytes of the file
+ *   UVFSD_STORE  nothing
+ *
+ * A non-zero status carries an error message as payload instead. Both
+ * ends share a host, so header fields are in host byte order.
+ */
+#define UVFSD_MAGIC "uvd1"
+#define UVFSD_MAGIC_LEN 4
+
+#define UVFSD_STAT  1
+#define UVFSD_LS    2
+#define UVFSD_CAT   3
+#define UVFSD_STORE 4
+
+typedef struct uvfsd_request uvfsd_request_t;
+struct uvfsd_request {
+             char  magic[UVFSD_MAGIC_LEN];
+    uint32_t       op;
+    uint32_t       image_len;
+    uint32_t       name_len;
+    uint64_t       offset;              // UVFSD_CAT: first byte wanted
+    uint64_t       length;              // UVFSD_CAT: bytes wanted, UVFSD_STORE: bytes sent
+} __attribute__ ((packed));
+
+typedef struct uvfsd_response uvfsd_response_t;
+struct uvfsd_response {
+             char  magic[UVFSD_MAGIC_LEN];
+    uint32_t       status;
+    uint64_t       length;
+} __attribute__ ((packed));
+
+typedef struct uvfsd_stat uvfsd_stat_t;
+struct uvfsd_stat {
+    superblock_entry_t sb;              // host byte order
+    uint32_t       free_blocks;
+    uint32_t       resv_blocks;
+    uint32_t       alloc_blocks;
+} __attribute__ ((packed));
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+void                uvfs_open(uvfs_image_t * image, char * imagename, int mode);
+void                uvfs_close(uvfs_image_t * image);
+int                 uvfs_find_entry(const uvfs_image_t * image, const char * filename);
+int                 uvfs_free_entry(const uvfs_image_t * image);
+off_t               uvfs_dir_entry_offset(const uvfs_image_t * image, int index);
+void                uvfs_pwrite(uvfs_image_t * image, const void * buffer, size_t len, off_t offset);
+size_t              uvfs_pread(int fd, void * buffer, size_t len, off_t offset);
+uvfs_extent_t *     uvfs_file_extents(const uvfs_image_t * image, unsigned int start_block, int * num_extents);
+
+uvfs_extent_t *     uvfs_entry_extents(const uvfs_image_t * image, const directory_entry_t * de, int * num_extents);
+uvfs_extent_t *     uvfs_map_extents(const uvfs_image_t * image, unsigned int map, unsigned int num_blocks,
+                        int * num_extents);
+unsigned int        uvfs_map_blocks(const uvfs_image_t * image, int num_extents);
+void                uvfs_map_put(uvfs_image_t * image, const unsigned int * blocks, const uvfs_extent_t * extents,
+                        int num_extents);
+unsigned int        uvfs_map_write(uvfs_store_t * store, const uvfs_extent_t * extents, int num_extents);
+unsigned int        uvfs_map_free(uvfs_store_t * store, unsigned int map);
+
+void                uvfs_sender_init(uvfs_sender_t * sender, int out_fd);
+void                uvfs_send(const uvfs_image_t * image, uvfs_sender_t * sender, off_t offset, size_t len);
+int                 uvfs_send_range(const uvfs_image_t * image, uvfs_sender_t * sender, off_t offset, size_t len);
+
+void                uvfs_index_build(const uvfs_image_t * image, const directory_entry_t * de, uvfs_index_t * index);
+int                 uvfs_index_load(const uvfs_image_t * image, const char * path, const directory_entry_t * de,
+                        uvfs_index_t * index);
+void                uvfs_index_save(const char * path, const directory_entry_t * de, const uvfs_index_t * index);
+int                 uvfs_index_valid(const uvfs_image_t * image, const directory_entry_t * de,
+                        const uvfs_index_t * index);
+void                uvfs_index_destroy(uvfs_index_t * index);
+int                 uvfs_index_lookup(const uvfs_index_t * index, unsigned int block);
+
+unsigned int        uvfs_dirhash_slots(unsigned int dir_entries);
+void                uvfs_dirhash_build(uvfs_dirhash_t * hash, const directory_entry_t * dir, unsigned int dir_entries);
+void                uvfs_dirhash_destroy(uvfs_dirhash_t * hash);
+int                 uvfs_dirhash_find(const uvfs_dirhash_t * hash, const char * name);
+unsigned int        uvfs_dirhash_insert(uvfs_dirhash_t * hash, const char * name, int index);
+int                 uvfs_dirtable_find(const uvfs_image_t * image, const char * name, int * index);
+int                 uvfs_dirtable_begin(uvfs_image_t * image);
+void                uvfs_dirtable_insert(uvfs_image_t * image, const char * name, int index);
+void                uvfs_dirtable_remove(uvfs_image_t * image, const char * name, int index);
+void                uvfs_dirtable_commit(uvfs_image_t * image);
+void                uvfs_dirtable_create(uvfs_image_t * image, const uvfs_dirhash_t * hash,
+                        unsigned int table_start, unsigned int table_blocks);
+int                 uvfs_dirtable_location(const uvfs_image_t * image, unsigned int * start, unsigned int * blocks);
+
+int                 uvfs_dir_find(const uvfs_image_t * image, unsigned int root, const char * name,
+                        directory_entry_t * de);
+int                 uvfs_lookup(const uvfs_image_t * image, const char * path, directory_entry_t * de);
+void                uvfs_dir_list(const uvfs_image_t * image, unsigned int root, uvfs_dir_fn fn, void * arg);
+int                 uvfs_dir_scan(const uvfs_image_t * image, unsigned int root, uvfs_dir_fn fn, void * arg);
+unsigned long       uvfs_dir_count(const uvfs_image_t * image, unsigned int root);
+void                uvfs_dir_enter(const uvfs_dir_path_t * at);
+int                 uvfs_dir_get(uvfs_store_t * store, unsigned int root, const char * name,
+                        directory_entry_t * de);
+unsigned int        uvfs_dir_create(uvfs_store_t * store);
+unsigned int        uvfs_dir_insert(uvfs_store_t * store, unsigned int root, const directory_entry_t * rec);
+int                 uvfs_dir_update(uvfs_store_t * store, unsigned int root, const directory_entry_t * rec);
+int                 uvfs_dir_delete(uvfs_store_t * store, unsigned int root, const char * name);
+void                uvfs_dir_flush(uvfs_store_t * store);
+
+void                uvfs_alloc_init(uvfs_allocator_t * alloc, const uvfs_image_t * image);
+void                uvfs_alloc_destroy(uvfs_allocator_t * alloc);
+int                 uvfs_alloc_in_use(const uvfs_allocator_t * alloc, unsigned int block);
+uvfs_extent_t *     uvfs_alloc_blocks(uvfs_allocator_t * alloc, unsigned int count, int * num_extents);
+
+void                uvfs_store_add(uvfs_store_t * store, char * filename, char * sourcename);
+void                uvfs_store_load(uvfs_store_t * store, uvfs_image_t * image, size_t fat_cache,
+                        unsigned int queue_depth);
+void                uvfs_store_run(uvfs_store_t * store, int dir_index);
+void                uvfs_store_extents(uvfs_store_t * store);
+void                uvfs_store_destroy(uvfs_store_t * store);
+
+void                uvfs_aio_init(uvfs_aio_t * aio, unsigned int depth);
+void                uvfs_aio_destroy(uvfs_aio_t * aio);
+void                uvfs_aio_read(uvfs_aio_t * aio, int fd, void * buffer, size_t len, off_t offset, int tag);
+void                uvfs_aio_write(uvfs_aio_t * aio, int fd, const void * buffer, size_t len, off_t offset, int tag);
+size_t              uvfs_aio_wait(uvfs_aio_t * aio, int * tag);
+const char *        uvfs_aio_name(const uvfs_aio_t * aio);
+
+void *              uvfs_client_call(const char * server, uint32_t op, const char * imagename,
+                        const char * filename, uint64_t offset, uint64_t length, int src_fd,
+                        int out_fd, uint64_t * payload_len);
+
+void                uvfs_advise(const uvfs_image_t * image, off_t offset, size_t len);
+void                uvfs_readahead_init(uvfs_readahead_t * ra, size_t window);
+void                uvfs_readahead(const uvfs_image_t * image, const uvfs_index_t * index,
+                        uvfs_readahead_t * ra, size_t pos);
+void                uvfs_cache_probe(const uvfs_image_t * image, off_t offset, size_t len,
+                        uvfs_cachestat_t * stat);
+
+void                uvfs_fatcache_init(uvfs_fatcache_t * cache, uvfs_image_t * image, size_t bytes);
+void                uvfs_fatcache_destroy(uvfs_fatcache_t * cache);
+unsigned int        uvfs_fatcache_get(uvfs_fatcache_t * cache, unsigned int block);
+void                uvfs_fatcache_set(uvfs_fatcache_t * cache, unsigned int block, unsigned int value);
+void                uvfs_fatcache_flush(uvfs_fatcache_t * cache);
+void                uvfs_fatcache_drop(uvfs_fatcache_t * cache);
+
+int                 uvfs_journal_location(const uvfs_image_t * image, unsigned int * start, unsigned int * blocks);
+void                uvfs_journal_create(uvfs_image_t * image, unsigned int blocks);
+int                 uvfs_journal_begin(uvfs_image_t * image);
+void                uvfs_journal_write(uvfs_image_t * image, const void * buffer, size_t len, off_t offset);
+void                uvfs_journal_commit(uvfs_image_t * image);
+void                uvfs_journal_recover(uvfs_image_t * image);
+
+void                uvfs_lock_metadata(const uvfs_image_t * image, int mode);
+uint64_t            uvfs_claim_slot(unsigned int dir_block, const char * name);
+int                 uvfs_claim_entry(const uvfs_image_t * image, uint64_t slot);
+void                uvfs_release_entry(const uvfs_image_t * image, uint64_t slot);
+int                 uvfs_entry_claimed(const uvfs_image_t * image, uint64_t slot);
+void                uvfs_group_sync(const uvfs_image_t * image);
+
+int                 uvfs_summary_read(const uvfs_image_t * image, uvfs_census_t * census);
+void                uvfs_summary_begin(uvfs_image_t * image);
+void                uvfs_summary_commit(uvfs_image_t * image, const uvfs_census_t * census);
+unsigned int        uvfs_checksum(const void * buffer, size_t len);
+
+void                convertToNet(superblock_entry_t * sb);
+void                convertToNetDE(directory_entry_t * de);
+void                convertToHostDE(directory_entry_t * de);
+void                uvfs_set_tail(directory_entry_t * de, unsigned int tail);
+unsigned int        uvfs_find_tail(const uvfs_image_t * image, const directory_entry_t * de);
+void                uvfs_set_map(directory_entry_t * de, unsigned int map);
+unsigned int        uvfs_entry_map(const uvfs_image_t * image, const directory_entry_t * de);
+
+int                 uvfs_census_supported(int kernel);
+int                 uvfs_census_best(void);
+char *              uvfs_census_name(int kernel);
+void                uvfs_count_fat(int kernel, const uint32_t * fat, size_t n, size_t * nfree, size_t * nresv);
+void                uvfs_fat_census(const uvfs_image_t * image, uvfs_census_t * census);
+
+char *              month_to_string(short m);
+void                unpack_datetime(unsigned char *time, short *year, short *month, short *day, short *hour, short *minute, short *second);
+void                pack_current_datetime(unsigned char *entry);
+
+/*
+ * Returns the FAT entry for block in host byte order
+ */
+static inline unsigned int uvfs_fat_entry(const uvfs_image_t * image, unsigned int block)
+{
+    return ntohl(image->fat[block]);
+}
+
+/*
+ * Returns the byte offset of block within the image
+ */
+static inline off_t uvfs_block_offset(const uvfs_image_t * image, unsigned int block)
+{
+    return (off_t)block * image->sb.block_size;
+}
+
+/*
+ * Returns a read-only view of the given data block
+ */
+static inline const unsigned char * uvfs_block(const uvfs_image_t * image, unsigned int block)
+{
+    return image->map + (size_t)block * image->sb.block_size;
+}
+
+/*
+ * Returns how many bytes of block are present in the image: block_size,
+ * fewer for a truncated final block, or 0 if out of range
+ */
+static inline size_t uvfs_block_bytes(const uvfs_image_t * image, unsigned int block)
+{
+    size_t offset = (size_t)block * image->sb.block_size;
+
+    if(block >= image->sb.num_blocks || offset >= image->map_len)
+        return 0;
+    if(image->map_len - offset < image->sb.block_size)
+        return image->map_len - offset;
+    return image->sb.block_size;
+}
+
+#endif
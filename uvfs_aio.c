@@ -0,0 +1,357 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uvfs.h"
+
+/*
+ * Queued positional I/O.
+ *
+ * Callers queue up to depth reads and writes, each under a tag of their
+ * choosing, and collect completions in whatever order they finish. Where
+ * the build host has <linux/io_uring.h> the queue is an io_uring driven
+ * through the raw system calls, so the device sees depth requests at
+ * once; where it does not, or the running kernel refuses the ring, every
+ * operation is carried out synchronously with pread/pwrite as it is
+ * queued. Short transfers are continued internally, so a completion
+ * always covers the whole request unless a read reached end of file.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define UVFS_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef UVFS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+typedef struct ring ring_t;
+struct ring {
+    int fd;
+    void * sq_map;
+    size_t sq_map_len;
+    void * cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe * sqes;
+    size_t sqes_len;
+    unsigned int * sq_tail;
+    unsigned int * sq_mask;
+    unsigned int * sq_array;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int * cq_mask;
+    struct io_uring_cqe * cqes;
+};
+#endif
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static int          take_op(uvfs_aio_t * aio);
+static void         run_sync(uvfs_aio_t * aio, int i);
+static void         queue(uvfs_aio_t * aio, int fd, int write, void * buffer, size_t len, off_t offset, int tag);
+#ifdef UVFS_HAVE_IO_URING
+static int          ring_setup(uvfs_aio_t * aio);
+static void         ring_teardown(uvfs_aio_t * aio);
+static void         ring_push(uvfs_aio_t * aio, int i);
+static void         ring_reap(uvfs_aio_t * aio);
+#endif
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Sets up a queue for depth outstanding operations. A depth of one, or a
+ * host without io_uring, gives the synchronous backend.
+ */
+void uvfs_aio_init(uvfs_aio_t * aio, unsigned int depth)
+{
+    memset(aio, 0, sizeof(uvfs_aio_t));
+    aio->depth = depth < 1 ? 1 : depth;
+    aio->backend = UVFS_AIO_SYNC;
+
+    aio->ops = calloc(aio->depth, sizeof(uvfs_aio_op_t));
+    aio->ready = malloc(aio->depth * sizeof(int));
+    if(aio->ops == NULL || aio->ready == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+#ifdef UVFS_HAVE_IO_URING
+    if(aio->depth > 1 && ring_setup(aio))
+        aio->backend = UVFS_AIO_URING;
+#endif
+}
+
+/*
+ * Releases the queue; operations still outstanding are abandoned
+ */
+void uvfs_aio_destroy(uvfs_aio_t * aio)
+{
+#ifdef UVFS_HAVE_IO_URING
+    if(aio->backend == UVFS_AIO_URING)
+        ring_teardown(aio);
+#endif
+    free(aio->ops);
+    free(aio->ready);
+    aio->ops = NULL;
+    aio->ready = NULL;
+}
+
+const char * uvfs_aio_name(const uvfs_aio_t * aio)
+{
+    return aio->backend == UVFS_AIO_URING ? "io_uring" : "sync";
+}
+
+/*
+ * Returns a free operation slot; callers never queue more than depth
+ */
+static int take_op(uvfs_aio_t * aio)
+{
+    int i;
+
+    for(i = 0; i < aio->depth; i++)
+    {
+        if(!aio->ops[i].busy)
+            return i;
+    }
+    assert(0 && "more than depth operations queued");
+    return -1;
+}
+
+/*
+ * Finishes operation i with pread/pwrite and marks it ready
+ */
+static void run_sync(uvfs_aio_t * aio, int i)
+{
+    uvfs_aio_op_t * op = &aio->ops[i];
+
+    if(op->write)
+    {
+        while(op->done < op->len)
+        {
+            ssize_t n = pwrite(op->fd, op->buffer + op->done, op->len - op->done, op->offset + op->done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                fprintf(stderr, "Write failed.\n");
+                exit(1);
+            }
+            op->done += n;
+        }
+    }
+    else
+        op->done += uvfs_pread(op->fd, op->buffer + op->done, op->len - op->done, op->offset + op->done);
+
+    aio->ready[aio->num_ready++] = i;
+}
+
+static void queue(uvfs_aio_t * aio, int fd, int write, void * buffer, size_t len, off_t offset, int tag)
+{
+    int i = take_op(aio);
+    uvfs_aio_op_t * op = &aio->ops[i];
+
+    op->fd = fd;
+    op->write = write;
+    op->buffer = buffer;
+    op->len = len;
+    op->offset = offset;
+    op->done = 0;
+    op->tag = tag;
+    op->busy = 1;
+
+#ifdef UVFS_HAVE_IO_URING
+    if(aio->backend == UVFS_AIO_URING && len > 0)
+    {
+        ring_push(aio, i);
+        return;
+    }
+#endif
+    run_sync(aio, i);
+}
+
+/*
+ * Queues a read of len bytes of fd at offset into buffer under tag
+ */
+void uvfs_aio_read(uvfs_aio_t * aio, int fd, void * buffer, size_t len, off_t offset, int tag)
+{
+    queue(aio, fd, 0, buffer, len, offset, tag);
+}
+
+/*
+ * Queues a write of len bytes of buffer to fd at offset under tag; buffer
+ * must not change until the write completes
+ */
+void uvfs_aio_write(uvfs_aio_t * aio, int fd, const void * buffer, size_t len, off_t offset, int tag)
+{
+    queue(aio, fd, 1, (void *)buffer, len, offset, tag);
+}
+
+/*
+ * Submits everything queued and waits for one operation to finish.
+ * Returns the bytes it transferred (short only for a read that hit end of
+ * file) and its tag in *tag. Exits on I/O errors.
+ */
+size_t uvfs_aio_wait(uvfs_aio_t * aio, int * tag)
+{
+#ifdef UVFS_HAVE_IO_URING
+    while(aio->num_ready == 0 && aio->backend == UVFS_AIO_URING)
+        ring_reap(aio);
+#endif
+    assert(aio->num_ready > 0);
+
+    uvfs_aio_op_t * op = &aio->ops[aio->ready[--aio->num_ready]];
+    op->busy = 0;
+    *tag = op->tag;
+    return op->done;
+}
+
+#ifdef UVFS_HAVE_IO_URING
+
+/*
+ * Creates and maps the ring. Returns 0 if the kernel refuses it.
+ */
+static int ring_setup(uvfs_aio_t * aio)
+{
+    struct io_uring_params p;
+    ring_t * r = calloc(1, sizeof(ring_t));
+
+    if(r == NULL)
+        return 0;
+
+    memset(&p, 0, sizeof(p));
+    if((r->fd = syscall(__NR_io_uring_setup, aio->depth, &p)) < 0)
+    {
+        free(r);
+        return 0;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_SQES);
+
+    if(r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        aio->ring = r;
+        ring_teardown(aio);
+        return 0;
+    }
+
+    r->sq_tail = (unsigned int *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned int *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+
+    aio->ring = r;
+    return 1;
+}
+
+static void ring_teardown(uvfs_aio_t * aio)
+{
+    ring_t * r = aio->ring;
+
+    if(r->sq_map != NULL && r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_map_len);
+    if(r->cq_map != NULL && r->cq_map != MAP_FAILED)
+        munmap(r->cq_map, r->cq_map_len);
+    if(r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    close(r->fd);
+    free(r);
+    aio->ring = NULL;
+}
+
+/*
+ * Places the untransferred part of operation i on the submission queue
+ */
+static void ring_push(uvfs_aio_t * aio, int i)
+{
+    ring_t * r = aio->ring;
+    uvfs_aio_op_t * op = &aio->ops[i];
+    unsigned int tail = *r->sq_tail;
+    unsigned int index = tail & *r->sq_mask;
+    struct io_uring_sqe * sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->addr = (unsigned long)(op->buffer + op->done);
+    sqe->len = op->len - op->done;
+    sqe->off = op->offset + op->done;
+    sqe->user_data = i;
+
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->unsubmitted++;
+}
+
+/*
+ * Submits pending entries, waits for at least one completion and handles
+ * every completion available
+ */
+static void ring_reap(uvfs_aio_t * aio)
+{
+    ring_t * r = aio->ring;
+    unsigned int head, tail;
+
+    if(syscall(__NR_io_uring_enter, r->fd, aio->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        if(errno == EINTR)
+            return;
+        fprintf(stderr, "I/O queue failed.\n");
+        exit(1);
+    }
+    aio->unsubmitted = 0;
+
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe * cqe = &r->cqes[head & *r->cq_mask];
+        int i = cqe->user_data;
+        int res = cqe->res;
+        uvfs_aio_op_t * op = &aio->ops[i];
+
+        if(res == -EINTR || res == -EAGAIN)
+            ring_push(aio, i);
+        else if(res == -EINVAL || res == -EOPNOTSUPP)
+            run_sync(aio, i);           // kernel without this opcode
+        else if(res < 0)
+        {
+            fprintf(stderr, op->write ? "Write failed.\n" : "Read failed.\n");
+            exit(1);
+        }
+        else if(res == 0 && op->write)
+        {
+            fprintf(stderr, "Write failed.\n");
+            exit(1);
+        }
+        else
+        {
+            op->done += res;
+            if(res > 0 && op->done < op->len)
+                ring_push(aio, i);
+            else
+                aio->ready[aio->num_ready++] = i;
+        }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+/*
+ * Free-extent allocator.
+ *
+ * Built once from the FAT: a bitmap of blocks in use plus every run of
+ * free blocks. The runs are collected in one pass, sorted once and built
+ * into a balanced AVL tree ordered by (length, start), so a best fit for
+ * a request, taking a run and giving back the rest of it all cost
+ * O(log E) in the number of runs. Requests are served from a single
+ * extent whenever one is large enough and otherwise from the fewest,
+ * largest extents.
+ */
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static void *       xrealloc(void * p, size_t len);
+static int          extent_before(const uvfs_extent_t * a, const uvfs_extent_t * b);
+static int          compare_extents(const void * a, const void * b);
+static int          height(const uvfs_allocator_t * alloc, int n);
+static void         update(uvfs_allocator_t * alloc, int n);
+static int          rotate(uvfs_allocator_t * alloc, int n, int left);
+static int          rebalance(uvfs_allocator_t * alloc, int n);
+static int          build_tree(uvfs_allocator_t * alloc, int lo, int hi);
+static int          tree_insert(uvfs_allocator_t * alloc, int n, int node);
+static int          tree_remove_min(uvfs_allocator_t * alloc, int n, int * min);
+static int          tree_remove(uvfs_allocator_t * alloc, int n, const uvfs_extent_t * e);
+static int          lower_bound(const uvfs_allocator_t * alloc, unsigned int length);
+static void         insert_extent(uvfs_allocator_t * alloc, unsigned int start, unsigned int length);
+static void         remove_extent(uvfs_allocator_t * alloc, uvfs_extent_t e);
+static void         mark_used(uvfs_allocator_t * alloc, unsigned int start, unsigned int length);
+static int          compare_start(const void * a, const void * b);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+static void * xrealloc(void * p, size_t len)
+{
+    if((p = realloc(p, len)) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int extent_before(const uvfs_extent_t * a, const uvfs_extent_t * b)
+{
+    return a->length < b->length || (a->length == b->length && a->start < b->start);
+}
+
+static int compare_extents(const void * a, const void * b)
+{
+    const uvfs_extent_node_t * x = a, * y = b;
+    return extent_before(&x->extent, &y->extent) ? -1 : extent_before(&y->extent, &x->extent);
+}
+
+static int height(const uvfs_allocator_t * alloc, int n)
+{
+    return n < 0 ? 0 : alloc->nodes[n].height;
+}
+
+static void update(uvfs_allocator_t * alloc, int n)
+{
+    int l = height(alloc, alloc->nodes[n].left), r = height(alloc, alloc->nodes[n].right);
+
+    alloc->nodes[n].height = (l > r ? l : r) + 1;
+}
+
+/*
+ * Rotates the subtree at n to the left (its right child rises) or to the
+ * right. Returns the subtree's new root.
+ */
+static int rotate(uvfs_allocator_t * alloc, int n, int left)
+{
+    uvfs_extent_node_t * nodes = alloc->nodes;
+    int up;
+
+    if(left)
+    {
+        up = nodes[n].right;
+        nodes[n].right = nodes[up].left;
+        nodes[up].left = n;
+    }
+    else
+    {
+        up = nodes[n].left;
+        nodes[n].left = nodes[up].right;
+        nodes[up].right = n;
+    }
+    update(alloc, n);
+    update(alloc, up);
+    return up;
+}
+
+/*
+ * Restores the AVL balance at n after one of its subtrees changed height
+ * by one. Returns the subtree's new root.
+ */
+static int rebalance(uvfs_allocator_t * alloc, int n)
+{
+    uvfs_extent_node_t * nodes = alloc->nodes;
+    int balance;
+
+    update(alloc, n);
+    balance = height(alloc, nodes[n].left) - height(alloc, nodes[n].right);
+
+    if(balance > 1)
+    {
+        if(height(alloc, nodes[nodes[n].left].left) < height(alloc, nodes[nodes[n].left].right))
+            nodes[n].left = rotate(alloc, nodes[n].left, 1);
+        return rotate(alloc, n, 0);
+    }
+    if(balance < -1)
+    {
+        if(height(alloc, nodes[nodes[n].right].right) < height(alloc, nodes[nodes[n].right].left))
+            nodes[n].right = rotate(alloc, nodes[n].right, 0);
+        return rotate(alloc, n, 1);
+    }
+    return n;
+}
+
+/*
+ * Makes the sorted nodes lo to hi - 1 a perfectly balanced tree. Returns
+ * its root.
+ */
+static int build_tree(uvfs_allocator_t * alloc, int lo, int hi)
+{
+    int mid = lo + (hi - lo) / 2;
+
+    if(lo >= hi)
+        return -1;
+
+    alloc->nodes[mid].left = build_tree(alloc, lo, mid);
+    alloc->nodes[mid].right = build_tree(alloc, mid + 1, hi);
+    update(alloc, mid);
+    return mid;
+}
+
+static int tree_insert(uvfs_allocator_t * alloc, int n, int node)
+{
+    if(n < 0)
+        return node;
+
+    if(extent_before(&alloc->nodes[node].extent, &alloc->nodes[n].extent))
+        alloc->nodes[n].left = tree_insert(alloc, alloc->nodes[n].left, node);
+    else
+        alloc->nodes[n].right = tree_insert(alloc, alloc->nodes[n].right, node);
+    return rebalance(alloc, n);
+}
+
+/*
+ * Unlinks the smallest node of the subtree at n into *min. Returns the
+ * subtree's new root.
+ */
+static int tree_remove_min(uvfs_allocator_t * alloc, int n, int * min)
+{
+    if(alloc->nodes[n].left < 0)
+    {
+        *min = n;
+        return alloc->nodes[n].right;
+    }
+    alloc->nodes[n].left = tree_remove_min(alloc, alloc->nodes[n].left, min);
+    return rebalance(alloc, n);
+}
+
+/*
+ * Unlinks the node holding e from the subtree at n and puts it on the
+ * unused list. Returns the subtree's new root.
+ */
+static int tree_remove(uvfs_allocator_t * alloc, int n, const uvfs_extent_t * e)
+{
+    uvfs_extent_node_t * nodes = alloc->nodes;
+    int up;
+
+    assert(n >= 0);
+    if(extent_before(e, &nodes[n].extent))
+    {
+        nodes[n].left = tree_remove(alloc, nodes[n].left, e);
+        return rebalance(alloc, n);
+    }
+    if(extent_before(&nodes[n].extent, e))
+    {
+        nodes[n].right = tree_remove(alloc, nodes[n].right, e);
+        return rebalance(alloc, n);
+    }
+
+    // the successor, if there is one, takes the node's place
+    if(nodes[n].left < 0 || nodes[n].right < 0)
+        up = nodes[n].left < 0 ? nodes[n].right : nodes[n].left;
+    else
+    {
+        nodes[n].right = tree_remove_min(alloc, nodes[n].right, &up);
+        nodes[up].left = nodes[n].left;
+        nodes[up].right = nodes[n].right;
+        up = rebalance(alloc, up);
+    }
+
+    nodes[n].left = alloc->unused;
+    alloc->unused = n;
+    return up;
+}
+
+/*
+ * Returns the node of the smallest free extent with at least length
+ * blocks, or -1 if there is none
+ */
+static int lower_bound(const uvfs_allocator_t * alloc, unsigned int length)
+{
+    int n = alloc->root, found = -1;
+
+    while(n >= 0)
+    {
+        if(alloc->nodes[n].extent.length < length)
+            n = alloc->nodes[n].right;
+        else
+        {
+            found = n;
+            n = alloc->nodes[n].left;
+        }
+    }
+    return found;
+}
+
+static void insert_extent(uvfs_allocator_t * alloc, unsigned int start, unsigned int length)
+{
+    int node = alloc->unused;
+
+    if(node >= 0)
+        alloc->unused = alloc->nodes[node].left;
+    else
+    {
+        if(alloc->num_extents == alloc->cap_nodes)
+        {
+            alloc->cap_nodes = alloc->cap_nodes ? alloc->cap_nodes * 2 : 64;
+            alloc->nodes = xrealloc(alloc->nodes, alloc->cap_nodes * sizeof(uvfs_extent_node_t));
+        }
+        node = alloc->num_extents;
+    }
+
+    alloc->nodes[node].extent.start = start;
+    alloc->nodes[node].extent.length = length;
+    alloc->nodes[node].left = alloc->nodes[node].right = -1;
+    alloc->nodes[node].height = 1;
+    alloc->root = tree_insert(alloc, alloc->root, node);
+    alloc->num_extents++;
+}
+
+static void remove_extent(uvfs_allocator_t * alloc, uvfs_extent_t e)
+{
+    alloc->root = tree_remove(alloc, alloc->root, &e);
+    alloc->num_extents--;
+}
+
+static void mark_used(uvfs_allocator_t * alloc, unsigned int start, unsigned int length)
+{
+    unsigned int b;
+    for(b = start; b < start + length; b++)
+        alloc->bitmap[b / 8] |= 1 << (b % 8);
+    alloc->free_blocks -= length;
+}
+
+static int compare_start(const void * a, const void * b)
+{
+    const uvfs_extent_t * x = a, * y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Builds the allocator from the FAT of image: the runs are gathered in a
+ * single pass and sorted once
+ */
+void uvfs_alloc_init(uvfs_allocator_t * alloc, const uvfs_image_t * image)
+{
+    unsigned int i, run = 0;
+
+    memset(alloc, 0, sizeof(uvfs_allocator_t));
+    alloc->root = alloc->unused = -1;
+    alloc->num_blocks = image->sb.num_blocks;
+    alloc->bitmap = xrealloc(NULL, alloc->num_blocks / 8 + 1);
+    memset(alloc->bitmap, 0, alloc->num_blocks / 8 + 1);
+
+    for(i = 0; i <= alloc->num_blocks; i++)
+    {
+        if(i < alloc->num_blocks && image->fat[i] == FAT_AVAILABLE)
+        {
+            run++;
+            continue;
+        }
+
+        if(i < alloc->num_blocks)
+            alloc->bitmap[i / 8] |= 1 << (i % 8);
+        if(run == 0)
+            continue;
+
+        if(alloc->num_extents == alloc->cap_nodes)
+        {
+            alloc->cap_nodes = alloc->cap_nodes ? alloc->cap_nodes * 2 : 64;
+            alloc->nodes = xrealloc(alloc->nodes, alloc->cap_nodes * sizeof(uvfs_extent_node_t));
+        }
+        alloc->nodes[alloc->num_extents].extent.start = i - run;
+        alloc->nodes[alloc->num_extents++].extent.length = run;
+        alloc->free_blocks += run;
+        run = 0;
+    }
+
+    qsort(alloc->nodes, alloc->num_extents, sizeof(uvfs_extent_node_t), compare_extents);
+    alloc->root = build_tree(alloc, 0, alloc->num_extents);
+}
+
+void uvfs_alloc_destroy(uvfs_allocator_t * alloc)
+{
+    free(alloc->bitmap);
+    free(alloc->nodes);
+    memset(alloc, 0, sizeof(uvfs_allocator_t));
+    alloc->root = alloc->unused = -1;
+}
+
+/*
+ * Returns whether block is marked in use
+ */
+int uvfs_alloc_in_use(const uvfs_allocator_t * alloc, unsigned int block)
+{
+    return (alloc->bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * Allocates count blocks, preferring the best-fitting single extent and
+ * otherwise the fewest largest extents. Returns the extents in ascending
+ * block order (caller frees) and their number in *num_extents, or NULL if
+ * there are not enough free blocks.
+ */
+uvfs_extent_t * uvfs_alloc_blocks(uvfs_allocator_t * alloc, unsigned int count, int * num_extents)
+{
+    uvfs_extent_t * out = NULL;
+    int n = 0;
+
+    *num_extents = 0;
+    if(count > alloc->free_blocks)
+        return NULL;
+
+    while(count > 0)
+    {
+        int node = lower_bound(alloc, count);
+        uvfs_extent_t e;
+
+        if(node >= 0)
+        {
+            // best fit: carve the request off the front of the smallest
+            // extent that holds all of it
+            e = alloc->nodes[node].extent;
+            remove_extent(alloc, e);
+            if(e.length > count)
+                insert_extent(alloc, e.start + count, e.length - count);
+            e.length = count;
+        }
+        else
+        {
+            // nothing holds the rest; take the largest run whole
+            for(node = alloc->root; alloc->nodes[node].right >= 0; node = alloc->nodes[node].right)
+                ;
+            e = alloc->nodes[node].extent;
+            remove_extent(alloc, e);
+        }
+
+        mark_used(alloc, e.start, e.length);
+        out = xrealloc(out, (n + 1) * sizeof(uvfs_extent_t));
+        out[n++] = e;
+        count -= e.length;
+    }
+
+    qsort(out, n, sizeof(uvfs_extent_t), compare_start);
+    *num_extents = n;
+    return out;
+}
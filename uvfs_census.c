@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include "uvfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UVFS_HAVE_X86 1
+#endif
+
+/*
+ * FAT census: counts available and reserved entries over the FAT in one
+ * pass. Entries are compared in on-disk (network) byte order so no entry
+ * is ever byte-swapped; anything neither available nor reserved counts as
+ * allocated.
+ */
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+static void count_fat_scalar(const uint32_t * fat, size_t n, size_t * nfree, size_t * nresv)
+{
+    const uint32_t resv = htonl(FAT_RESERVED);
+    size_t i, f = 0, r = 0;
+
+    for(i = 0; i < n; i++)
+    {
+        f += (fat[i] == FAT_AVAILABLE);
+        r += (fat[i] == resv);
+    }
+    *nfree += f;
+    *nresv += r;
+}
+
+#ifdef UVFS_HAVE_X86
+
+__attribute__((target("sse2")))
+static void count_fat_sse2(const uint32_t * fat, size_t n, size_t * nfree, size_t * nresv)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i resv = _mm_set1_epi32(htonl(FAT_RESERVED));
+    __m128i cf = zero, cr = zero;
+    uint32_t lanes[4];
+    size_t i;
+
+    // compare masks are -1 per matching lane, so subtracting them counts;
+    // num_blocks is 32 bits wide so per-lane counters cannot overflow
+    for(i = 0; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+        cf = _mm_sub_epi32(cf, _mm_cmpeq_epi32(v, zero));
+        cr = _mm_sub_epi32(cr, _mm_cmpeq_epi32(v, resv));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, cf);
+    *nfree += (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128((__m128i *)lanes, cr);
+    *nresv += (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    count_fat_scalar(fat + i, n - i, nfree, nresv);
+}
+
+__attribute__((target("avx2")))
+static void count_fat_avx2(const uint32_t * fat, size_t n, size_t * nfree, size_t * nresv)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i resv = _mm256_set1_epi32(htonl(FAT_RESERVED));
+    __m256i cf = zero, cr = zero;
+    uint32_t lanes[8];
+    size_t i;
+    int j;
+
+    for(i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+        cf = _mm256_sub_epi32(cf, _mm256_cmpeq_epi32(v, zero));
+        cr = _mm256_sub_epi32(cr, _mm256_cmpeq_epi32(v, resv));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, cf);
+    for(j = 0; j < 8; j++)
+        *nfree += lanes[j];
+    _mm256_storeu_si256((__m256i *)lanes, cr);
+    for(j = 0; j < 8; j++)
+        *nresv += lanes[j];
+
+    count_fat_scalar(fat + i, n - i, nfree, nresv);
+}
+
+#endif
+
+/*
+ * Returns whether kernel can run on this machine
+ */
+int uvfs_census_supported(int kernel)
+{
+    switch(kernel) {
+    case UVFS_CENSUS_SCALAR: return 1;
+#ifdef UVFS_HAVE_X86
+    case UVFS_CENSUS_SSE2: return __builtin_cpu_supports("sse2");
+    case UVFS_CENSUS_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return 0;
+    }
+}
+
+/*
+ * Returns the fastest kernel supported on this machine
+ */
+int uvfs_census_best(void)
+{
+    if(uvfs_census_supported(UVFS_CENSUS_AVX2))
+        return UVFS_CENSUS_AVX2;
+    if(uvfs_census_supported(UVFS_CENSUS_SSE2))
+        return UVFS_CENSUS_SSE2;
+    return UVFS_CENSUS_SCALAR;
+}
+
+char * uvfs_census_name(int kernel)
+{
+    switch(kernel) {
+    case UVFS_CENSUS_SCALAR: return "scalar";
+    case UVFS_CENSUS_SSE2: return "sse2";
+    case UVFS_CENSUS_AVX2: return "avx2";
+    default: return "?!?";
+    }
+}
+
+/*
+ * Adds the available and reserved entries among the n FAT entries at fat
+ * (network byte order) to *nfree and *nresv using the given kernel
+ */
+void uvfs_count_fat(int kernel, const uint32_t * fat, size_t n, size_t * nfree, size_t * nresv)
+{
+    switch(kernel) {
+#ifdef UVFS_HAVE_X86
+    case UVFS_CENSUS_SSE2: count_fat_sse2(fat, n, nfree, nresv); break;
+    case UVFS_CENSUS_AVX2: count_fat_avx2(fat, n, nfree, nresv); break;
+#endif
+    default: count_fat_scalar(fat, n, nfree, nresv); break;
+    }
+}
+
+/*
+ * Counts free, reserved and allocated blocks over the whole FAT
+ */
+void uvfs_fat_census(const uvfs_image_t * image, uvfs_census_t * census)
+{
+    size_t nfree = 0, nresv = 0;
+
+    uvfs_count_fat(uvfs_census_best(), image->fat, image->sb.num_blocks, &nfree, &nresv);
+
+    census->free_blocks = nfree;
+    census->resv_blocks = nresv;
+    census->alloc_blocks = image->sb.num_blocks - nfree - nresv;
+}
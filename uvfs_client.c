@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "uvfs.h"
+
+/*
+ * Client side of the uvfsd protocol (see uvfs.h): one request per
+ * connection, errors reported and exited on like a local failure.
+ */
+
+#define CLIENT_CHUNK (64 << 10)
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static void         send_all(int fd, const void * buffer, size_t len);
+static void         recv_all(int fd, void * buffer, size_t len);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+static void send_all(int fd, const void * buffer, size_t len)
+{
+    const unsigned char * p = buffer;
+
+    while(len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            fprintf(stderr, "Lost connection to server.\n");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void recv_all(int fd, void * buffer, size_t len)
+{
+    unsigned char * p = buffer;
+
+    while(len > 0)
+    {
+        ssize_t n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            fprintf(stderr, "Lost connection to server.\n");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Sends one request to the uvfsd listening on server. For UVFSD_STORE,
+ * length bytes of src_fd follow the header. A server error is printed
+ * and exits. Otherwise the payload is copied to out_fd if it is not -1,
+ * or returned in a buffer the caller frees, its size in *payload_len.
+ */
+void * uvfs_client_call(const char * server, uint32_t op, const char * imagename,
+    const char * filename, uint64_t offset, uint64_t length, int src_fd,
+    int out_fd, uint64_t * payload_len)
+{
+    struct sockaddr_un addr;
+    uvfsd_request_t req;
+    uvfsd_response_t resp;
+    char path[PATH_MAX];
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(server) >= sizeof(addr.sun_path) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        fprintf(stderr, "Could not connect to server.\n");
+        exit(1);
+    }
+    strcpy(addr.sun_path, server);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Could not connect to server.\n");
+        exit(1);
+    }
+
+    // the server knows its images by canonical path
+    if(realpath(imagename, path) == NULL)
+    {
+        strncpy(path, imagename, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+    }
+
+    memcpy(req.magic, UVFSD_MAGIC, UVFSD_MAGIC_LEN);
+    req.op = op;
+    req.image_len = strlen(path);
+    req.name_len = filename != NULL ? strlen(filename) : 0;
+    req.offset = offset;
+    req.length = length;
+
+    send_all(fd, &req, sizeof(req));
+    send_all(fd, path, req.image_len);
+    send_all(fd, filename, req.name_len);
+
+    if(src_fd >= 0)
+    {
+        unsigned char * buffer = malloc(CLIENT_CHUNK);
+        off_t done = 0;
+
+        if(buffer == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        while(done < length)
+        {
+            size_t want = length - done < CLIENT_CHUNK ? length - done : CLIENT_CHUNK;
+            if(uvfs_pread(src_fd, buffer, want, done) != want)
+            {
+                fprintf(stderr, "Read failed.\n");
+                exit(1);
+            }
+            send_all(fd, buffer, want);
+            done += want;
+        }
+        free(buffer);
+    }
+
+    recv_all(fd, &resp, sizeof(resp));
+    if(strncmp(resp.magic, UVFSD_MAGIC, UVFSD_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "Bad response from server.\n");
+        exit(1);
+    }
+
+    unsigned char * payload = malloc(out_fd >= 0 || resp.status != 0 ?
+        CLIENT_CHUNK + 1 : resp.length + 1);
+    if(payload == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(resp.status != 0)
+    {
+        size_t len = resp.length < CLIENT_CHUNK ? resp.length : CLIENT_CHUNK;
+        recv_all(fd, payload, len);
+        payload[len] = '\0';
+        fprintf(stderr, "%s\n", payload);
+        exit(1);
+    }
+
+    if(out_fd < 0)
+    {
+        recv_all(fd, payload, resp.length);
+        close(fd);
+        if(payload_len != NULL)
+            *payload_len = resp.length;
+        return payload;
+    }
+
+    while(resp.length > 0)
+    {
+        size_t len = resp.length < CLIENT_CHUNK ? resp.length : CLIENT_CHUNK;
+        const unsigned char * p = payload;
+
+        recv_all(fd, payload, len);
+        resp.length -= len;
+        while(len > 0)
+        {
+            ssize_t n = write(out_fd, p, len);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                fprintf(stderr, "Write failed.\n");
+                exit(1);
+            }
+            p += n;
+            len -= n;
+        }
+    }
+
+    free(payload);
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,617 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+/*
+ * Subdirectories.
+ *
+ * A subdirectory is a B+-tree of directory entries keyed by name (see
+ * disk.h), so finding a name reads one node per level and a directory of
+ * any size lists in name order. Readers use the tree as it is in the
+ * image; writers go through a store, which gives new nodes blocks from
+ * its allocator, links them into the directory's chain right after the
+ * root node and keeps every node it changes in memory until
+ * uvfs_dir_flush, so like the FAT they reach the image together, and in
+ * the run's transaction on a journalled image.
+ *
+ * A full node splits in two, the upper half moving to a new node whose
+ * first name becomes the separator in the parent. When the root itself
+ * is full both halves move to new nodes and the root becomes their
+ * parent, so the root node stays where the directory entry points.
+ * Removing an entry never merges nodes; a directory keeps the blocks it
+ * has grown to until it is removed.
+ */
+
+#define DIR_MAX_LEVEL 32
+
+typedef struct dir_walk dir_walk_t;
+struct dir_walk {
+    uvfs_dir_fn fn;
+    void * arg;
+    int all;                            // claims as well as visible entries
+    int check;                          // skip damaged nodes rather than exit
+    int damaged;                        // a node was skipped
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static unsigned int node_capacity(const uvfs_image_t * image);
+static const dir_node_t * node_check(const uvfs_image_t * image, unsigned int block, int level);
+static const dir_node_t * node_at(const uvfs_image_t * image, unsigned int block, int level);
+static const dir_node_t * store_node(uvfs_store_t * store, unsigned int block, int level);
+static void         corrupt(void);
+static int          child_for(const dir_node_t * node, const char * name);
+static int          leaf_search(const dir_node_t * node, const char * name, int * found);
+static unsigned int find_leaf(const uvfs_image_t * image, uvfs_store_t * store, unsigned int root,
+                        const char * name);
+static void         walk(const uvfs_image_t * image, unsigned int block, int level, dir_walk_t * w);
+static void         count_entry(const directory_entry_t * de, void * arg);
+static int          node_slot(const uvfs_store_t * store, unsigned int block, int * found);
+static dir_node_t * node_new(uvfs_store_t * store, unsigned int block, int level);
+static dir_node_t * node_read(uvfs_store_t * store, unsigned int block, int level);
+static unsigned int node_alloc(uvfs_store_t * store, unsigned int root);
+static int          node_insert(uvfs_store_t * store, unsigned int root, unsigned int block, int level,
+                        const directory_entry_t * rec, directory_entry_t * sep, unsigned int * added);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Returns the records a node holds
+ */
+static unsigned int node_capacity(const uvfs_image_t * image)
+{
+    return image->sb.block_size / SIZE_DIR_ENTRY - 1;
+}
+
+static void corrupt(void)
+{
+    fprintf(stderr, "Specified directory is damaged.\n");
+    exit(1);
+}
+
+/*
+ * Returns the node in block, checked to be a node at level, or at any
+ * level if level is negative. Returns NULL if it is not.
+ */
+static const dir_node_t * node_check(const uvfs_image_t * image, unsigned int block, int level)
+{
+    const dir_node_t * node;
+
+    if(block == 0 || uvfs_block_bytes(image, block) != image->sb.block_size)
+        return NULL;
+
+    node = (const dir_node_t *)uvfs_block(image, block);
+    if(strncmp(node->magic, DIR_NODE_MAGIC, DIR_NODE_MAGIC_LEN) != 0 ||
+        ntohs(node->count) > node_capacity(image) || ntohs(node->level) > DIR_MAX_LEVEL ||
+        (level >= 0 && ntohs(node->level) != level) ||
+        (ntohs(node->level) > 0 && ntohs(node->count) == 0))
+        return NULL;
+    return node;
+}
+
+/*
+ * Returns the node in block like node_check, exiting if it is damaged
+ */
+static const dir_node_t * node_at(const uvfs_image_t * image, unsigned int block, int level)
+{
+    const dir_node_t * node = node_check(image, block, level);
+
+    if(node == NULL)
+        corrupt();
+    return node;
+}
+
+/*
+ * Returns the record of interior node whose child holds name: the last
+ * one whose key is not after name, the first if none is
+ */
+static int child_for(const dir_node_t * node, const char * name)
+{
+    int lo = 1, hi = ntohs(node->count) - 1, i = 0;
+
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(strncmp(node->records[mid].filename, name, DIR_FILENAME_MAX) <= 0)
+        {
+            i = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return i;
+}
+
+/*
+ * Returns where name is or would go in a leaf, setting found if it is there
+ */
+static int leaf_search(const dir_node_t * node, const char * name, int * found)
+{
+    int lo = 0, hi = ntohs(node->count);
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(strncmp(node->records[mid].filename, name, DIR_FILENAME_MAX) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = lo < ntohs(node->count) &&
+        strncmp(node->records[lo].filename, name, DIR_FILENAME_MAX) == 0;
+    return lo;
+}
+
+/*
+ * Returns the leaf of the tree rooted at root that holds or would hold
+ * name, as the image has it or, given a store, as the store has it
+ */
+static unsigned int find_leaf(const uvfs_image_t * image, uvfs_store_t * store, unsigned int root,
+    const char * name)
+{
+    const dir_node_t * node = store ? store_node(store, root, -1) : node_at(image, root, -1);
+    int level = ntohs(node->level);
+    unsigned int block = root;
+
+    while(level > 0)
+    {
+        block = ntohl(node->records[child_for(node, name)].start_block);
+        level--;
+        node = store ? store_node(store, block, level) : node_at(image, block, level);
+    }
+    return block;
+}
+
+/*
+ * Finds name in the directory rooted at root and copies its entry, on-disk
+ * byte order, to de. Returns 0 if there is no such entry. Claimed entries
+ * are found too; their status is available.
+ */
+int uvfs_dir_find(const uvfs_image_t * image, unsigned int root, const char * name, directory_entry_t * de)
+{
+    const dir_node_t * node = node_at(image, find_leaf(image, NULL, root, name), 0);
+    int found, i = leaf_search(node, name, &found);
+
+    if(found)
+        *de = node->records[i];
+    return found;
+}
+
+/*
+ * Looks path up from the root directory, components separated by '/',
+ * and copies the entry it names, on-disk byte order, to de. Returns 0 if
+ * any component is missing or not a directory.
+ */
+int uvfs_lookup(const uvfs_image_t * image, const char * path, directory_entry_t * de)
+{
+    char name[DIR_FILENAME_MAX];
+    unsigned int dir = 0;
+    size_t len;
+
+    for(;;)
+    {
+        while(*path == '/')
+            path++;
+        len = strcspn(path, "/");
+        if(len == 0 || len >= DIR_FILENAME_MAX)
+            return 0;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        if(dir == 0)
+        {
+            int e = uvfs_find_entry(image, name);
+
+            if(e < 0)
+                return 0;
+            *de = image->dir[e];
+        }
+        else if(!uvfs_dir_find(image, dir, name, de))
+            return 0;
+
+        if(de->status != DIR_ENTRY_NORMALFILE && de->status != DIR_ENTRY_DIRECTORY)
+            return 0;
+
+        while(*path == '/')
+            path++;
+        if(*path == '\0')
+            return 1;
+        if(de->status != DIR_ENTRY_DIRECTORY)
+            return 0;
+        dir = ntohl(de->start_block);
+    }
+}
+
+static void walk(const uvfs_image_t * image, unsigned int block, int level, dir_walk_t * w)
+{
+    const dir_node_t * node = w->check ? node_check(image, block, level) : node_at(image, block, level);
+    int i;
+
+    if(node == NULL)
+    {
+        w->damaged = 1;
+        return;
+    }
+
+    for(i = 0; i < ntohs(node->count); i++)
+    {
+        const directory_entry_t * rec = &node->records[i];
+
+        if(level > 0)
+            walk(image, ntohl(rec->start_block), level - 1, w);
+        else if(w->all || rec->status == DIR_ENTRY_NORMALFILE || rec->status == DIR_ENTRY_DIRECTORY)
+            w->fn(rec, w->arg);
+    }
+}
+
+/*
+ * Calls fn with every file and directory in the directory rooted at root,
+ * in name order, entries in on-disk byte order
+ */
+void uvfs_dir_list(const uvfs_image_t * image, unsigned int root, uvfs_dir_fn fn, void * arg)
+{
+    dir_walk_t w = { fn, arg, 0, 0, 0 };
+
+    walk(image, root, ntohs(node_at(image, root, -1)->level), &w);
+}
+
+/*
+ * Calls fn with every record in the directory rooted at root, the claims
+ * of stores filling it included, in name order. Damaged nodes are passed
+ * over, with what they hold, rather than exited on. Returns 0 if there
+ * were any.
+ */
+int uvfs_dir_scan(const uvfs_image_t * image, unsigned int root, uvfs_dir_fn fn, void * arg)
+{
+    const dir_node_t * node = node_check(image, root, -1);
+    dir_walk_t w = { fn, arg, 1, 1, 0 };
+
+    if(node == NULL)
+        return 0;
+    walk(image, root, ntohs(node->level), &w);
+    return !w.damaged;
+}
+
+static void count_entry(const directory_entry_t * de, void * arg)
+{
+    (*(unsigned long *)arg)++;
+}
+
+/*
+ * Returns the number of entries in the directory rooted at root, those
+ * other stores are filling included
+ */
+unsigned long uvfs_dir_count(const uvfs_image_t * image, unsigned int root)
+{
+    unsigned long n = 0;
+    dir_walk_t w = { count_entry, &n, 1, 0, 0 };
+
+    walk(image, root, ntohs(node_at(image, root, -1)->level), &w);
+    return n;
+}
+
+/*
+ * Checks that a walk down the tree may go into the directory at: exits
+ * if it is one of the directories the walk is already in, which would
+ * take the walk round a loop for good
+ */
+void uvfs_dir_enter(const uvfs_dir_path_t * at)
+{
+    const uvfs_dir_path_t * up;
+
+    for(up = at->parent; up != NULL; up = up->parent)
+    {
+        if(up->root == at->root)
+            corrupt();
+    }
+}
+
+/*
+ * Returns where block is or would go among the store's changed nodes,
+ * setting found if it is there
+ */
+static int node_slot(const uvfs_store_t * store, unsigned int block, int * found)
+{
+    int lo = 0, hi = store->num_nodes;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(store->nodes[mid].block < block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = lo < store->num_nodes && store->nodes[lo].block == block;
+    return lo;
+}
+
+/*
+ * Returns the node in block as the store has it: changed, or as in the image
+ */
+static const dir_node_t * store_node(uvfs_store_t * store, unsigned int block, int level)
+{
+    int found, i = node_slot(store, block, &found);
+    const dir_node_t * node;
+
+    if(!found)
+        return node_at(store->image, block, level);
+
+    node = (const dir_node_t *)store->nodes[i].data;
+    if(level >= 0 && ntohs(node->level) != level)
+        corrupt();
+    return node;
+}
+
+/*
+ * Starts an empty node at level in block, to be written by uvfs_dir_flush
+ */
+static dir_node_t * node_new(uvfs_store_t * store, unsigned int block, int level)
+{
+    int found, i = node_slot(store, block, &found);
+    dir_node_t * node;
+
+    if(!found)
+    {
+        store->nodes = realloc(store->nodes, (store->num_nodes + 1) * sizeof(uvfs_dirnode_t));
+        if(store->nodes == NULL ||
+            (node = malloc(store->image->sb.block_size + SIZE_DIR_ENTRY)) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memmove(&store->nodes[i + 1], &store->nodes[i], (store->num_nodes - i) * sizeof(uvfs_dirnode_t));
+        store->nodes[i].block = block;
+        store->nodes[i].data = (unsigned char *)node;
+        store->num_nodes++;
+    }
+    node = (dir_node_t *)store->nodes[i].data;
+
+    memset(node, 0, store->image->sb.block_size + SIZE_DIR_ENTRY);
+    memcpy(node->magic, DIR_NODE_MAGIC, DIR_NODE_MAGIC_LEN);
+    node->level = htons(level);
+    return node;
+}
+
+/*
+ * Returns the node in block for changing, with room for one record more
+ * than it can hold
+ */
+static dir_node_t * node_read(uvfs_store_t * store, unsigned int block, int level)
+{
+    int found;
+    const dir_node_t * node;
+
+    node_slot(store, block, &found);
+    if(found)
+        return (dir_node_t *)store_node(store, block, level);
+
+    node = node_at(store->image, block, level);
+    dir_node_t * copy = node_new(store, block, level);
+    memcpy(copy, node, store->image->sb.block_size);
+    return copy;
+}
+
+/*
+ * Takes a block for a new node of the directory rooted at root and links
+ * it into the chain after the root
+ */
+static unsigned int node_alloc(uvfs_store_t * store, unsigned int root)
+{
+    int num_extents;
+    uvfs_extent_t * extents = uvfs_alloc_blocks(&store->alloc, 1, &num_extents);
+    unsigned int block;
+
+    if(extents == NULL)
+    {
+        fprintf(stderr, "Not enough room for directory.\n");
+        exit(1);
+    }
+    block = extents[0].start;
+    free(extents);
+
+    uvfs_fatcache_set(&store->fat, block, uvfs_fatcache_get(&store->fat, root));
+    uvfs_fatcache_set(&store->fat, root, block);
+    store->census.free_blocks--;
+    store->census.alloc_blocks++;
+    return block;
+}
+
+/*
+ * Finds name in the directory rooted at root as the store has it and
+ * copies its entry to de. Returns 0 if there is no such entry.
+ */
+int uvfs_dir_get(uvfs_store_t * store, unsigned int root, const char * name, directory_entry_t * de)
+{
+    const dir_node_t * node = store_node(store, find_leaf(store->image, store, root, name), 0);
+    int found, i = leaf_search(node, name, &found);
+
+    if(found)
+        *de = node->records[i];
+    return found;
+}
+
+/*
+ * Makes an empty directory. Returns its root node.
+ */
+unsigned int uvfs_dir_create(uvfs_store_t * store)
+{
+    int num_extents;
+    uvfs_extent_t * extents;
+    unsigned int block;
+
+    // a root split leaves two records, and either half must fit a node
+    if(node_capacity(store->image) < 3)
+    {
+        fprintf(stderr, "Block size too small for directories.\n");
+        exit(1);
+    }
+
+    if((extents = uvfs_alloc_blocks(&store->alloc, 1, &num_extents)) == NULL)
+    {
+        fprintf(stderr, "Not enough room for directory.\n");
+        exit(1);
+    }
+    block = extents[0].start;
+    free(extents);
+
+    uvfs_fatcache_set(&store->fat, block, FAT_LASTBLOCK);
+    store->census.free_blocks--;
+    store->census.alloc_blocks++;
+
+    node_new(store, block, 0);
+    return block;
+}
+
+/*
+ * Inserts rec into the subtree at block. If the node splits, the new
+ * right half's separator goes in sep and 1 is returned.
+ */
+static int node_insert(uvfs_store_t * store, unsigned int root, unsigned int block, int level,
+    const directory_entry_t * rec, directory_entry_t * sep, unsigned int * added)
+{
+    unsigned int cap = node_capacity(store->image);
+    directory_entry_t child_sep;
+    dir_node_t * node, * right;
+    int count, pos, found, half;
+
+    if(level == 0)
+    {
+        node = node_read(store, block, level);
+        pos = leaf_search(node, rec->filename, &found);
+    }
+    else
+    {
+        int i = child_for(store_node(store, block, level), rec->filename);
+        unsigned int child = ntohl(store_node(store, block, level)->records[i].start_block);
+
+        if(!node_insert(store, root, child, level - 1, rec, &child_sep, added))
+            return 0;
+        node = node_read(store, block, level);
+        pos = i + 1;
+        rec = &child_sep;
+    }
+
+    count = ntohs(node->count);
+    memmove(&node->records[pos + 1], &node->records[pos], (count - pos) * sizeof(directory_entry_t));
+    node->records[pos] = *rec;
+    node->count = htons(++count);
+
+    if(count <= cap)
+        return 0;
+
+    half = count / 2;
+
+    if(block == root)
+    {
+        // the root keeps its block: both halves move out below it
+        unsigned int lb = node_alloc(store, root), rb = node_alloc(store, root);
+        dir_node_t * left = node_new(store, lb, level);
+
+        right = node_new(store, rb, level);
+        node = node_read(store, block, level);
+        memcpy(left->records, node->records, half * sizeof(directory_entry_t));
+        left->count = htons(half);
+        memcpy(right->records, &node->records[half], (count - half) * sizeof(directory_entry_t));
+        right->count = htons(count - half);
+
+        memset(node->records, 0, count * sizeof(directory_entry_t));
+        strncpy(node->records[0].filename, left->records[0].filename, DIR_FILENAME_MAX);
+        node->records[0].start_block = htonl(lb);
+        strncpy(node->records[1].filename, right->records[0].filename, DIR_FILENAME_MAX);
+        node->records[1].start_block = htonl(rb);
+        node->level = htons(level + 1);
+        node->count = htons(2);
+
+        *added += 2;
+        return 0;
+    }
+
+    unsigned int rb = node_alloc(store, root);
+
+    right = node_new(store, rb, level);
+    node = node_read(store, block, level);
+    memcpy(right->records, &node->records[half], (count - half) * sizeof(directory_entry_t));
+    right->count = htons(count - half);
+    memset(&node->records[half], 0, (count - half) * sizeof(directory_entry_t));
+    node->count = htons(half);
+
+    memset(sep, 0, sizeof(directory_entry_t));
+    strncpy(sep->filename, right->records[0].filename, DIR_FILENAME_MAX);
+    sep->start_block = htonl(rb);
+
+    *added += 1;
+    return 1;
+}
+
+/*
+ * Inserts rec, on-disk byte order, into the directory rooted at root,
+ * which must not already hold its name. Returns the number of nodes the
+ * directory grew by.
+ */
+unsigned int uvfs_dir_insert(uvfs_store_t * store, unsigned int root, const directory_entry_t * rec)
+{
+    directory_entry_t sep;
+    unsigned int added = 0;
+
+    node_insert(store, root, root, ntohs(store_node(store, root, -1)->level), rec, &sep, &added);
+    return added;
+}
+
+/*
+ * Overwrites the entry named rec->filename in the directory rooted at
+ * root with rec. Returns 0 if there is no such entry.
+ */
+int uvfs_dir_update(uvfs_store_t * store, unsigned int root, const directory_entry_t * rec)
+{
+    dir_node_t * node = node_read(store, find_leaf(store->image, store, root, rec->filename), 0);
+    int found, i = leaf_search(node, rec->filename, &found);
+
+    if(found)
+        node->records[i] = *rec;
+    return found;
+}
+
+/*
+ * Takes the entry named name out of the directory rooted at root.
+ * Returns 0 if there is no such entry.
+ */
+int uvfs_dir_delete(uvfs_store_t * store, unsigned int root, const char * name)
+{
+    dir_node_t * node = node_read(store, find_leaf(store->image, store, root, name), 0);
+    int found, i = leaf_search(node, name, &found), count = ntohs(node->count);
+
+    if(found)
+    {
+        memmove(&node->records[i], &node->records[i + 1], (count - i - 1) * sizeof(directory_entry_t));
+        memset(&node->records[count - 1], 0, sizeof(directory_entry_t));
+        node->count = htons(count - 1);
+    }
+    return found;
+}
+
+/*
+ * Writes every node the store has changed, in block order, and forgets them
+ */
+void uvfs_dir_flush(uvfs_store_t * store)
+{
+    uvfs_image_t * image = store->image;
+    int i;
+
+    for(i = 0; i < store->num_nodes; i++)
+    {
+        uvfs_pwrite(image, store->nodes[i].data, image->sb.block_size,
+            uvfs_block_offset(image, store->nodes[i].block));
+        free(store->nodes[i].data);
+    }
+    free(store->nodes);
+    store->nodes = NULL;
+    store->num_nodes = 0;
+}
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "uvfs.h"
+
+/*
+ * Root directory name index.
+ *
+ * uvfs_dirhash_t is an in-memory open-addressing table built from one
+ * pass over the mapped directory. Its slot array uses the on-image layout
+ * described in disk.h, so the same table can be written out as the
+ * persistent dirhash extension and probed in place by later runs without
+ * reading the directory at all.
+ */
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static unsigned int name_hash(const char * name);
+static int          probe(const uint32_t * slots, unsigned int num_slots, const directory_entry_t * dir,
+                        unsigned int dir_entries, const char * name);
+static int          dirtable_header(const uvfs_image_t * image, superblock_dirhash_t * h);
+static void         dirtable_write_header(uvfs_image_t * image, superblock_dirhash_t * h);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+static unsigned int name_hash(const char * name)
+{
+    return uvfs_checksum(name, strnlen(name, DIR_FILENAME_MAX));
+}
+
+/*
+ * Probes slots (network byte order) for name.
+ * Returns its directory entry index or -1.
+ */
+static int probe(const uint32_t * slots, unsigned int num_slots, const directory_entry_t * dir,
+    unsigned int dir_entries, const char * name)
+{
+    unsigned int i, s = name_hash(name) & (num_slots - 1);
+
+    for(i = 0; i < num_slots; i++, s = (s + 1) & (num_slots - 1))
+    {
+        uint32_t v = ntohl(slots[s]);
+
+        if(v == DIRHASH_EMPTY)
+            return -1;
+        if(v == DIRHASH_TOMBSTONE || v > dir_entries)
+            continue;
+
+        const directory_entry_t * de = &dir[v - 1];
+        if(de->status != DIR_ENTRY_AVAILABLE && strncmp(de->filename, name, DIR_FILENAME_MAX) == 0)
+            return v - 1;
+    }
+    return -1;
+}
+
+/*
+ * Returns the slot count used for a directory of dir_entries entries:
+ * a power of two at most half full
+ */
+unsigned int uvfs_dirhash_slots(unsigned int dir_entries)
+{
+    unsigned int n = 16;
+    while(n < 2 * dir_entries)
+        n *= 2;
+    return n;
+}
+
+/*
+ * Indexes every used entry of dir (the mapped root directory or a private
+ * copy of it) in one pass and notes the first free entry. Lookups compare
+ * names against dir, so it must outlive the index.
+ */
+void uvfs_dirhash_build(uvfs_dirhash_t * hash, const directory_entry_t * dir, unsigned int dir_entries)
+{
+    int i;
+
+    hash->dir = dir;
+    hash->dir_entries = dir_entries;
+    hash->num_slots = uvfs_dirhash_slots(dir_entries);
+    hash->first_free = -1;
+    if((hash->slots = calloc(hash->num_slots, sizeof(uint32_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(i = 0; i < dir_entries; i++)
+    {
+        if(dir[i].status == DIR_ENTRY_AVAILABLE)
+        {
+            if(hash->first_free < 0)
+                hash->first_free = i;
+            continue;
+        }
+        uvfs_dirhash_insert(hash, dir[i].filename, i);
+    }
+}
+
+void uvfs_dirhash_destroy(uvfs_dirhash_t * hash)
+{
+    free(hash->slots);
+    hash->slots = NULL;
+}
+
+int uvfs_dirhash_find(const uvfs_dirhash_t * hash, const char * name)
+{
+    return probe(hash->slots, hash->num_slots, hash->dir, hash->dir_entries, name);
+}
+
+/*
+ * Records name at directory entry index.
+ * Returns the slot used.
+ */
+unsigned int uvfs_dirhash_insert(uvfs_dirhash_t * hash, const char * name, int index)
+{
+    unsigned int s = name_hash(name) & (hash->num_slots - 1);
+
+    while(hash->slots[s] != htonl(DIRHASH_EMPTY) && hash->slots[s] != htonl(DIRHASH_TOMBSTONE))
+        s = (s + 1) & (hash->num_slots - 1);
+
+    hash->slots[s] = htonl(index + 1);
+    return s;
+}
+
+/*
+ * Reads the dirhash extension header.
+ * Returns 1 if a table is recorded and lies inside the image.
+ */
+static int dirtable_header(const uvfs_image_t * image, superblock_dirhash_t * h)
+{
+    if(image->sb.block_size < SB_DIRHASH_OFFSET + sizeof(superblock_dirhash_t))
+        return 0;
+
+    memcpy(h, image->map + SB_DIRHASH_OFFSET, sizeof(superblock_dirhash_t));
+    if(strncmp(h->magic, SB_DIRHASH_MAGIC, SB_DIRHASH_MAGIC_LEN) != 0 ||
+        ntohl(h->checksum) != uvfs_checksum(h, offsetof(superblock_dirhash_t, checksum)))
+        return 0;
+
+    unsigned int start = ntohl(h->table_start), blocks = ntohl(h->table_blocks);
+    unsigned int slots = ntohl(h->num_slots);
+
+    return slots > 0 && (slots & (slots - 1)) == 0 &&
+        (size_t)slots * sizeof(uint32_t) <= (size_t)blocks * image->sb.block_size &&
+        start + blocks <= image->sb.num_blocks &&
+        (size_t)(start + blocks) * image->sb.block_size <= image->map_len;
+}
+
+static void dirtable_write_header(uvfs_image_t * image, superblock_dirhash_t * h)
+{
+    h->checksum = htonl(uvfs_checksum(h, offsetof(superblock_dirhash_t, checksum)));
+    uvfs_pwrite(image, h, sizeof(superblock_dirhash_t), SB_DIRHASH_OFFSET);
+}
+
+/*
+ * Looks name up in the persistent table, touching only the table and the
+ * matching directory entry. Returns 1 and sets *index (-1 if absent) when
+ * the table is clean, 0 if the caller must fall back to a scan.
+ */
+int uvfs_dirtable_find(const uvfs_image_t * image, const char * name, int * index)
+{
+    superblock_dirhash_t h;
+
+    if(!dirtable_header(image, &h) || !(ntohl(h.flags) & SB_DIRHASH_CLEAN))
+        return 0;
+
+    const uint32_t * slots = (const uint32_t *)uvfs_block(image, ntohl(h.table_start));
+    *index = probe(slots, ntohl(h.num_slots), image->dir, image->dir_entries, name);
+    return 1;
+}
+
+/*
+ * Marks a clean table stale before the directory is modified.
+ * Returns 1 if the caller should maintain the table and commit it.
+ */
+int uvfs_dirtable_begin(uvfs_image_t * image)
+{
+    superblock_dirhash_t h;
+
+    image->dirtable_live = 0;
+    if(!dirtable_header(image, &h) || !(ntohl(h.flags) & SB_DIRHASH_CLEAN))
+        return 0;
+
+    h.flags = htonl(0);
+    dirtable_write_header(image, &h);
+    image->dirtable_live = 1;
+    return 1;
+}
+
+/*
+ * Adds name at directory entry index to the persistent table if it is
+ * being maintained (between uvfs_dirtable_begin and uvfs_dirtable_commit)
+ */
+void uvfs_dirtable_insert(uvfs_image_t * image, const char * name, int index)
+{
+    superblock_dirhash_t h;
+
+    if(!image->dirtable_live || !dirtable_header(image, &h))
+        return;
+
+    unsigned int num_slots = ntohl(h.num_slots);
+    size_t base = (size_t)ntohl(h.table_start) * image->sb.block_size;
+    const uint32_t * slots = (const uint32_t *)(image->map + base);
+    unsigned int s = name_hash(name) & (num_slots - 1);
+    uint32_t v = htonl(index + 1);
+
+    while(slots[s] != htonl(DIRHASH_EMPTY) && slots[s] != htonl(DIRHASH_TOMBSTONE))
+        s = (s + 1) & (num_slots - 1);
+
+    uvfs_pwrite(image, &v, sizeof(v), (off_t)base + (off_t)s * sizeof(uint32_t));
+}
+
+/*
+ * Removes the slot pointing at directory entry index, known by name, from
+ * the persistent table if it is being maintained
+ */
+void uvfs_dirtable_remove(uvfs_image_t * image, const char * name, int index)
+{
+    superblock_dirhash_t h;
+
+    if(!image->dirtable_live || !dirtable_header(image, &h))
+        return;
+
+    unsigned int num_slots = ntohl(h.num_slots), i;
+    size_t base = (size_t)ntohl(h.table_start) * image->sb.block_size;
+    const uint32_t * slots = (const uint32_t *)(image->map + base);
+    unsigned int s = name_hash(name) & (num_slots - 1);
+    uint32_t v = htonl(DIRHASH_TOMBSTONE);
+
+    for(i = 0; i < num_slots && slots[s] != htonl(DIRHASH_EMPTY); i++, s = (s + 1) & (num_slots - 1))
+    {
+        if(slots[s] == htonl(index + 1))
+        {
+            uvfs_pwrite(image, &v, sizeof(v), (off_t)base + (off_t)s * sizeof(uint32_t));
+            return;
+        }
+    }
+}
+
+/*
+ * Marks a maintained table clean again once the directory change is written
+ */
+void uvfs_dirtable_commit(uvfs_image_t * image)
+{
+    superblock_dirhash_t h;
+
+    if(!image->dirtable_live || !dirtable_header(image, &h))
+        return;
+
+    image->dirtable_live = 0;
+    h.flags = htonl(SB_DIRHASH_CLEAN);
+    dirtable_write_header(image, &h);
+}
+
+/*
+ * Writes hash as the persistent table in table_blocks blocks at
+ * table_start (already reserved in the FAT by the caller) and records it
+ * in the superblock extension
+ */
+void uvfs_dirtable_create(uvfs_image_t * image, const uvfs_dirhash_t * hash,
+    unsigned int table_start, unsigned int table_blocks)
+{
+    superblock_dirhash_t h;
+    size_t len = (size_t)table_blocks * image->sb.block_size;
+    unsigned char * table = calloc(1, len);
+
+    if(table == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(table, hash->slots, hash->num_slots * sizeof(uint32_t));
+    uvfs_pwrite(image, table, len, uvfs_block_offset(image, table_start));
+    free(table);
+
+    memcpy(h.magic, SB_DIRHASH_MAGIC, SB_DIRHASH_MAGIC_LEN);
+    h.flags = htonl(SB_DIRHASH_CLEAN);
+    h.table_start = htonl(table_start);
+    h.table_blocks = htonl(table_blocks);
+    h.num_slots = htonl(hash->num_slots);
+    dirtable_write_header(image, &h);
+}
+
+/*
+ * Returns the blocks held by a recorded table in *start and *blocks.
+ * Returns 0 if the image has no table.
+ */
+int uvfs_dirtable_location(const uvfs_image_t * image, unsigned int * start, unsigned int * blocks)
+{
+    superblock_dirhash_t h;
+
+    if(!dirtable_header(image, &h))
+        return 0;
+
+    *start = ntohl(h.table_start);
+    *blocks = ntohl(h.table_blocks);
+    return 1;
+}
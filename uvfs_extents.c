@@ -0,0 +1,235 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+/*
+ * Extent maps (uvicfs18, see disk.h).
+ *
+ * Readers take a file's runs from its map, a read per map block, and
+ * fall back to walking the chain whenever the map does not check out:
+ * the entry's hint, each block's magic and checksum, and runs that stay
+ * on the image and add up to the entry's num_blocks. Writers never change
+ * a map in place. A store gives every file it writes a new map at plan
+ * and frees the old one at commit, so whichever entry readers see points
+ * at a map that describes it.
+ */
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static unsigned int map_capacity(const uvfs_image_t * image);
+static unsigned int map_checksum(extent_map_t * m, unsigned int count);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Returns how many runs fit in one map block
+ */
+static unsigned int map_capacity(const uvfs_image_t * image)
+{
+    return (image->sb.block_size - sizeof(extent_map_t)) / sizeof(extent_run_t);
+}
+
+/*
+ * Returns the checksum of a map block holding count runs. m's checksum
+ * field is left zero.
+ */
+static unsigned int map_checksum(extent_map_t * m, unsigned int count)
+{
+    m->checksum = 0;
+    return uvfs_checksum(m, sizeof(extent_map_t) + (size_t)count * sizeof(extent_run_t));
+}
+
+/*
+ * Returns the runs of the map starting at block map, which must cover
+ * exactly num_blocks blocks, or NULL if it does not check out
+ */
+uvfs_extent_t * uvfs_map_extents(const uvfs_image_t * image, unsigned int map, unsigned int num_blocks,
+    int * num_extents)
+{
+    size_t bs = image->sb.block_size;
+    unsigned int cap = map_capacity(image), hops = 0, total = 0, count, sum, i;
+    uvfs_extent_t * extents = NULL;
+    extent_map_t * m;
+    int n = 0;
+
+    if((m = malloc(bs)) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    while(map != 0)
+    {
+        if(map >= image->sb.num_blocks || ++hops > num_blocks || uvfs_block_bytes(image, map) < bs)
+            goto bad;
+
+        memcpy(m, uvfs_block(image, map), bs);
+        count = ntohl(m->count);
+        sum = ntohl(m->checksum);
+        if(memcmp(m->magic, EXTENT_MAP_MAGIC, EXTENT_MAP_MAGIC_LEN) != 0 || count == 0 || count > cap ||
+            map_checksum(m, count) != sum)
+            goto bad;
+
+        if((extents = realloc(extents, (n + count) * sizeof(uvfs_extent_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        for(i = 0; i < count; i++)
+        {
+            unsigned int start = ntohl(m->runs[i].start), length = ntohl(m->runs[i].length);
+
+            if(length == 0 || start >= image->sb.num_blocks || length > image->sb.num_blocks - start ||
+                length > num_blocks - total)
+                goto bad;
+            extents[n].start = start;
+            extents[n++].length = length;
+            total += length;
+        }
+        map = ntohl(m->next);
+    }
+
+    if(n == 0 || total != num_blocks)
+        goto bad;
+    free(m);
+    *num_extents = n;
+    return extents;
+
+bad:
+    free(m);
+    free(extents);
+    return NULL;
+}
+
+/*
+ * Returns the runs of the file de (host byte order) in order, from its
+ * extent map where it has a good one and from its chain otherwise
+ */
+uvfs_extent_t * uvfs_entry_extents(const uvfs_image_t * image, const directory_entry_t * de, int * num_extents)
+{
+    directory_entry_t net = *de;
+    uvfs_extent_t * extents;
+    unsigned int map;
+
+    convertToNetDE(&net);
+    if((map = uvfs_entry_map(image, &net)) != 0 &&
+        (extents = uvfs_map_extents(image, map, de->num_blocks, num_extents)) != NULL)
+    {
+        if(extents[0].start == de->start_block)
+            return extents;
+        free(extents);
+    }
+    return uvfs_file_extents(image, de->start_block, num_extents);
+}
+
+/*
+ * Returns how many map blocks a map of num_extents runs takes
+ */
+unsigned int uvfs_map_blocks(const uvfs_image_t * image, int num_extents)
+{
+    unsigned int cap = map_capacity(image);
+
+    return num_extents > 0 ? (num_extents + cap - 1) / cap : 1;
+}
+
+/*
+ * Writes a map of extents into blocks, uvfs_map_blocks of them, which
+ * the caller has taken; the FAT is left to the caller
+ */
+void uvfs_map_put(uvfs_image_t * image, const unsigned int * blocks, const uvfs_extent_t * extents,
+    int num_extents)
+{
+    size_t bs = image->sb.block_size;
+    unsigned int cap = map_capacity(image), num_maps = uvfs_map_blocks(image, num_extents);
+    unsigned int count, k, i;
+    extent_map_t * m = malloc(bs);
+
+    if(m == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(k = 0; k < num_maps; k++)
+    {
+        count = num_extents - k * cap < cap ? num_extents - k * cap : cap;
+
+        memset(m, 0, bs);
+        memcpy(m->magic, EXTENT_MAP_MAGIC, EXTENT_MAP_MAGIC_LEN);
+        m->count = htonl(count);
+        m->next = htonl(k + 1 < num_maps ? blocks[k + 1] : 0);
+        for(i = 0; i < count; i++)
+        {
+            m->runs[i].start = htonl(extents[k * cap + i].start);
+            m->runs[i].length = htonl(extents[k * cap + i].length);
+        }
+        m->checksum = htonl(map_checksum(m, count));
+
+        uvfs_pwrite(image, m, bs, uvfs_block_offset(image, blocks[k]));
+    }
+    free(m);
+}
+
+/*
+ * Writes a map of extents to blocks from the store's allocator, each
+ * marked in the FAT as a chain of its own. Returns its first block.
+ */
+unsigned int uvfs_map_write(uvfs_store_t * store, const uvfs_extent_t * extents, int num_extents)
+{
+    unsigned int num_maps = uvfs_map_blocks(store->image, num_extents), b, k = 0;
+    unsigned int * blocks = malloc(num_maps * sizeof(unsigned int));
+    uvfs_extent_t * runs;
+    int num_runs, r;
+
+    if(blocks == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    if((runs = uvfs_alloc_blocks(&store->alloc, num_maps, &num_runs)) == NULL)
+    {
+        fprintf(stderr, "Not enough room for extent map.\n");
+        exit(1);
+    }
+    for(r = 0; r < num_runs; r++)
+    {
+        for(b = runs[r].start; b < runs[r].start + runs[r].length; b++)
+            blocks[k++] = b;
+    }
+    free(runs);
+
+    uvfs_map_put(store->image, blocks, extents, num_extents);
+    for(k = 0; k < num_maps; k++)
+        uvfs_fatcache_set(&store->fat, blocks[k], FAT_LASTBLOCK);
+
+    store->census.free_blocks -= num_maps;
+    store->census.alloc_blocks += num_maps;
+    b = blocks[0];
+    free(blocks);
+    return b;
+}
+
+/*
+ * Frees the blocks of the map starting at block map, as far as they are
+ * still map blocks. Returns how many were freed.
+ */
+unsigned int uvfs_map_free(uvfs_store_t * store, unsigned int map)
+{
+    uvfs_image_t * image = store->image;
+    unsigned int freed = 0;
+
+    while(map != 0 && map < image->sb.num_blocks && freed < image->sb.num_blocks &&
+        uvfs_block_bytes(image, map) == image->sb.block_size &&
+        memcmp(uvfs_block(image, map), EXTENT_MAP_MAGIC, EXTENT_MAP_MAGIC_LEN) == 0 &&
+        uvfs_fatcache_get(&store->fat, map) == FAT_LASTBLOCK)
+    {
+        const extent_map_t * m = (const extent_map_t *)uvfs_block(image, map);
+
+        uvfs_fatcache_set(&store->fat, map, FAT_AVAILABLE);
+        freed++;
+        map = ntohl(m->next);
+    }
+    return freed;
+}
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "uvfs.h"
+
+/*
+ * FAT paging cache.
+ *
+ * Holds a fixed number of FAT blocks in memory, so a writer's footprint
+ * depends on the cache size rather than the image size. Frames are found
+ * through a small hash on the FAT block number and kept on an LRU list;
+ * a dirty frame is written back when it is evicted and at flush time,
+ * when all remaining dirty frames go out in FAT order, adjacent blocks
+ * coalesced into one write.
+ */
+
+#define NO_FRAME -1
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static void         lru_unlink(uvfs_fatcache_t * cache, int f);
+static void         lru_push(uvfs_fatcache_t * cache, int f);
+static void         hash_remove(uvfs_fatcache_t * cache, int f);
+static void         write_back(uvfs_fatcache_t * cache, const int * frames, int n);
+static int          compare_frames(const void * a, const void * b, void * arg);
+static int          frame_for(uvfs_fatcache_t * cache, unsigned int fat_block);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Sets up a cache of at most bytes (at least one block, at most the
+ * whole FAT) over image, which must stay open while it is used
+ */
+void uvfs_fatcache_init(uvfs_fatcache_t * cache, uvfs_image_t * image, size_t bytes)
+{
+    size_t bs = image->sb.block_size;
+    size_t frames = bytes / bs;
+
+    if(frames < 1)
+        frames = 1;
+    if(frames > image->sb.fat_blocks)
+        frames = image->sb.fat_blocks;
+
+    memset(cache, 0, sizeof(uvfs_fatcache_t));
+    cache->image = image;
+    cache->entries_per_block = bs / SIZE_FAT_ENTRY;
+    cache->num_frames = frames;
+    cache->head = cache->tail = NO_FRAME;
+
+    cache->num_buckets = 16;
+    while(cache->num_buckets < 2 * frames)
+        cache->num_buckets *= 2;
+
+    cache->frames = calloc(frames, sizeof(uvfs_fatframe_t));
+    cache->data = malloc(frames * bs);
+    cache->buckets = malloc(cache->num_buckets * sizeof(int));
+    if(cache->frames == NULL || cache->data == NULL || cache->buckets == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memset(cache->buckets, 0xff, cache->num_buckets * sizeof(int));
+}
+
+/*
+ * Releases the cache; dirty frames not flushed are lost
+ */
+void uvfs_fatcache_destroy(uvfs_fatcache_t * cache)
+{
+    free(cache->frames);
+    free(cache->data);
+    free(cache->buckets);
+    cache->frames = NULL;
+    cache->data = NULL;
+    cache->buckets = NULL;
+}
+
+static void lru_unlink(uvfs_fatcache_t * cache, int f)
+{
+    uvfs_fatframe_t * frame = &cache->frames[f];
+
+    if(frame->prev != NO_FRAME)
+        cache->frames[frame->prev].next = frame->next;
+    else
+        cache->head = frame->next;
+
+    if(frame->next != NO_FRAME)
+        cache->frames[frame->next].prev = frame->prev;
+    else
+        cache->tail = frame->prev;
+}
+
+static void lru_push(uvfs_fatcache_t * cache, int f)
+{
+    uvfs_fatframe_t * frame = &cache->frames[f];
+
+    frame->prev = NO_FRAME;
+    frame->next = cache->head;
+    if(cache->head != NO_FRAME)
+        cache->frames[cache->head].prev = f;
+    cache->head = f;
+    if(cache->tail == NO_FRAME)
+        cache->tail = f;
+}
+
+static void hash_remove(uvfs_fatcache_t * cache, int f)
+{
+    int * link = &cache->buckets[cache->frames[f].block & (cache->num_buckets - 1)];
+
+    while(*link != f)
+        link = &cache->frames[*link].hash_next;
+    *link = cache->frames[f].hash_next;
+}
+
+/*
+ * Writes frames, which hold consecutive FAT blocks in ascending order,
+ * with one gathered write and marks them clean
+ */
+static void write_back(uvfs_fatcache_t * cache, const int * frames, int n)
+{
+    uvfs_image_t * image = cache->image;
+    size_t bs = image->sb.block_size;
+    off_t offset = uvfs_block_offset(image, image->sb.fat_start + cache->frames[frames[0]].block);
+    struct iovec iov[n];
+    ssize_t done;
+    int i;
+
+    for(i = 0; i < n; i++)
+    {
+        iov[i].iov_base = cache->frames[frames[i]].entries;
+        iov[i].iov_len = bs;
+        cache->frames[frames[i]].dirty = 0;
+    }
+
+    if(image->txn != NULL)
+    {
+        for(i = 0; i < n; i++, offset += bs)
+            uvfs_pwrite(image, iov[i].iov_base, bs, offset);
+        return;
+    }
+
+    do
+        done = pwritev(image->fd, iov, n, offset);
+    while(done < 0 && errno == EINTR);
+
+    if(done < 0)
+    {
+        fprintf(stderr, "Write failed.\n");
+        exit(1);
+    }
+
+    // finish a short gathered write block by block
+    for(i = 0; i < n; i++, offset += bs)
+    {
+        if(done >= bs)
+        {
+            done -= bs;
+            continue;
+        }
+        uvfs_pwrite(image, (unsigned char *)iov[i].iov_base + done, bs - done, offset + done);
+        done = 0;
+    }
+}
+
+static int compare_frames(const void * a, const void * b, void * arg)
+{
+    const uvfs_fatframe_t * frames = arg;
+    unsigned int x = frames[*(const int *)a].block, y = frames[*(const int *)b].block;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the frame holding fat_block (relative to fat_start), paging it
+ * in over the least recently used frame on a miss
+ */
+static int frame_for(uvfs_fatcache_t * cache, unsigned int fat_block)
+{
+    unsigned int bucket = fat_block & (cache->num_buckets - 1);
+    size_t bs = cache->image->sb.block_size;
+    int f;
+
+    for(f = cache->buckets[bucket]; f != NO_FRAME; f = cache->frames[f].hash_next)
+    {
+        if(cache->frames[f].block == fat_block)
+        {
+            cache->hits++;
+            if(cache->head != f)
+            {
+                lru_unlink(cache, f);
+                lru_push(cache, f);
+            }
+            return f;
+        }
+    }
+
+    cache->misses++;
+    if(cache->used_frames < cache->num_frames)
+    {
+        f = cache->used_frames++;
+        cache->frames[f].entries = (uint32_t *)(cache->data + (size_t)f * bs);
+    }
+    else
+    {
+        f = cache->tail;
+        if(cache->frames[f].dirty)
+            write_back(cache, &f, 1);
+        lru_unlink(cache, f);
+        hash_remove(cache, f);
+    }
+
+    uvfs_fatframe_t * frame = &cache->frames[f];
+    frame->block = fat_block;
+    frame->dirty = 0;
+    memcpy(frame->entries, cache->image->fat + (size_t)fat_block * cache->entries_per_block, bs);
+
+    frame->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = f;
+    lru_push(cache, f);
+    return f;
+}
+
+/*
+ * Returns the FAT entry for block in host byte order
+ */
+unsigned int uvfs_fatcache_get(uvfs_fatcache_t * cache, unsigned int block)
+{
+    int f = frame_for(cache, block / cache->entries_per_block);
+
+    return ntohl(cache->frames[f].entries[block % cache->entries_per_block]);
+}
+
+/*
+ * Sets the FAT entry for block to value (host byte order); it reaches the
+ * image on eviction or at the next flush
+ */
+void uvfs_fatcache_set(uvfs_fatcache_t * cache, unsigned int block, unsigned int value)
+{
+    int f = frame_for(cache, block / cache->entries_per_block);
+
+    cache->frames[f].entries[block % cache->entries_per_block] = htonl(value);
+    cache->frames[f].dirty = 1;
+}
+
+/*
+ * Forgets every frame, so later lookups see the FAT as it is now rather
+ * than as it was paged in. Dirty frames must have been flushed.
+ */
+void uvfs_fatcache_drop(uvfs_fatcache_t * cache)
+{
+    cache->used_frames = 0;
+    cache->head = cache->tail = NO_FRAME;
+    memset(cache->buckets, 0xff, cache->num_buckets * sizeof(int));
+}
+
+/*
+ * Writes every dirty frame back in FAT order, one write per run of
+ * adjacent FAT blocks
+ */
+void uvfs_fatcache_flush(uvfs_fatcache_t * cache)
+{
+    int * dirty = malloc((cache->used_frames + 1) * sizeof(int));
+    int n = 0, i, run;
+
+    if(dirty == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(i = 0; i < cache->used_frames; i++)
+    {
+        if(cache->frames[i].dirty)
+            dirty[n++] = i;
+    }
+
+    qsort_r(dirty, n, sizeof(int), compare_frames, cache->frames);
+
+    for(i = 0; i < n; i = run)
+    {
+        for(run = i + 1; run < n && run - i < IOV_MAX &&
+            cache->frames[dirty[run]].block == cache->frames[dirty[run - 1]].block + 1; run++)
+            ;
+        write_back(cache, dirty + i, run - i);
+    }
+    free(dirty);
+}
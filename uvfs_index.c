@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+/*
+ * Chain index: a file's extents in chain order together with the logical
+ * block each one starts at, so the extent holding any file offset is a
+ * binary search away. Indexes can be cached in a sidecar file, keyed by
+ * the directory entry fields that change whenever a store changes the
+ * chain. Moving blocks (uvfsdefrag) can leave those fields alone, so a
+ * sidecar whose key matches is still checked against the image: its
+ * extents must cover exactly the entry's blocks from its start block,
+ * and the FAT must link the end of each to the start of the next. That
+ * costs a FAT read per extent. A chain packed in place, the one move
+ * keeping the start block, always fails it: the end of its old first
+ * extent now links to the block after it.
+ */
+
+#define INDEX_MAGIC "uvix"
+#define INDEX_MAGIC_LEN 4
+
+typedef struct index_header index_header_t;
+struct index_header {
+             char  magic[INDEX_MAGIC_LEN];
+    unsigned int   start_block;
+    unsigned int   num_blocks;
+    unsigned int   file_size;
+    unsigned char  modify_time[DIR_TIME_WIDTH];
+    unsigned int   num_extents;
+} __attribute__ ((packed));
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static void         index_prefix(uvfs_index_t * index);
+static void         index_key(index_header_t * h, const directory_entry_t * de);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Fills in the logical starting block of every extent
+ */
+static void index_prefix(uvfs_index_t * index)
+{
+    unsigned int block = 0;
+    int i;
+
+    if((index->first_block = malloc((index->num_extents + 1) * sizeof(unsigned int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(i = 0; i < index->num_extents; i++)
+    {
+        index->first_block[i] = block;
+        block += index->extents[i].length;
+    }
+    index->first_block[i] = block;
+}
+
+static void index_key(index_header_t * h, const directory_entry_t * de)
+{
+    memset(h, 0, sizeof(index_header_t));
+    memcpy(h->magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    h->start_block = de->start_block;
+    h->num_blocks = de->num_blocks;
+    h->file_size = de->file_size;
+    memcpy(h->modify_time, de->modify_time, DIR_TIME_WIDTH);
+}
+
+/*
+ * Returns 1 if the extents in index are still the chain of de (host byte
+ * order) on image, checking the FAT at the end of each
+ */
+int uvfs_index_valid(const uvfs_image_t * image, const directory_entry_t * de, const uvfs_index_t * index)
+{
+    unsigned int total = 0, end, next;
+    int i;
+
+    if(index->num_extents == 0 || index->extents[0].start != de->start_block)
+        return 0;
+
+    for(i = 0; i < index->num_extents; i++)
+    {
+        unsigned int start = index->extents[i].start, length = index->extents[i].length;
+
+        if(length == 0 || start >= image->sb.num_blocks || length > image->sb.num_blocks - start ||
+            length > de->num_blocks - total)
+            return 0;
+        total += length;
+
+        end = start + length - 1;
+        next = i + 1 < index->num_extents ? index->extents[i + 1].start : FAT_LASTBLOCK;
+        if(uvfs_fat_entry(image, end) != next)
+            return 0;
+    }
+    return total == de->num_blocks;
+}
+
+/*
+ * Builds the index for de (host byte order) from its extent map, or with
+ * one chain walk
+ */
+void uvfs_index_build(const uvfs_image_t * image, const directory_entry_t * de, uvfs_index_t * index)
+{
+    index->extents = uvfs_entry_extents(image, de, &index->num_extents);
+    index_prefix(index);
+}
+
+/*
+ * Loads a cached index for de (host byte order) on image from path.
+ * Returns 1 on success, 0 if the sidecar is missing or describes another chain.
+ */
+int uvfs_index_load(const uvfs_image_t * image, const char * path, const directory_entry_t * de,
+    uvfs_index_t * index)
+{
+    index_header_t want, have;
+    FILE * f;
+
+    if((f = fopen(path, "rb")) == NULL)
+        return 0;
+
+    index_key(&want, de);
+    if(fread(&have, sizeof(have), 1, f) != 1 ||
+        memcmp(&want, &have, offsetof(index_header_t, num_extents)) != 0 ||
+        have.num_extents == 0 || have.num_extents > de->num_blocks)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    index->num_extents = have.num_extents;
+    if((index->extents = malloc(have.num_extents * sizeof(uvfs_extent_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    if(fread(index->extents, sizeof(uvfs_extent_t), have.num_extents, f) != have.num_extents)
+    {
+        free(index->extents);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    if(!uvfs_index_valid(image, de, index))
+    {
+        free(index->extents);
+        return 0;
+    }
+    index_prefix(index);
+    return 1;
+}
+
+/*
+ * Writes index for de to the sidecar at path; failures only cost the cache
+ */
+void uvfs_index_save(const char * path, const directory_entry_t * de, const uvfs_index_t * index)
+{
+    index_header_t h;
+    FILE * f;
+
+    if((f = fopen(path, "wb")) == NULL)
+        return;
+
+    index_key(&h, de);
+    h.num_extents = index->num_extents;
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(index->extents, sizeof(uvfs_extent_t), index->num_extents, f);
+    fclose(f);
+}
+
+void uvfs_index_destroy(uvfs_index_t * index)
+{
+    free(index->extents);
+    free(index->first_block);
+    index->extents = NULL;
+    index->first_block = NULL;
+    index->num_extents = 0;
+}
+
+/*
+ * Returns the index of the extent holding logical block, or num_extents
+ * if block is past the end of the chain
+ */
+int uvfs_index_lookup(const uvfs_index_t * index, unsigned int block)
+{
+    int lo = 0, hi = index->num_extents;
+
+    // last extent whose first logical block is <= block
+    while(lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if(index->first_block[mid + 1] <= block)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "uvfs.h"
+
+/*
+ * Streams byte ranges of an image to another descriptor without bouncing
+ * them through a user buffer. Each kernel path is tried in turn the first
+ * time a sender is used and the one that works is kept:
+ * copy_file_range (regular file output), sendfile, splice (pipe output),
+ * and finally plain write(2) straight from the image mapping.
+ */
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+void uvfs_sender_init(uvfs_sender_t * sender, int out_fd)
+{
+    sender->out_fd = out_fd;
+    sender->method = UVFS_SEND_COPY_RANGE;
+}
+
+/*
+ * Returns whether err means "this method cannot serve this pair of fds"
+ * rather than a real I/O failure
+ */
+static int unsupported(int err)
+{
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+        err == EOPNOTSUPP || err == ESPIPE;
+}
+
+/*
+ * One transfer of up to len bytes at offset with the current method.
+ * Returns bytes moved, 0 at end of image, or -1 with errno set.
+ */
+static ssize_t send_once(const uvfs_image_t * image, uvfs_sender_t * sender, off_t offset, size_t len)
+{
+    off_t off = offset;
+
+    switch(sender->method) {
+    case UVFS_SEND_COPY_RANGE:
+        return copy_file_range(image->fd, &off, sender->out_fd, NULL, len, 0);
+    case UVFS_SEND_SENDFILE:
+        return sendfile(sender->out_fd, image->fd, &off, len);
+    case UVFS_SEND_SPLICE:
+        return splice(image->fd, &off, sender->out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    default:
+        if(offset >= image->map_len)
+            return 0;
+        if(len > image->map_len - offset)
+            len = image->map_len - offset;
+        return write(sender->out_fd, image->map + offset, len);
+    }
+}
+
+/*
+ * Sends len bytes of image starting at offset to the sender's descriptor.
+ * Returns 0, UVFS_SEND_WRITE_FAILED if the descriptor failed (errno set)
+ * or UVFS_SEND_SHORT if the range runs past the end of the image.
+ */
+int uvfs_send_range(const uvfs_image_t * image, uvfs_sender_t * sender, off_t offset, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = send_once(image, sender, offset, len);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        // a method that moved nothing yet and is refused falls through to
+        // the next one; UVFS_SEND_WRITE is always available
+        if(n < 0 && unsupported(errno) && sender->method != UVFS_SEND_WRITE)
+        {
+            sender->method++;
+            continue;
+        }
+
+        if(n < 0)
+            return UVFS_SEND_WRITE_FAILED;
+        if(n == 0)
+            return UVFS_SEND_SHORT;
+
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * As uvfs_send_range, but exits on either failure
+ */
+void uvfs_send(const uvfs_image_t * image, uvfs_sender_t * sender, off_t offset, size_t len)
+{
+    int status = uvfs_send_range(image, sender, offset, len);
+
+    if(status == UVFS_SEND_WRITE_FAILED)
+    {
+        fprintf(stderr, "Write failed.\n");
+        exit(1);
+    }
+    if(status == UVFS_SEND_SHORT)
+    {
+        fprintf(stderr, "Read failed.\n");
+        exit(1);
+    }
+}
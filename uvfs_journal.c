@@ -0,0 +1,508 @@
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "uvfs.h"
+
+/*
+ * Metadata journal.
+ *
+ * Between uvfs_journal_begin and uvfs_journal_commit the image is seen
+ * through a private copy-on-write mapping: metadata writes made with
+ * uvfs_pwrite land there, so the writer reads them back, and nothing
+ * reaches the file. Commit logs an image of every block written to the
+ * next journal slot, makes it durable with a single fdatasync and only
+ * then writes the blocks in place. However many blocks a transaction
+ * covers, it costs one fsync, and a crash leaves either all of it or
+ * none of it once the journal is replayed.
+ *
+ * That holds for metadata only. What a file reads after a crash also
+ * depends on its data blocks, which is why stores into a journalled
+ * image never write over blocks a committed entry points at: a replace
+ * writes a new chain and the commit swaps it in (see uvfs_store.c).
+ * Blocks a crashed store had allocated for existing files are leaked
+ * until the image is checked.
+ *
+ * Replay happens when an image is opened for writing, together with
+ * rolling back directory entries claimed by stores that never committed
+ * (see disk.h): their chains were allocated by a committed transaction,
+ * so they are walked and freed rather than leaked.
+ *
+ * Transactions must be made with the exclusive metadata lock held. File
+ * data is not journalled; stores flush it before committing the entries
+ * that point at it.
+ */
+
+/*
+ * An open transaction: the private mapping it writes to and the blocks
+ * written, possibly repeated, in no particular order
+ */
+typedef struct txn txn_t;
+struct txn {
+    unsigned char * shadow;
+    unsigned char * shared;
+    unsigned int * blocks;
+    int num_blocks;
+    int cap_blocks;
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static int          journal_header(const uvfs_image_t * image, superblock_journal_t * h);
+static void         journal_write_header(uvfs_image_t * image, superblock_journal_t * h);
+static void         set_view(uvfs_image_t * image, unsigned char * map);
+static int          compare_blocks(const void * a, const void * b);
+static void         write_blocks(uvfs_image_t * image, const unsigned char * map,
+                        const unsigned int * blocks, int n);
+static int          replay_slot(uvfs_image_t * image, const superblock_journal_t * h, unsigned int sequence);
+static int          rollback_claims(uvfs_image_t * image);
+static void         sync_image(const uvfs_image_t * image);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Reads the journal extension header.
+ * Returns 1 if a journal is recorded and lies inside the image.
+ */
+static int journal_header(const uvfs_image_t * image, superblock_journal_t * h)
+{
+    if(image->sb.block_size < SB_JOURNAL_OFFSET + sizeof(superblock_journal_t))
+        return 0;
+
+    memcpy(h, image->map + SB_JOURNAL_OFFSET, sizeof(superblock_journal_t));
+    if(strncmp(h->magic, SB_JOURNAL_MAGIC, SB_JOURNAL_MAGIC_LEN) != 0 ||
+        ntohl(h->checksum) != uvfs_checksum(h, offsetof(superblock_journal_t, checksum)))
+        return 0;
+
+    unsigned int start = ntohl(h->journal_start), blocks = ntohl(h->journal_blocks);
+
+    return blocks >= 4 && start + blocks <= image->sb.num_blocks && start + blocks > start &&
+        (size_t)(start + blocks) * image->sb.block_size <= image->map_len;
+}
+
+static void journal_write_header(uvfs_image_t * image, superblock_journal_t * h)
+{
+    h->checksum = htonl(uvfs_checksum(h, offsetof(superblock_journal_t, checksum)));
+    uvfs_pwrite(image, h, sizeof(superblock_journal_t), SB_JOURNAL_OFFSET);
+}
+
+/*
+ * Returns 1 and the journal's location if image has one
+ */
+int uvfs_journal_location(const uvfs_image_t * image, unsigned int * start, unsigned int * blocks)
+{
+    superblock_journal_t h;
+
+    if(!journal_header(image, &h))
+        return 0;
+
+    *start = ntohl(h.journal_start);
+    *blocks = ntohl(h.journal_blocks);
+    return 1;
+}
+
+/*
+ * Gives image a journal of blocks blocks, taken as one contiguous free
+ * run and reserved in the FAT. An image that already has a journal keeps
+ * it.
+ */
+void uvfs_journal_create(uvfs_image_t * image, unsigned int blocks)
+{
+    superblock_journal_t h;
+    uvfs_allocator_t alloc;
+    uvfs_census_t census;
+    uvfs_extent_t * extents;
+    unsigned int b, start;
+    int num_extents;
+
+    if(image->sb.block_size < SB_JOURNAL_OFFSET + sizeof(superblock_journal_t))
+    {
+        fprintf(stderr, "Block size too small for a journal.\n");
+        exit(1);
+    }
+    if(blocks < 4)
+    {
+        fprintf(stderr, "Journal too small.\n");
+        exit(1);
+    }
+
+    uvfs_lock_metadata(image, UVFS_LOCK_EXCLUSIVE);
+
+    if(journal_header(image, &h))
+    {
+        uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+        return;
+    }
+
+    uvfs_alloc_init(&alloc, image);
+    extents = uvfs_alloc_blocks(&alloc, blocks, &num_extents);
+    if(extents == NULL || num_extents != 1)
+    {
+        fprintf(stderr, "Not enough room for journal.\n");
+        exit(1);
+    }
+    start = extents[0].start;
+    free(extents);
+    uvfs_alloc_destroy(&alloc);
+
+    if(uvfs_summary_read(image, &census) != UVFS_SUMMARY_VALID)
+        uvfs_fat_census(image, &census);
+
+    uint32_t * entries = malloc(blocks * sizeof(uint32_t));
+    unsigned char * zero = calloc(1, image->sb.block_size);
+    if(entries == NULL || zero == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(b = 0; b < blocks; b++)
+        entries[b] = htonl(FAT_RESERVED);
+
+    // neither slot may hold anything that could pass for a transaction
+    uvfs_pwrite(image, zero, image->sb.block_size, uvfs_block_offset(image, start));
+    uvfs_pwrite(image, zero, image->sb.block_size, uvfs_block_offset(image, start + blocks / 2));
+
+    uvfs_summary_begin(image);
+    uvfs_pwrite(image, entries, blocks * sizeof(uint32_t),
+        uvfs_block_offset(image, image->sb.fat_start) + (off_t)start * SIZE_FAT_ENTRY);
+    census.free_blocks -= blocks;
+    census.resv_blocks += blocks;
+    uvfs_summary_commit(image, &census);
+
+    memcpy(h.magic, SB_JOURNAL_MAGIC, SB_JOURNAL_MAGIC_LEN);
+    h.journal_start = htonl(start);
+    h.journal_blocks = htonl(blocks);
+    h.sequence = htonl(0);
+    journal_write_header(image, &h);
+    sync_image(image);
+
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+    free(entries);
+    free(zero);
+}
+
+/*
+ * Points image's metadata views into map
+ */
+static void set_view(uvfs_image_t * image, unsigned char * map)
+{
+    size_t bs = image->sb.block_size;
+
+    image->map = map;
+    image->fat = (const uint32_t *)(map + (size_t)image->sb.fat_start * bs);
+    image->dir = (const directory_entry_t *)(map + (size_t)image->sb.dir_start * bs);
+}
+
+/*
+ * Starts a transaction if image has a journal. Returns 1 if it did.
+ */
+int uvfs_journal_begin(uvfs_image_t * image)
+{
+    superblock_journal_t h;
+    txn_t * t;
+
+    if(!journal_header(image, &h))
+        return 0;
+
+    if((t = calloc(1, sizeof(txn_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    t->shadow = mmap(NULL, image->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, image->fd, 0);
+    if(t->shadow == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not start journal transaction.\n");
+        exit(1);
+    }
+
+    t->shared = image->map;
+    set_view(image, t->shadow);
+    image->txn = t;
+    return 1;
+}
+
+/*
+ * uvfs_pwrite while a transaction is open: applies the write to the
+ * private mapping and notes the blocks it touches
+ */
+void uvfs_journal_write(uvfs_image_t * image, const void * buffer, size_t len, off_t offset)
+{
+    txn_t * t = image->txn;
+    size_t bs = image->sb.block_size;
+    unsigned int b;
+
+    if(len == 0)
+        return;
+    if(offset < 0 || offset + len > image->map_len)
+    {
+        fprintf(stderr, "Write failed.\n");
+        exit(1);
+    }
+
+    memcpy(t->shadow + offset, buffer, len);
+
+    for(b = offset / bs; b <= (offset + len - 1) / bs; b++)
+    {
+        if(t->num_blocks > 0 && t->blocks[t->num_blocks - 1] == b)
+            continue;
+        if(t->num_blocks == t->cap_blocks)
+        {
+            t->cap_blocks = t->cap_blocks ? t->cap_blocks * 2 : 64;
+            if((t->blocks = realloc(t->blocks, t->cap_blocks * sizeof(unsigned int))) == NULL)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+        }
+        t->blocks[t->num_blocks++] = b;
+    }
+}
+
+static int compare_blocks(const void * a, const void * b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes blocks of map, ascending and distinct, in place with one write
+ * per run of adjacent blocks
+ */
+static void write_blocks(uvfs_image_t * image, const unsigned char * map,
+    const unsigned int * blocks, int n)
+{
+    size_t bs = image->sb.block_size;
+    int i, run;
+
+    for(i = 0; i < n; i = run)
+    {
+        for(run = i + 1; run < n && blocks[run] == blocks[run - 1] + 1; run++)
+            ;
+        uvfs_pwrite(image, map + (size_t)blocks[i] * bs, (size_t)(run - i) * bs,
+            uvfs_block_offset(image, blocks[i]));
+    }
+}
+
+static void sync_image(const uvfs_image_t * image)
+{
+    if(fdatasync(image->fd) != 0)
+    {
+        fprintf(stderr, "Sync failed.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Commits the open transaction, if any: logs it, syncs once and writes
+ * it in place. A transaction too big for a journal slot is abandoned
+ * with the image untouched.
+ */
+void uvfs_journal_commit(uvfs_image_t * image)
+{
+    txn_t * t = image->txn;
+    superblock_journal_t h;
+    size_t bs = image->sb.block_size;
+    int i, n;
+
+    if(t == NULL)
+        return;
+
+    set_view(image, t->shared);
+    image->txn = NULL;
+
+    qsort(t->blocks, t->num_blocks, sizeof(unsigned int), compare_blocks);
+    for(i = 0, n = 0; i < t->num_blocks; i++)
+    {
+        if(n == 0 || t->blocks[n - 1] != t->blocks[i])
+            t->blocks[n++] = t->blocks[i];
+    }
+
+    if(n > 0)
+    {
+        journal_header(image, &h);
+
+        unsigned int sequence = ntohl(h.sequence) + 1;
+        unsigned int slot_blocks = ntohl(h.journal_blocks) / 2;
+        unsigned int slot = ntohl(h.journal_start) + (sequence % 2) * slot_blocks;
+        size_t desc_blocks = (sizeof(journal_descriptor_t) + n * sizeof(uint32_t) + bs - 1) / bs;
+
+        if(desc_blocks + n > slot_blocks)
+        {
+            fprintf(stderr, "Journal too small for this store.\n");
+            exit(1);
+        }
+
+        unsigned char * record = calloc(desc_blocks + n, bs);
+        if(record == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        journal_descriptor_t * d = (journal_descriptor_t *)record;
+        uint32_t * targets = (uint32_t *)(record + sizeof(journal_descriptor_t));
+
+        memcpy(d->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+        d->sequence = htonl(sequence);
+        d->num_blocks = htonl(n);
+        d->checksum = 0;
+        for(i = 0; i < n; i++)
+        {
+            targets[i] = htonl(t->blocks[i]);
+            memcpy(record + (desc_blocks + i) * bs, t->shadow + (size_t)t->blocks[i] * bs, bs);
+        }
+        d->checksum = htonl(uvfs_checksum(record, (desc_blocks + n) * bs));
+
+        uvfs_pwrite(image, record, (desc_blocks + n) * bs, uvfs_block_offset(image, slot));
+        sync_image(image);
+
+        write_blocks(image, t->shadow, t->blocks, n);
+        h.sequence = htonl(sequence);
+        journal_write_header(image, &h);
+        free(record);
+    }
+
+    munmap(t->shadow, image->map_len);
+    free(t->blocks);
+    free(t);
+}
+
+/*
+ * Writes transaction sequence in place if its slot holds a valid copy.
+ * Returns 1 if it did.
+ */
+static int replay_slot(uvfs_image_t * image, const superblock_journal_t * h, unsigned int sequence)
+{
+    size_t bs = image->sb.block_size;
+    unsigned int slot_blocks = ntohl(h->journal_blocks) / 2;
+    unsigned int slot = ntohl(h->journal_start) + (sequence % 2) * slot_blocks;
+    const unsigned char * base = uvfs_block(image, slot);
+    journal_descriptor_t d;
+    int i;
+
+    memcpy(&d, base, sizeof(d));
+    if(strncmp(d.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0 || ntohl(d.sequence) != sequence)
+        return 0;
+
+    size_t n = ntohl(d.num_blocks);
+    size_t desc_blocks = (sizeof(journal_descriptor_t) + n * sizeof(uint32_t) + bs - 1) / bs;
+
+    if(n == 0 || n > slot_blocks || desc_blocks + n > slot_blocks)
+        return 0;
+
+    unsigned char * record = malloc((desc_blocks + n) * bs);
+    if(record == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(record, base, (desc_blocks + n) * bs);
+    ((journal_descriptor_t *)record)->checksum = 0;
+
+    const uint32_t * targets = (const uint32_t *)(record + sizeof(journal_descriptor_t));
+    int valid = uvfs_checksum(record, (desc_blocks + n) * bs) == ntohl(d.checksum);
+
+    for(i = 0; valid && i < n; i++)
+    {
+        if(ntohl(targets[i]) >= image->sb.num_blocks ||
+            (size_t)(ntohl(targets[i]) + 1) * bs > image->map_len)
+            valid = 0;
+    }
+
+    for(i = 0; valid && i < n; i++)
+        uvfs_pwrite(image, record + (desc_blocks + i) * bs, bs, uvfs_block_offset(image, ntohl(targets[i])));
+
+    free(record);
+    return valid;
+}
+
+/*
+ * Frees the chains of directory entries claimed by stores that are no
+ * longer running and clears the entries, in one transaction. Returns the
+ * number rolled back.
+ */
+static int rollback_claims(uvfs_image_t * image)
+{
+    directory_entry_t empty;
+    uvfs_census_t census;
+    uint32_t available = htonl(FAT_AVAILABLE);
+    int i, rolled = 0;
+
+    memset(&empty, 0, sizeof(empty));
+
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        const directory_entry_t * de = &image->dir[i];
+        unsigned int block, steps;
+
+        if(de->status != DIR_ENTRY_AVAILABLE ||
+            memcmp(de->_padding, DIR_CLAIM_MAGIC, DIR_CLAIM_MAGIC_LEN) != 0 ||
+            uvfs_entry_claimed(image, i))
+            continue;
+
+        if(rolled++ == 0)
+            uvfs_journal_begin(image);
+
+        // the chain came from one committed transaction, but stay inside
+        // the FAT whatever it holds
+        block = ntohl(de->start_block);
+        for(steps = 0; block < image->sb.num_blocks && steps < image->sb.num_blocks; steps++)
+        {
+            unsigned int next = uvfs_fat_entry(image, block);
+
+            if(next == FAT_AVAILABLE || next == FAT_RESERVED)
+                break;
+            uvfs_pwrite(image, &available, sizeof(available),
+                uvfs_block_offset(image, image->sb.fat_start) + (off_t)block * SIZE_FAT_ENTRY);
+            block = next;
+        }
+
+        uvfs_pwrite(image, &empty, sizeof(empty), uvfs_dir_entry_offset(image, i));
+    }
+
+    if(rolled > 0)
+    {
+        uvfs_fat_census(image, &census);
+        uvfs_summary_commit(image, &census);
+        uvfs_journal_commit(image);
+    }
+    return rolled;
+}
+
+/*
+ * Brings a journalled image opened for writing back to a consistent
+ * state: replays committed transactions not yet known to be in place,
+ * then rolls back abandoned claims
+ */
+void uvfs_journal_recover(uvfs_image_t * image)
+{
+    superblock_journal_t h;
+    unsigned int sequence;
+
+    if(!journal_header(image, &h))
+        return;
+
+    uvfs_lock_metadata(image, UVFS_LOCK_EXCLUSIVE);
+
+    journal_header(image, &h);
+    sequence = ntohl(h.sequence);
+    while(replay_slot(image, &h, sequence + 1))
+        sequence++;
+
+    if(sequence != ntohl(h.sequence))
+    {
+        sync_image(image);
+        journal_header(image, &h);
+        h.sequence = htonl(sequence);
+        journal_write_header(image, &h);
+    }
+
+    rollback_claims(image);
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+}
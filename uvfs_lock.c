@@ -0,0 +1,223 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uvfs.h"
+
+/*
+ * Coordination between processes sharing an image.
+ *
+ * The metadata lock is an fcntl byte-range lock over block 0 (superblock
+ * and extensions), the FAT and the directory. Readers hold it shared
+ * while they read metadata; a store holds it exclusively only while it
+ * plans and while it commits, never while it copies file data, so
+ * readers never wait on data writes.
+ *
+ * A store claims each directory entry it will fill by locking one byte
+ * per entry in a range far past the end of any image. While claimed the
+ * entry is written with its name but status available: other stores
+ * neither take the entry nor the name, readers do not see the file, and
+ * if the store dies the claim goes with it. Entries in subdirectories
+ * are claimed by a byte past all of those, picked from the directory and
+ * the name by uvfs_claim_slot. An image ends before byte 2^48, its
+ * blocks numbered in 32 bits and each under 64k, so the claims start at
+ * 2^60 and leave 62 bits for a subdirectory's slot: 30 of its root
+ * block and a 32-bit hash of the name.
+ *
+ * uvfs_group_sync makes everything written so far durable. The
+ * generation of the sync most recently started and finished is kept in
+ * a small shared memory object per image, so a store that finds a sync
+ * started after its writes has already finished returns without its
+ * own; concurrent stores queue behind one leader and share its fsync.
+ */
+
+#define LOCK_BASE  ((off_t)1 << 60)
+#define LOCK_SYNC  LOCK_BASE
+#define LOCK_CLAIM (LOCK_BASE + 1)
+#define CLAIM_NESTED ((uint64_t)1 << 32)
+#define CLAIM_DIR_MASK 0x3fffffffu
+
+typedef struct sync_state sync_state_t;
+struct sync_state {
+    uint64_t started;
+    uint64_t done;
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static int          range_lock(const uvfs_image_t * image, int cmd, short type, off_t start, off_t len);
+static sync_state_t * map_sync_state(const uvfs_image_t * image, char * name, size_t len);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+static int range_lock(const uvfs_image_t * image, int cmd, short type, off_t start, off_t len)
+{
+    struct flock fl;
+    int r;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    while((r = fcntl(image->fd, cmd, &fl)) < 0 && errno == EINTR)
+        ;
+    return r;
+}
+
+/*
+ * Takes the metadata lock, shared for UVFS_LOCK_SHARED and exclusive for
+ * UVFS_LOCK_EXCLUSIVE, waiting as long as it takes; UVFS_LOCK_NONE
+ * releases it
+ */
+void uvfs_lock_metadata(const uvfs_image_t * image, int mode)
+{
+    const superblock_entry_t * sb = &image->sb;
+    short type = mode == UVFS_LOCK_EXCLUSIVE ? F_WRLCK : mode == UVFS_LOCK_SHARED ? F_RDLCK : F_UNLCK;
+    int cmd = type == F_UNLCK ? F_SETLK : F_SETLKW;
+
+    if(range_lock(image, cmd, type, 0, sb->block_size) != 0 ||
+        range_lock(image, cmd, type, uvfs_block_offset(image, sb->fat_start),
+            (off_t)sb->fat_blocks * sb->block_size) != 0 ||
+        range_lock(image, cmd, type, uvfs_block_offset(image, sb->dir_start),
+            (off_t)sb->dir_blocks * sb->block_size) != 0)
+    {
+        fprintf(stderr, "Could not lock image.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Returns the claim slot for name in the subdirectory whose tree is
+ * rooted at dir_block. Slots for the root directory are entry indexes.
+ * Two names share a slot only if their whole checksums match, so one
+ * store's claim all but never holds up another's on a different name.
+ */
+uint64_t uvfs_claim_slot(unsigned int dir_block, const char * name)
+{
+    uint64_t hash = uvfs_checksum(name, strnlen(name, DIR_FILENAME_MAX));
+
+    return CLAIM_NESTED + ((uint64_t)(dir_block & CLAIM_DIR_MASK) << 32 | hash);
+}
+
+/*
+ * Claims directory entry slot for this process. Returns 0 if another
+ * process holds it.
+ */
+int uvfs_claim_entry(const uvfs_image_t * image, uint64_t slot)
+{
+    if(range_lock(image, F_SETLK, F_WRLCK, LOCK_CLAIM + slot, 1) == 0)
+        return 1;
+    if(errno == EACCES || errno == EAGAIN)
+        return 0;
+
+    fprintf(stderr, "Could not lock image.\n");
+    exit(1);
+}
+
+void uvfs_release_entry(const uvfs_image_t * image, uint64_t slot)
+{
+    range_lock(image, F_SETLK, F_UNLCK, LOCK_CLAIM + slot, 1);
+}
+
+/*
+ * Returns 1 if another process has claimed directory entry slot
+ */
+int uvfs_entry_claimed(const uvfs_image_t * image, uint64_t slot)
+{
+    struct flock fl;
+
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = LOCK_CLAIM + slot;
+    fl.l_len = 1;
+
+    return fcntl(image->fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+}
+
+/*
+ * Maps the sync generations shared by every process using image, or
+ * returns NULL if they cannot be shared. The object's name goes in name.
+ */
+static sync_state_t * map_sync_state(const uvfs_image_t * image, char * name, size_t len)
+{
+    struct stat st;
+    sync_state_t * state;
+    int fd;
+
+    if(fstat(image->fd, &st) != 0)
+        return NULL;
+
+    // one object per image file, whatever path it was opened by
+    snprintf(name, len, "/uvfs-sync-%lx-%lx",
+        (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+
+    if((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0)
+        return NULL;
+    if(ftruncate(fd, sizeof(sync_state_t)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    state = mmap(NULL, sizeof(sync_state_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return state == MAP_FAILED ? NULL : state;
+}
+
+/*
+ * Makes everything this process has written to image durable, sharing
+ * the fsync with any other process syncing the image at the same time
+ */
+void uvfs_group_sync(const uvfs_image_t * image)
+{
+    char name[64];
+    sync_state_t * state = map_sync_state(image, name, sizeof(name));
+    uint64_t need, gen;
+    int r;
+
+    if(state == NULL)
+    {
+        if(fdatasync(image->fd) != 0)
+        {
+            fprintf(stderr, "Sync failed.\n");
+            exit(1);
+        }
+        return;
+    }
+
+    // a sync is only good for us if it started after this point
+    need = __atomic_load_n(&state->started, __ATOMIC_ACQUIRE) + 1;
+
+    if(range_lock(image, F_SETLKW, F_WRLCK, LOCK_SYNC, 1) != 0)
+    {
+        fprintf(stderr, "Could not lock image.\n");
+        exit(1);
+    }
+
+    r = 0;
+    if(__atomic_load_n(&state->done, __ATOMIC_ACQUIRE) < need)
+    {
+        gen = __atomic_add_fetch(&state->started, 1, __ATOMIC_ACQ_REL);
+        if((r = fdatasync(image->fd)) == 0)
+            __atomic_store_n(&state->done, gen, __ATOMIC_RELEASE);
+
+        // processes already waiting keep the object mapped and still
+        // share it; later ones start a fresh one rather than leaving
+        // an object behind for every image ever stored to
+        shm_unlink(name);
+    }
+
+    range_lock(image, F_SETLK, F_UNLCK, LOCK_SYNC, 1);
+    munmap(state, sizeof(sync_state_t));
+
+    if(r != 0)
+    {
+        fprintf(stderr, "Sync failed.\n");
+        exit(1);
+    }
+}
@@ -0,0 +1,107 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "uvfs.h"
+
+/*
+ * Chain-driven read-ahead and page cache accounting.
+ *
+ * Image data is read through the mapping or the kernel copy paths, so the
+ * page cache is the block cache every tool shares. The kernel's own
+ * read-ahead only follows consecutive offsets, which stops at every jump
+ * in a fragmented chain; these helpers use the chain index to ask for the
+ * blocks a reader will reach next wherever they lie. uvfs_cache_probe
+ * counts how much of a range was already cached, for sizing workloads.
+ */
+
+#define PROBE_PAGES 4096
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Asks the kernel to start reading len bytes of image at offset
+ */
+void uvfs_advise(const uvfs_image_t * image, off_t offset, size_t len)
+{
+    if(len > 0)
+        posix_fadvise(image->fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+void uvfs_readahead_init(uvfs_readahead_t * ra, size_t window)
+{
+    ra->window = window;
+    ra->ahead = 0;
+}
+
+/*
+ * Called with the file offset a reader of index is about to read from.
+ * Keeps the next window bytes of the file, in chain order, advised. Work
+ * is only done once the reader is halfway through the last window, so
+ * most calls return without a system call.
+ */
+void uvfs_readahead(const uvfs_image_t * image, const uvfs_index_t * index,
+    uvfs_readahead_t * ra, size_t pos)
+{
+    size_t bs = image->sb.block_size;
+    size_t end = (size_t)index->first_block[index->num_extents] * bs;
+    size_t from = pos > ra->ahead ? pos : ra->ahead;
+    size_t to = pos + ra->window;
+    int i;
+
+    if(to > end)
+        to = end;
+    if(from >= to || ra->ahead >= pos + ra->window / 2)
+        return;
+
+    for(i = uvfs_index_lookup(index, from / bs); i < index->num_extents && from < to; i++)
+    {
+        size_t first = (size_t)index->first_block[i] * bs;
+        size_t last = (size_t)index->first_block[i + 1] * bs;
+        size_t len = (last < to ? last : to) - from;
+
+        uvfs_advise(image, uvfs_block_offset(image, index->extents[i].start) + (from - first), len);
+        from += len;
+    }
+    ra->ahead = to;
+}
+
+/*
+ * Adds to stat how many pages of the len bytes at offset are already in
+ * the page cache (hits) and how many will have to be read (misses)
+ */
+void uvfs_cache_probe(const uvfs_image_t * image, off_t offset, size_t len,
+    uvfs_cachestat_t * stat)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start, end;
+    unsigned char vec[PROBE_PAGES];
+
+    if(offset >= image->map_len || len == 0)
+        return;
+
+    end = offset + len < image->map_len ? offset + len : image->map_len;
+    start = offset - offset % page;
+
+    while(start < end)
+    {
+        size_t pages = (end - start + page - 1) / page;
+        size_t i;
+
+        if(pages > PROBE_PAGES)
+            pages = PROBE_PAGES;
+
+        if(mincore((void *)(image->map + start), pages * page, vec) != 0)
+            return;
+
+        for(i = 0; i < pages; i++)
+        {
+            if(vec[i] & 1)
+                stat->hits++;
+            else
+                stat->misses++;
+        }
+        start += pages * page;
+    }
+}
@@ -0,0 +1,1689 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "uvfs.h"
+
+/*
+ * Store engine shared by storuvfs and uvfsd.
+ *
+ * A run queues jobs and stores them in three phases, so any number of
+ * processes can store into one image at once:
+ *
+ *   plan    under the exclusive metadata lock: read the FAT, directory and
+ *           counts as they are now, give every job its extents and a
+ *           claimed directory entry, and write the chains, the claims and
+ *           the new counts
+ *   copy    no lock: copy the file data into the extents
+ *   commit  under the exclusive metadata lock: make the claimed entries
+ *           normal files and bring the name table up to date
+ *
+ * and then makes the run durable with a group sync (see uvfs_lock.c).
+ * Jobs that change an existing file claim its entry instead and leave it
+ * as it is until the commit. An append takes blocks for the new data as
+ * a chain of their own, fills the partial last block and then those, and
+ * the commit hangs the new chain off the file's tail. The tail is cached
+ * in the entry, so appending never walks the chain. A replace writes
+ * over the old chain's blocks and either chains new blocks on or frees
+ * the ones it no longer needs at commit; on a journalled image it writes
+ * a new chain instead and the commit frees the old one. A remove frees
+ * the whole chain and clears the entry. Frees adjust the allocation summary by the
+ * blocks freed rather than recounting the FAT.
+ *
+ * A filename may be a path. Directories missing on the way to a file
+ * being created are made by the plan, and are there from then on; a file
+ * in a subdirectory is claimed by uvfs_claim_slot, inserted into the
+ * directory's tree as a claim by the plan and made a file by the commit,
+ * like a file in the root. A claim left in a subdirectory by a store
+ * that died is taken over, its chain freed, by the next store creating
+ * that name. A directory is removed like a file, once it is empty.
+ *
+ * On an image with extent maps (uvicfs18) the plan also writes each file
+ * it creates or changes a new map, naming its kept runs and then its new
+ * extents, and the commit frees the map the entry pointed at before.
+ * uvfs_store_extents moves an older image to extent maps. Maps of claims
+ * a store died holding are leaked, like blocks freed by a run that
+ * crashes without a journal, until the image is checked.
+ *
+ * On a journalled image each locked phase is one journal transaction
+ * and the data is flushed before the commit phase, so a crash at any
+ * point leaves the image consistent and every file either as it was or
+ * as stored. Without a journal a crash while a replace is copying
+ * leaves the file partly overwritten. Errors exit, like the rest of the
+ * library; a long-lived caller runs the store in a child process.
+ *
+ * Files of STORE_LARGE_FILE bytes or more are copied by num_threads
+ * threads, each taking pieces of the file in turn and moving them with
+ * copy_file_range, so the data need not pass through user space, or
+ * with pread and pwrite where the kernel cannot copy between the two
+ * files. Smaller files go through the I/O queue.
+ */
+
+#define COPY_CHUNK (1 << 20)
+#define COPY_PIECE (8 << 20)
+#define STORE_LARGE_FILE (64 << 20)
+#define STORE_MAX_THREADS 64
+
+#define COPY_IDLE    0
+#define COPY_READING 1
+#define COPY_WRITING 2
+
+/*
+ * One chunk buffer of write_extents and the transfer it is part of
+ */
+typedef struct copy_slot copy_slot_t;
+struct copy_slot {
+    int state;
+    size_t len;                         // bytes of image written
+    size_t want;                        // bytes of source read
+    off_t offset;                       // image offset of the chunk
+};
+
+/*
+ * One piece of a large file: a run of source bytes and the image bytes
+ * they fill, zero padded past the end of the source
+ */
+typedef struct copy_piece copy_piece_t;
+struct copy_piece {
+    off_t src_offset;
+    off_t offset;
+    size_t want;
+    size_t len;
+};
+
+/*
+ * A large file being copied by threads, sharing one cursor into its
+ * pieces
+ */
+typedef struct copy_pool copy_pool_t;
+struct copy_pool {
+    int src_fd;
+    int dst_fd;
+    copy_piece_t * pieces;
+    size_t num_pieces;
+    size_t next_piece;
+    int no_copy_range;                  // set once the kernel refuses
+};
+
+/*
+ * A directory on a job's path: its tree and where its own entry is
+ */
+typedef struct dir_ref dir_ref_t;
+struct dir_ref {
+    unsigned int block;                 // root node, 0 for the root directory
+    unsigned int holder;                // block of the directory holding its entry
+    int index;                          // its entry, if the root directory holds it
+    char name[DIR_FILENAME_MAX];
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+static void         plan_job(uvfs_store_t * store, uvfs_store_job_t * job);
+static void         plan_create(uvfs_store_t * store, uvfs_store_job_t * job, const dir_ref_t * dir);
+static unsigned int file_blocks(const uvfs_store_t * store, size_t size);
+static int          resolve_path(uvfs_store_t * store, uvfs_store_job_t * job, dir_ref_t * dir, int create);
+static int          open_dir(uvfs_store_t * store, const dir_ref_t * parent, const char * name,
+                        dir_ref_t * dir, int create);
+static void         dir_insert(uvfs_store_t * store, const dir_ref_t * dir, const directory_entry_t * rec);
+static int          take_entry(uvfs_store_t * store);
+static void         touch_entry(uvfs_store_t * store, int e);
+static directory_entry_t * job_entry(uvfs_store_t * store, uvfs_store_job_t * job);
+static int          same_file(const uvfs_store_job_t * a, const uvfs_store_job_t * b);
+static int          claim_existing(uvfs_store_t * store, uvfs_store_job_t * job);
+static void         plan_append(uvfs_store_t * store, uvfs_store_job_t * job);
+static void         plan_replace(uvfs_store_t * store, uvfs_store_job_t * job);
+static void         set_layout(uvfs_store_t * store, uvfs_store_job_t * job, directory_entry_t * de,
+                        const uvfs_extent_t * head, int num_head);
+static void         map_entry(uvfs_store_t * store, directory_entry_t * de);
+static void         map_dir(uvfs_store_t * store, unsigned int root, const uvfs_dir_path_t * parent);
+static void         collect_entry(const directory_entry_t * de, void * arg);
+static void         write_job(uvfs_store_t * store, uvfs_store_job_t * job);
+static void         read_metadata(uvfs_store_t * store);
+static void         store_commit(uvfs_store_t * store, int dir_index);
+static void         copy_extents(uvfs_store_t * store, int src_fd, off_t src_start,
+                        uvfs_extent_t * extents, int num_extents, size_t file_size);
+static unsigned int free_chain(uvfs_store_t * store, unsigned int block, unsigned int limit);
+static void         link_chain(uvfs_store_t * store, uvfs_extent_t * extents, int num_extents);
+static void         write_extents(uvfs_store_t * store, int src_fd, off_t src_start,
+                        uvfs_extent_t * extents, int num_extents, size_t file_size);
+static void         write_parallel(uvfs_store_t * store, int src_fd, off_t src_start,
+                        uvfs_extent_t * extents, int num_extents, size_t file_size);
+static void *       copy_worker(void * arg);
+static void         copy_piece(copy_pool_t * pool, const copy_piece_t * p, unsigned char * buffer);
+static void         write_all(int fd, const void * buffer, size_t len, off_t offset);
+static void         build_dir_index(uvfs_store_t * store);
+static directory_entry_t * read_dir(uvfs_image_t * image);
+static void         write_dir(uvfs_store_t * store, unsigned char status);
+static unsigned char * new_dirty(unsigned int num_blocks);
+static void         write_dirty(uvfs_image_t * image, const void * copy, const unsigned char * dirty,
+                        unsigned int num_blocks, unsigned int region_start);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Queues filename to be stored from the host file sourcename. A caller
+ * holding the data in a descriptor can set src_fd on the new job instead.
+ */
+void uvfs_store_add(uvfs_store_t * store, char * filename, char * sourcename)
+{
+    store->jobs = realloc(store->jobs, (store->num_jobs + 1) * sizeof(uvfs_store_job_t));
+    if(store->jobs == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    uvfs_store_job_t * job = &store->jobs[store->num_jobs++];
+    memset(job, 0, sizeof(uvfs_store_job_t));
+    job->filename = filename;
+    job->sourcename = sourcename;
+    job->src_fd = -1;
+    job->de_index = -1;
+}
+
+/*
+ * Sets a run up on image, paging the FAT through a cache of fat_cache
+ * bytes and copying data with up to queue_depth transfers in flight.
+ * Large files are copied by one thread until num_threads is raised. The
+ * metadata itself is read by uvfs_store_run once it holds the lock.
+ */
+void uvfs_store_load(uvfs_store_t * store, uvfs_image_t * image, size_t fat_cache,
+    unsigned int queue_depth)
+{
+    store->image = image;
+    store->num_threads = 1;
+    uvfs_fatcache_init(&store->fat, image, fat_cache);
+    uvfs_aio_init(&store->aio, queue_depth);
+}
+
+/*
+ * Loads the metadata every job needs, once per run, with the metadata
+ * lock held. Entries other stores have claimed are marked used in the
+ * private directory, so their names count as taken.
+ */
+static void read_metadata(uvfs_store_t * store)
+{
+    uvfs_image_t * image = store->image;
+    int i;
+
+    store->ROOT = read_dir(image);
+    store->dir_dirty = new_dirty(image->sb.dir_blocks);
+    store->next_entry = 0;
+
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        if(store->ROOT[i].status == DIR_ENTRY_AVAILABLE && store->ROOT[i].filename[0] != '\0' &&
+            uvfs_entry_claimed(image, i))
+            store->ROOT[i].status = DIR_ENTRY_NORMALFILE;
+    }
+
+    uvfs_alloc_init(&store->alloc, image);
+    uvfs_dirhash_build(&store->names, store->ROOT, image->dir_entries);
+
+    if(uvfs_summary_read(image, &store->census) != UVFS_SUMMARY_VALID)
+        uvfs_fat_census(image, &store->census);
+}
+
+/*
+ * Checks job against the image and the jobs planned before it, then gives
+ * it a directory entry and its extents. Only directories made on the way
+ * to a new file are changed, and those only in the store's copies, so a
+ * job that cannot be stored stops the run with the image untouched.
+ */
+static void plan_job(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    uvfs_image_t * image = store->image;
+    dir_ref_t dir;
+    struct stat st;
+    int found;
+
+    // a new file gets any directories missing on its path
+    found = resolve_path(store, job, &dir,
+        job->mode == UVFS_STORE_CREATE || job->mode == UVFS_STORE_REPLACE) &&
+        job->mode != UVFS_STORE_CREATE && claim_existing(store, job);
+
+    if((job->mode == UVFS_STORE_REMOVE || job->mode == UVFS_STORE_APPEND) && !found)
+    {
+        fprintf(stderr, "File not found on specified image.\n");
+        exit(1);
+    }
+
+    if(job->mode == UVFS_STORE_REMOVE)
+    {
+        directory_entry_t * de = job_entry(store, job);
+
+        job->tail = ntohl(de->start_block);
+        job->old_blocks = ntohl(de->num_blocks);
+        job->old_map = uvfs_entry_map(image, de);
+        if(de->status == DIR_ENTRY_DIRECTORY)
+        {
+            // what the run removes from it before it does not count
+            unsigned long n = uvfs_dir_count(image, job->tail);
+            int i;
+
+            for(i = 0; &store->jobs[i] != job; i++)
+            {
+                if(store->jobs[i].dir_block == job->tail)
+                    n--;
+            }
+            if(n > 0)
+            {
+                fprintf(stderr, "Directory not empty.\n");
+                exit(1);
+            }
+        }
+        if(job->dir_block == 0)
+            store->dir_dirty[job->de_index * sizeof(directory_entry_t) / image->sb.block_size] = 1;
+        return;
+    }
+
+    if(found && job_entry(store, job)->status == DIR_ENTRY_DIRECTORY)
+    {
+        fprintf(stderr, "Specified file is a directory.\n");
+        exit(1);
+    }
+
+    if(job->src_fd < 0 && (job->src_fd = open(job->sourcename, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "Specified source file could not be found.\n");
+        exit(1);
+    }
+
+    if(fstat(job->src_fd, &st) != 0 || st.st_size > 0xffffffffL)
+    {
+        fprintf(stderr, "Specified source file could not be read.\n");
+        exit(1);
+    }
+    job->file_size = st.st_size;
+
+    if(job->mode == UVFS_STORE_APPEND)
+        plan_append(store, job);
+    else if(found)
+        plan_replace(store, job);
+    else
+    {
+        // replacing a file that is not there is storing it
+        job->mode = UVFS_STORE_CREATE;
+        plan_create(store, job, &dir);
+    }
+}
+
+/*
+ * Plans storing job as a new file in dir: claims an entry for it and
+ * takes its extents
+ */
+static void plan_create(uvfs_store_t * store, uvfs_store_job_t * job, const dir_ref_t * dir)
+{
+    uvfs_image_t * image = store->image;
+    directory_entry_t de, old;
+    int i, reclaim = 0;
+
+    // check file doesn't already exist
+    for(i = 0; &store->jobs[i] != job; i++)
+    {
+        if(same_file(&store->jobs[i], job))
+        {
+            fprintf(stderr, "File already on specified image.\n");
+            exit(1);
+        }
+    }
+
+    if(job->dir_block == 0)
+    {
+        if(uvfs_dirhash_find(&store->names, job->name) >= 0)
+        {
+            fprintf(stderr, "File already on specified image.\n");
+            exit(1);
+        }
+        job->de_index = take_entry(store);
+        job->slot = job->de_index;
+    }
+    else
+    {
+        // an available entry with the name is another store's claim; if
+        // that store is gone, this one takes the claim over
+        job->slot = uvfs_claim_slot(job->dir_block, job->name);
+        if(uvfs_dir_get(store, job->dir_block, job->name, &old))
+        {
+            if(old.status != DIR_ENTRY_AVAILABLE || uvfs_entry_claimed(image, job->slot))
+            {
+                fprintf(stderr, "File already on specified image.\n");
+                exit(1);
+            }
+            reclaim = 1;
+        }
+        if(!uvfs_claim_entry(image, job->slot))
+        {
+            fprintf(stderr, "File already on specified image.\n");
+            exit(1);
+        }
+    }
+    job->claimed = 1;
+
+    // size the whole file up front and take it from the best-fitting runs
+    job->num_blocks = file_blocks(store, job->file_size);
+    job->extents = uvfs_alloc_blocks(&store->alloc, job->num_blocks, &job->num_extents);
+
+    if(job->extents == NULL)
+    {
+        fprintf(stderr, "Not enough room for file.\n");
+        exit(1);
+    }
+
+    memset(&de, 0, sizeof(directory_entry_t));
+    de.status = DIR_ENTRY_NORMALFILE;
+    de.start_block = job->extents[0].start;
+    de.num_blocks = job->num_blocks;
+    de.file_size = job->file_size;
+    strcpy(de.filename, job->name);
+    pack_current_datetime(de.create_time);
+    pack_current_datetime(de.modify_time);
+    convertToHostDE(&de);
+    set_layout(store, job, &de, NULL, 0);
+
+    if(job->dir_block == 0)
+    {
+        store->ROOT[job->de_index] = de;
+        store->dir_dirty[job->de_index * sizeof(directory_entry_t) / image->sb.block_size] = 1;
+        uvfs_dirhash_insert(&store->names, job->name, job->de_index);
+    }
+    else
+    {
+        if(reclaim)
+        {
+            unsigned int freed = free_chain(store, ntohl(old.start_block), ntohl(old.num_blocks));
+
+            store->census.free_blocks += freed;
+            store->census.alloc_blocks -= freed;
+        }
+
+        job->entry = de;
+        de.status = DIR_ENTRY_AVAILABLE;
+        memcpy(de._padding, DIR_CLAIM_MAGIC, DIR_CLAIM_MAGIC_LEN);
+        if(reclaim)
+            uvfs_dir_update(store, job->dir_block, &de);
+        else
+            dir_insert(store, dir, &de);
+    }
+
+    store->census.free_blocks -= job->num_blocks;
+    store->census.alloc_blocks += job->num_blocks;
+}
+
+/*
+ * Returns the blocks a file of size bytes occupies. An empty file still
+ * owns one (empty) block for its chain.
+ */
+static unsigned int file_blocks(const uvfs_store_t * store, size_t size)
+{
+    unsigned int bs = store->image->sb.block_size;
+
+    return size == 0 ? 1 : (size + bs - 1) / bs;
+}
+
+/*
+ * Walks job's path to the directory holding its last component, leaving
+ * that directory in dir, its root node in job->dir_block and the
+ * component in job->name. Directories missing on the way are made if
+ * create is set; otherwise returns 0 if one is missing.
+ */
+static int resolve_path(uvfs_store_t * store, uvfs_store_job_t * job, dir_ref_t * dir, int create)
+{
+    char name[DIR_FILENAME_MAX];
+    char * p = job->filename;
+    dir_ref_t next;
+
+    memset(dir, 0, sizeof(dir_ref_t));
+    dir->index = -1;
+
+    for(;;)
+    {
+        size_t len = strcspn(p, "/");
+
+        if(len >= DIR_FILENAME_MAX)
+        {
+            fprintf(stderr, "Filename too long.\n");
+            exit(1);
+        }
+        if(len == 0 || (p[0] == '.' && (len == 1 || (len == 2 && p[1] == '.'))))
+        {
+            fprintf(stderr, "Invalid path.\n");
+            exit(1);
+        }
+        if(p[len] == '\0')
+            break;
+
+        memcpy(name, p, len);
+        name[len] = '\0';
+        if(!open_dir(store, dir, name, &next, create))
+            return 0;
+        *dir = next;
+        p += len + 1;
+    }
+
+    job->name = p;
+    job->dir_block = dir->block;
+    return 1;
+}
+
+/*
+ * Finds the directory name in parent, leaving it in dir, or makes it if
+ * create is set. Returns 0 if it is not there and was not made.
+ */
+static int open_dir(uvfs_store_t * store, const dir_ref_t * parent, const char * name,
+    dir_ref_t * dir, int create)
+{
+    directory_entry_t de;
+    uint64_t slot;
+    int found;
+
+    memset(dir, 0, sizeof(dir_ref_t));
+    dir->holder = parent->block;
+    dir->index = -1;
+    strcpy(dir->name, name);
+
+    if(parent->block == 0)
+    {
+        dir->index = uvfs_dirhash_find(&store->names, name);
+        found = dir->index >= 0;
+        if(found)
+            de = store->ROOT[dir->index];
+        slot = dir->index;
+    }
+    else
+    {
+        found = uvfs_dir_get(store, parent->block, name, &de);
+        slot = uvfs_claim_slot(parent->block, name);
+    }
+
+    if(found)
+    {
+        if(de.status != DIR_ENTRY_DIRECTORY)
+        {
+            fprintf(stderr, "Path component is not a directory.\n");
+            exit(1);
+        }
+        // the only store to claim a directory is one removing it
+        if(uvfs_entry_claimed(store->image, slot))
+        {
+            fprintf(stderr, "Directory is being removed by another store.\n");
+            exit(1);
+        }
+        dir->block = ntohl(de.start_block);
+        return 1;
+    }
+    if(!create)
+        return 0;
+
+    memset(&de, 0, sizeof(directory_entry_t));
+    de.status = DIR_ENTRY_DIRECTORY;
+    de.start_block = uvfs_dir_create(store);
+    de.num_blocks = 1;
+    de.file_size = store->image->sb.block_size;
+    strcpy(de.filename, name);
+    pack_current_datetime(de.create_time);
+    pack_current_datetime(de.modify_time);
+    convertToNetDE(&de);
+    dir->block = ntohl(de.start_block);
+
+    if(parent->block == 0)
+    {
+        dir->index = take_entry(store);
+        store->ROOT[dir->index] = de;
+        uvfs_dirhash_insert(&store->names, name, dir->index);
+        touch_entry(store, dir->index);
+    }
+    else
+        dir_insert(store, parent, &de);
+    return 1;
+}
+
+/*
+ * Inserts rec into dir and counts any nodes the tree grew by in the
+ * directory's own entry
+ */
+static void dir_insert(uvfs_store_t * store, const dir_ref_t * dir, const directory_entry_t * rec)
+{
+    unsigned int added = uvfs_dir_insert(store, dir->block, rec);
+    directory_entry_t held, * de = &held;
+
+    if(added == 0)
+        return;
+
+    if(dir->holder == 0)
+        de = &store->ROOT[dir->index];
+    else if(!uvfs_dir_get(store, dir->holder, dir->name, de))
+    {
+        fprintf(stderr, "Specified directory is damaged.\n");
+        exit(1);
+    }
+
+    convertToHostDE(de);
+    de->num_blocks += added;
+    de->file_size = de->num_blocks * store->image->sb.block_size;
+    convertToNetDE(de);
+
+    if(dir->holder == 0)
+        touch_entry(store, dir->index);
+    else
+        uvfs_dir_update(store, dir->holder, de);
+}
+
+/*
+ * Returns a free root directory entry no other store has claimed, now
+ * claimed by this one
+ */
+static int take_entry(uvfs_store_t * store)
+{
+    uvfs_image_t * image = store->image;
+
+    while(store->next_entry < image->dir_entries &&
+        (store->ROOT[store->next_entry].status != DIR_ENTRY_AVAILABLE ||
+        !uvfs_claim_entry(image, store->next_entry)))
+        store->next_entry++;
+
+    if(store->next_entry == image->dir_entries)
+    {
+        fprintf(stderr, "No room for directory entry.\n");
+        exit(1);
+    }
+    return store->next_entry;
+}
+
+/*
+ * Notes that the plan changed root entry e of a directory, to be written
+ * with the claims
+ */
+static void touch_entry(uvfs_store_t * store, int e)
+{
+    int i;
+
+    store->dir_dirty[e * sizeof(directory_entry_t) / store->image->sb.block_size] = 1;
+    for(i = 0; i < store->num_touched; i++)
+    {
+        if(store->touched[i] == e)
+            return;
+    }
+
+    if((store->touched = realloc(store->touched, (store->num_touched + 1) * sizeof(int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    store->touched[store->num_touched++] = e;
+}
+
+/*
+ * Returns the store's copy of job's entry
+ */
+static directory_entry_t * job_entry(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    return job->dir_block == 0 ? &store->ROOT[job->de_index] : &job->entry;
+}
+
+static int same_file(const uvfs_store_job_t * a, const uvfs_store_job_t * b)
+{
+    return a->dir_block == b->dir_block && strcmp(a->name, b->name) == 0;
+}
+
+/*
+ * Finds and claims the existing file job names, for a job that changes
+ * it in place. Returns 0 if there is no such file.
+ */
+static int claim_existing(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    int i;
+
+    if(job->dir_block == 0)
+    {
+        if((job->de_index = uvfs_dirhash_find(&store->names, job->name)) < 0)
+            return 0;
+        job->slot = job->de_index;
+    }
+    else
+    {
+        if(!uvfs_dir_get(store, job->dir_block, job->name, &job->entry))
+            return 0;
+        job->slot = uvfs_claim_slot(job->dir_block, job->name);
+    }
+
+    for(i = 0; &store->jobs[i] != job; i++)
+    {
+        if(same_file(&store->jobs[i], job))
+        {
+            fprintf(stderr, "File named more than once.\n");
+            exit(1);
+        }
+    }
+
+    // entries other stores are filling show up as files in ROOT and as
+    // claims in subdirectories, where a claim nobody holds is left for a
+    // create to take over
+    if(job->dir_block != 0 && job->entry.status == DIR_ENTRY_AVAILABLE &&
+        !uvfs_entry_claimed(store->image, job->slot))
+        return 0;
+    if((job->dir_block != 0 && job->entry.status == DIR_ENTRY_AVAILABLE) ||
+        !uvfs_claim_entry(store->image, job->slot))
+    {
+        fprintf(stderr, "File is being written by another store.\n");
+        exit(1);
+    }
+    job->claimed = 1;
+    return 1;
+}
+
+/*
+ * Plans appending job's source to the claimed existing file: finds its
+ * tail and takes blocks for whatever does not fit in the partial last
+ * block. The entry in the private directory gets the new size, to be
+ * written at commit.
+ */
+static void plan_append(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    uvfs_image_t * image = store->image;
+    unsigned int bs = image->sb.block_size;
+    directory_entry_t * de = job_entry(store, job);
+    size_t old_blocks = ntohl(de->num_blocks);
+    uvfs_extent_t * head = NULL;
+    int num_head = 0;
+    job->old_size = ntohl(de->file_size);
+    job->old_blocks = old_blocks;
+    job->tail = uvfs_find_tail(image, de);
+    job->old_map = uvfs_entry_map(image, de);
+
+    if(job->tail == FAT_LASTBLOCK || old_blocks == 0 || job->old_size > old_blocks * bs ||
+        (old_blocks - 1) * bs > job->old_size)
+    {
+        fprintf(stderr, "Specified file is damaged.\n");
+        exit(1);
+    }
+    if(job->old_size + job->file_size > 0xffffffffL)
+    {
+        fprintf(stderr, "Not enough room for file.\n");
+        exit(1);
+    }
+
+    // whatever spills past the last block goes in new blocks
+    size_t room = old_blocks * bs - job->old_size;
+    job->num_blocks = job->file_size > room ? (job->file_size - room + bs - 1) / bs : 0;
+
+    if(job->num_blocks > 0)
+    {
+        job->extents = uvfs_alloc_blocks(&store->alloc, job->num_blocks, &job->num_extents);
+        if(job->extents == NULL)
+        {
+            fprintf(stderr, "Not enough room for file.\n");
+            exit(1);
+        }
+    }
+
+    convertToHostDE(de);
+    if(image->extent_maps)
+        head = uvfs_entry_extents(image, de, &num_head);
+    de->num_blocks += job->num_blocks;
+    de->file_size += job->file_size;
+    pack_current_datetime(de->modify_time);
+    convertToNetDE(de);
+    set_layout(store, job, de, head, num_head);
+    free(head);
+    if(job->dir_block == 0)
+        store->dir_dirty[job->de_index * sizeof(directory_entry_t) / bs] = 1;
+
+    store->census.free_blocks -= job->num_blocks;
+    store->census.alloc_blocks += job->num_blocks;
+}
+
+/*
+ * Plans overwriting the claimed existing file with job's source. The new
+ * data goes over the old chain's blocks as far as they reach; a larger
+ * file gets new blocks chained on at commit, and a smaller one has the
+ * rest of the old chain freed at commit. On a journalled image it all
+ * goes to new blocks instead and the commit swaps the chains, so a crash
+ * leaves the old file whole rather than half overwritten.
+ */
+static void plan_replace(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    uvfs_image_t * image = store->image;
+    unsigned int bs = image->sb.block_size;
+    directory_entry_t * de = job_entry(store, job);
+    unsigned int block = ntohl(de->start_block), keep, n, i, j_start, j_blocks;
+    unsigned int * chain;
+
+    job->old_size = ntohl(de->file_size);
+    job->old_blocks = ntohl(de->num_blocks);
+    job->old_map = uvfs_entry_map(image, de);
+    n = file_blocks(store, job->file_size);
+    job->relocate = uvfs_journal_location(image, &j_start, &j_blocks);
+    keep = job->relocate ? 0 : n < job->old_blocks ? n : job->old_blocks;
+
+    if(job->old_blocks == 0 || (chain = malloc(job->old_blocks * sizeof(unsigned int))) == NULL)
+    {
+        fprintf(stderr, job->old_blocks == 0 ? "Specified file is damaged.\n" : "Out of memory.\n");
+        exit(1);
+    }
+
+    // the chain must be exactly as long as the entry says
+    for(i = 0; i < job->old_blocks; i++)
+    {
+        unsigned int next = block < image->sb.num_blocks ? uvfs_fat_entry(image, block) : FAT_AVAILABLE;
+
+        if(next == FAT_AVAILABLE || next == FAT_RESERVED ||
+            (next == FAT_LASTBLOCK) != (i == job->old_blocks - 1))
+        {
+            fprintf(stderr, "Specified file is damaged.\n");
+            exit(1);
+        }
+        chain[i] = block;
+        block = next;
+    }
+
+    // the blocks kept, as runs
+    for(i = 0; i < keep; i++)
+    {
+        if(i > 0 && chain[i] == chain[i - 1] + 1)
+        {
+            job->reuse[job->num_reuse - 1].length++;
+            continue;
+        }
+        if((job->reuse = realloc(job->reuse, (job->num_reuse + 1) * sizeof(uvfs_extent_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        job->reuse[job->num_reuse].start = chain[i];
+        job->reuse[job->num_reuse++].length = 1;
+    }
+    // a relocated file's old chain is freed from its start
+    job->tail = chain[job->relocate ? 0 : keep - 1];
+    free(chain);
+
+    job->num_blocks = n - keep;
+    if(job->num_blocks > 0)
+    {
+        job->extents = uvfs_alloc_blocks(&store->alloc, job->num_blocks, &job->num_extents);
+        if(job->extents == NULL)
+        {
+            fprintf(stderr, "Not enough room for file.\n");
+            exit(1);
+        }
+    }
+
+    convertToHostDE(de);
+    if(job->relocate)
+        de->start_block = job->extents[0].start;
+    de->num_blocks = n;
+    de->file_size = job->file_size;
+    pack_current_datetime(de->modify_time);
+    convertToNetDE(de);
+    set_layout(store, job, de, job->reuse, job->num_reuse);
+    if(job->dir_block == 0)
+        store->dir_dirty[job->de_index * sizeof(directory_entry_t) / bs] = 1;
+
+    store->census.free_blocks -= job->num_blocks;
+    store->census.alloc_blocks += job->num_blocks;
+}
+
+/*
+ * Records where de (network byte order, already sized) finds its blocks:
+ * on an image with extent maps a new map of head, the runs the file
+ * keeps, followed by the job's new extents, and otherwise its last block
+ */
+static void set_layout(uvfs_store_t * store, uvfs_store_job_t * job, directory_entry_t * de,
+    const uvfs_extent_t * head, int num_head)
+{
+    uvfs_extent_t * runs;
+    int i, n = 0;
+
+    if(!store->image->extent_maps)
+    {
+        uvfs_set_tail(de, job->num_extents > 0 ?
+            job->extents[job->num_extents - 1].start + job->extents[job->num_extents - 1].length - 1 :
+            job->tail);
+        return;
+    }
+
+    if((runs = malloc((num_head + job->num_extents) * sizeof(uvfs_extent_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < num_head + job->num_extents; i++)
+    {
+        const uvfs_extent_t * e = i < num_head ? &head[i] : &job->extents[i - num_head];
+
+        if(n > 0 && runs[n - 1].start + runs[n - 1].length == e->start)
+            runs[n - 1].length += e->length;
+        else
+            runs[n++] = *e;
+    }
+    uvfs_set_map(de, uvfs_map_write(store, runs, n));
+    free(runs);
+}
+
+/*
+ * Copies a planned job's data: over the blocks a replaced file keeps or
+ * into the room left in the last block of a file being appended to (all
+ * of it, for an empty file), then into the job's new extents
+ */
+static void write_job(uvfs_store_t * store, uvfs_store_job_t * job)
+{
+    size_t bs = store->image->sb.block_size;
+    size_t head = 0;
+
+    if(job->mode == UVFS_STORE_REMOVE)
+        return;
+
+    if(job->mode == UVFS_STORE_REPLACE)
+    {
+        int i;
+
+        for(i = 0; i < job->num_reuse; i++)
+            head += (size_t)job->reuse[i].length * bs;
+        if(head > job->file_size)
+            head = job->file_size;
+        copy_extents(store, job->src_fd, 0, job->reuse, job->num_reuse, head);
+    }
+    else if(job->mode == UVFS_STORE_APPEND && job->old_blocks * bs > job->old_size)
+    {
+        unsigned char buffer[bs];
+
+        head = job->old_blocks * bs - job->old_size;
+        if(head > job->file_size)
+            head = job->file_size;
+        if(uvfs_pread(job->src_fd, buffer, head, 0) != head)
+        {
+            fprintf(stderr, "Read failed.\n");
+            exit(1);
+        }
+        write_all(store->image->fd, buffer, head,
+            uvfs_block_offset(store->image, job->tail) + job->old_size % bs);
+    }
+
+    if(job->num_blocks > 0)
+        copy_extents(store, job->src_fd, head, job->extents, job->num_extents, job->file_size - head);
+    close(job->src_fd);
+    job->src_fd = -1;
+}
+
+/*
+ * Copies file_size bytes of src_fd, from src_start, into extents, with
+ * threads if there is enough of it
+ */
+static void copy_extents(uvfs_store_t * store, int src_fd, off_t src_start,
+    uvfs_extent_t * extents, int num_extents, size_t file_size)
+{
+    if(file_size >= STORE_LARGE_FILE)
+        write_parallel(store, src_fd, src_start, extents, num_extents, file_size);
+    else
+        write_extents(store, src_fd, src_start, extents, num_extents, file_size);
+}
+
+/*
+ * Frees up to limit blocks of the chain starting at block through the
+ * cache. Returns the number freed.
+ */
+static unsigned int free_chain(uvfs_store_t * store, unsigned int block, unsigned int limit)
+{
+    unsigned int freed = 0;
+
+    while(freed < limit && block < store->image->sb.num_blocks)
+    {
+        unsigned int next = uvfs_fatcache_get(&store->fat, block);
+
+        if(next == FAT_AVAILABLE || next == FAT_RESERVED)
+            break;
+        uvfs_fatcache_set(&store->fat, block, FAT_AVAILABLE);
+        freed++;
+        block = next;
+    }
+    return freed;
+}
+
+/*
+ * Applies the run to the directories with the metadata lock held: claimed
+ * entries become files, changed files get their new chains and sizes and
+ * removed ones are cleared, their blocks freed and counted back as free.
+ * Then brings the name table up to date. A rebuilt table indexes the
+ * directory as it is now, other stores' files included.
+ */
+static void store_commit(uvfs_store_t * store, int dir_index)
+{
+    uvfs_image_t * image = store->image;
+    uvfs_census_t census;
+    unsigned int freed = 0;
+    int i, frees = 0, counted = 0;
+
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        uvfs_store_job_t * job = &store->jobs[i];
+
+        if(job->mode == UVFS_STORE_REMOVE || job->old_map != 0 || job->relocate ||
+            (job->mode == UVFS_STORE_REPLACE && file_blocks(store, job->file_size) < job->old_blocks))
+            frees = 1;
+    }
+
+    if(frees)
+    {
+        counted = uvfs_summary_read(image, &census) == UVFS_SUMMARY_VALID;
+        uvfs_summary_begin(image);
+    }
+
+    // the cache's pages date from the plan; other stores have changed
+    // the FAT since
+    uvfs_fatcache_drop(&store->fat);
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        uvfs_store_job_t * job = &store->jobs[i];
+        unsigned int n = file_blocks(store, job->file_size);
+
+        if(job->old_map != 0)
+            freed += uvfs_map_free(store, job->old_map);
+        if(job->mode == UVFS_STORE_REMOVE || job->relocate)
+            freed += free_chain(store, job->tail, job->old_blocks);
+        else if(job->mode == UVFS_STORE_CREATE)
+            continue;
+        else if(job->num_blocks > 0)
+            uvfs_fatcache_set(&store->fat, job->tail, job->extents[0].start);
+        else if(job->mode == UVFS_STORE_REPLACE && n < job->old_blocks)
+        {
+            freed += free_chain(store, uvfs_fatcache_get(&store->fat, job->tail), job->old_blocks - n);
+            uvfs_fatcache_set(&store->fat, job->tail, FAT_LASTBLOCK);
+        }
+    }
+    uvfs_fatcache_flush(&store->fat);
+
+    if(frees)
+    {
+        if(counted)
+        {
+            census.free_blocks += freed;
+            census.alloc_blocks -= freed;
+        }
+        else
+            uvfs_fat_census(image, &census);
+        uvfs_summary_commit(image, &census);
+    }
+
+    // entries in subdirectories are found by name, wherever splits by
+    // other stores have moved them since the plan; those in directories
+    // the run removes went with them
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        uvfs_store_job_t * job = &store->jobs[i];
+        int k;
+
+        for(k = 0; k < store->num_jobs; k++)
+        {
+            if(store->jobs[k].mode == UVFS_STORE_REMOVE && store->jobs[k].tail == job->dir_block)
+                break;
+        }
+        if(job->dir_block == 0 || k < store->num_jobs)
+            continue;
+        if(job->mode == UVFS_STORE_REMOVE ? !uvfs_dir_delete(store, job->dir_block, job->name) :
+            !uvfs_dir_update(store, job->dir_block, &job->entry))
+        {
+            fprintf(stderr, "Specified directory is damaged.\n");
+            exit(1);
+        }
+    }
+    uvfs_dir_flush(store);
+
+    uvfs_dirtable_begin(image);
+    write_dir(store, DIR_ENTRY_NORMALFILE);
+
+    if(dir_index)
+    {
+        uvfs_dirhash_destroy(&store->names);
+        uvfs_dirhash_build(&store->names, image->dir, image->dir_entries);
+        uvfs_dirtable_create(image, &store->names, store->table_start, store->table_blocks);
+    }
+    else
+    {
+        for(i = 0; i < store->num_jobs; i++)
+        {
+            uvfs_store_job_t * job = &store->jobs[i];
+
+            if(job->dir_block != 0)
+                continue;
+            if(job->mode == UVFS_STORE_CREATE)
+                uvfs_dirtable_insert(image, job->name, job->de_index);
+            else if(job->mode == UVFS_STORE_REMOVE)
+                uvfs_dirtable_remove(image, job->name, job->de_index);
+        }
+    }
+
+    uvfs_dirtable_commit(image);
+}
+
+/*
+ * Chains the blocks of extents, in order, in the FAT
+ */
+static void link_chain(uvfs_store_t * store, uvfs_extent_t * extents, int num_extents)
+{
+    int i;
+    unsigned int b;
+
+    for(i = 0; i < num_extents; i++)
+    {
+        for(b = extents[i].start; b < extents[i].start + extents[i].length - 1; b++)
+            uvfs_fatcache_set(&store->fat, b, b + 1);
+
+        uvfs_fatcache_set(&store->fat, b, i + 1 < num_extents ? extents[i + 1].start : FAT_LASTBLOCK);
+    }
+}
+
+/*
+ * Copies file_size bytes of src_fd, from src_start, into extents in
+ * chunks. Each of up to queue depth chunk buffers cycles through a source
+ * read and an image write, so with a deep queue reads of later chunks
+ * overlap writes of earlier ones. The tail of the last block is zero
+ * filled.
+ */
+static void write_extents(uvfs_store_t * store, int src_fd, off_t src_start,
+    uvfs_extent_t * extents, int num_extents, size_t file_size)
+{
+    uvfs_image_t * image = store->image;
+    uvfs_aio_t * aio = &store->aio;
+    size_t bs = image->sb.block_size;
+    size_t chunk = COPY_CHUNK - COPY_CHUNK % bs;
+    unsigned char * buffers = malloc(aio->depth * chunk);
+    copy_slot_t * slots = calloc(aio->depth, sizeof(copy_slot_t));
+    size_t ext_done = 0;
+    off_t src_offset = src_start;
+    int i = 0, slot, outstanding = 0;
+
+    if(buffers == NULL || slots == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(;;)
+    {
+        // start a chunk in every idle slot
+        for(slot = 0; slot < aio->depth && i < num_extents; slot++)
+        {
+            copy_slot_t * s = &slots[slot];
+            unsigned char * buffer = buffers + slot * chunk;
+            size_t left = (size_t)extents[i].length * bs - ext_done;
+
+            if(s->state != COPY_IDLE)
+                continue;
+
+            s->len = left < chunk ? left : chunk;
+            s->want = s->len < file_size ? s->len : file_size;
+            s->offset = uvfs_block_offset(image, extents[i].start) + ext_done;
+
+            ext_done += s->len;
+            if(ext_done == (size_t)extents[i].length * bs)
+            {
+                i++;
+                ext_done = 0;
+            }
+            file_size -= s->want;
+            outstanding++;
+
+            if(s->want == 0)
+            {
+                memset(buffer, 0, s->len);
+                s->state = COPY_WRITING;
+                uvfs_aio_write(aio, image->fd, buffer, s->len, s->offset, slot);
+            }
+            else
+            {
+                s->state = COPY_READING;
+                uvfs_aio_read(aio, src_fd, buffer, s->want, src_offset, slot);
+                src_offset += s->want;
+            }
+        }
+
+        if(outstanding == 0)
+            break;
+
+        size_t n = uvfs_aio_wait(aio, &slot);
+        copy_slot_t * s = &slots[slot];
+
+        if(s->state == COPY_READING)
+        {
+            unsigned char * buffer = buffers + slot * chunk;
+
+            if(n != s->want)
+            {
+                fprintf(stderr, "Read failed.\n");
+                exit(1);
+            }
+            memset(buffer + s->want, 0, s->len - s->want);
+            s->state = COPY_WRITING;
+            uvfs_aio_write(aio, image->fd, buffer, s->len, s->offset, slot);
+        }
+        else
+        {
+            s->state = COPY_IDLE;
+            outstanding--;
+        }
+    }
+
+    free(buffers);
+    free(slots);
+}
+
+/*
+ * Copies file_size bytes of src_fd, from src_start, into extents with up
+ * to num_threads threads, the calling thread among them. The tail of the
+ * last block is zero filled.
+ */
+static void write_parallel(uvfs_store_t * store, int src_fd, off_t src_start,
+    uvfs_extent_t * extents, int num_extents, size_t file_size)
+{
+    uvfs_image_t * image = store->image;
+    size_t bs = image->sb.block_size;
+    size_t piece = COPY_PIECE - COPY_PIECE % bs;
+    pthread_t threads[STORE_MAX_THREADS];
+    copy_pool_t pool;
+    off_t src_offset = src_start;
+    int i, num_threads = store->num_threads;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.src_fd = src_fd;
+    pool.dst_fd = image->fd;
+
+    for(i = 0; i < num_extents; i++)
+    {
+        size_t ext_len = (size_t)extents[i].length * bs, ext_done;
+
+        for(ext_done = 0; ext_done < ext_len; ext_done += piece)
+        {
+            pool.pieces = realloc(pool.pieces, (pool.num_pieces + 1) * sizeof(copy_piece_t));
+            if(pool.pieces == NULL)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+
+            copy_piece_t * p = &pool.pieces[pool.num_pieces++];
+            p->len = ext_len - ext_done < piece ? ext_len - ext_done : piece;
+            p->want = p->len < file_size ? p->len : file_size;
+            p->offset = uvfs_block_offset(image, extents[i].start) + ext_done;
+            p->src_offset = src_offset;
+            src_offset += p->want;
+            file_size -= p->want;
+        }
+    }
+
+    if(num_threads > STORE_MAX_THREADS)
+        num_threads = STORE_MAX_THREADS;
+    if(num_threads > pool.num_pieces)
+        num_threads = pool.num_pieces;
+
+    for(i = 1; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, copy_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Could not start thread.\n");
+            exit(1);
+        }
+    }
+    copy_worker(&pool);
+    for(i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(pool.pieces);
+}
+
+/*
+ * Copies pieces of pool until none are left
+ */
+static void * copy_worker(void * arg)
+{
+    copy_pool_t * pool = arg;
+    unsigned char * buffer = malloc(COPY_PIECE);
+    size_t i;
+
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    while((i = __atomic_fetch_add(&pool->next_piece, 1, __ATOMIC_RELAXED)) < pool->num_pieces)
+        copy_piece(pool, &pool->pieces[i], buffer);
+
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Copies one piece, in the kernel if it will, and zero fills the rest of
+ * its image bytes. buffer holds COPY_PIECE bytes.
+ */
+static void copy_piece(copy_pool_t * pool, const copy_piece_t * p, unsigned char * buffer)
+{
+    size_t done = 0;
+
+    while(done < p->want && !__atomic_load_n(&pool->no_copy_range, __ATOMIC_RELAXED))
+    {
+        loff_t src_offset = p->src_offset + done, offset = p->offset + done;
+        ssize_t n = copy_file_range(pool->src_fd, &src_offset, pool->dst_fd, &offset,
+            p->want - done, 0);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+            errno == EOPNOTSUPP || errno == EBADF))
+        {
+            __atomic_store_n(&pool->no_copy_range, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if(n <= 0)
+        {
+            fprintf(stderr, n == 0 ? "Read failed.\n" : "Write failed.\n");
+            exit(1);
+        }
+        done += n;
+    }
+
+    if(done < p->want)
+    {
+        if(uvfs_pread(pool->src_fd, buffer, p->want - done, p->src_offset + done) != p->want - done)
+        {
+            fprintf(stderr, "Read failed.\n");
+            exit(1);
+        }
+        write_all(pool->dst_fd, buffer, p->want - done, p->offset + done);
+    }
+
+    if(p->len > p->want)
+    {
+        memset(buffer, 0, p->len - p->want);
+        write_all(pool->dst_fd, buffer, p->len - p->want, p->offset + p->want);
+    }
+}
+
+static void write_all(int fd, const void * buffer, size_t len, off_t offset)
+{
+    const unsigned char * p = buffer;
+
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            fprintf(stderr, "Write failed.\n");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/*
+ * Finds blocks for the persistent directory name table: an existing table
+ * is rewritten in place, otherwise a contiguous run is reserved in the
+ * FAT. The table itself is written by store_commit once the directory
+ * is on disk.
+ */
+static void build_dir_index(uvfs_store_t * store)
+{
+    uvfs_image_t * image = store->image;
+    unsigned int start, blocks, b;
+    unsigned int bs = image->sb.block_size;
+    unsigned int need = (store->names.num_slots * sizeof(uint32_t) + bs - 1) / bs;
+
+    if(uvfs_dirtable_location(image, &start, &blocks) && blocks >= need)
+    {
+        store->table_start = start;
+        store->table_blocks = blocks;
+        return;
+    }
+
+    int num_extents;
+    uvfs_extent_t * extents = uvfs_alloc_blocks(&store->alloc, need, &num_extents);
+
+    if(extents == NULL || num_extents != 1)
+    {
+        fprintf(stderr, "Not enough room for directory index.\n");
+        exit(1);
+    }
+
+    start = extents[0].start;
+    free(extents);
+
+    for(b = start; b < start + need; b++)
+        uvfs_fatcache_set(&store->fat, b, FAT_RESERVED);
+
+    store->census.free_blocks -= need;
+    store->census.resv_blocks += need;
+    store->table_start = start;
+    store->table_blocks = need;
+}
+
+/*
+ * Returns a private copy of the root directory for modification
+ */
+static directory_entry_t * read_dir(uvfs_image_t * image)
+{
+    size_t len = (size_t)image->sb.dir_blocks * image->sb.block_size;
+    directory_entry_t * ROOT = malloc(len);
+
+    if(ROOT == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(ROOT, image->dir, len);
+    return ROOT;
+}
+
+/*
+ * Writes back the root directory blocks holding the run's entries, with
+ * the entries given status. The blocks are taken from the image as it is
+ * now, since other stores may have changed their own entries in them.
+ * Directories the plan made or grew are written with the claims, and
+ * new ones go in the name table then.
+ */
+static void write_dir(uvfs_store_t * store, unsigned char status)
+{
+    uvfs_image_t * image = store->image;
+    directory_entry_t * dir = read_dir(image);
+    int i, indexing = 0;
+
+    for(i = 0; status == DIR_ENTRY_AVAILABLE && i < store->num_touched; i++)
+    {
+        int e = store->touched[i];
+
+        if(dir[e].status == DIR_ENTRY_AVAILABLE)
+        {
+            if(!indexing)
+                indexing = uvfs_dirtable_begin(image);
+            uvfs_dirtable_insert(image, store->ROOT[e].filename, e);
+        }
+        dir[e] = store->ROOT[e];
+    }
+
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        int e = store->jobs[i].de_index;
+
+        if(store->jobs[i].dir_block != 0)
+            continue;
+        // existing files stay as they were until the commit
+        if(status == DIR_ENTRY_AVAILABLE && store->jobs[i].mode != UVFS_STORE_CREATE)
+            continue;
+        if(store->jobs[i].mode == UVFS_STORE_REMOVE)
+        {
+            memset(&dir[e], 0, sizeof(directory_entry_t));
+            continue;
+        }
+        dir[e] = store->ROOT[e];
+        dir[e].status = status;
+        if(status == DIR_ENTRY_AVAILABLE)
+            memcpy(dir[e]._padding, DIR_CLAIM_MAGIC, DIR_CLAIM_MAGIC_LEN);
+    }
+
+    write_dirty(image, dir, store->dir_dirty, image->sb.dir_blocks, image->sb.dir_start);
+    if(indexing)
+        uvfs_dirtable_commit(image);
+    free(dir);
+}
+
+/*
+ * Returns a cleared dirty flag per block of a num_blocks block region
+ */
+static unsigned char * new_dirty(unsigned int num_blocks)
+{
+    unsigned char * dirty = calloc(num_blocks, 1);
+
+    if(dirty == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return dirty;
+}
+
+/*
+ * Writes the dirty blocks of copy, a private copy of the num_blocks block
+ * region at region_start, back in ascending order with one write per run
+ * of adjacent dirty blocks
+ */
+static void write_dirty(uvfs_image_t * image, const void * copy, const unsigned char * dirty,
+    unsigned int num_blocks, unsigned int region_start)
+{
+    size_t bs = image->sb.block_size;
+    unsigned int b = 0, run;
+
+    while(b < num_blocks)
+    {
+        if(!dirty[b])
+        {
+            b++;
+            continue;
+        }
+
+        for(run = b; run < num_blocks && dirty[run]; run++)
+            ;
+
+        uvfs_pwrite(image, (const unsigned char *)copy + (size_t)b * bs, (size_t)(run - b) * bs,
+            uvfs_block_offset(image, region_start) + (off_t)b * bs);
+        b = run;
+    }
+}
+
+/*
+ * Stores every queued job: plans them all, so a job that cannot be
+ * stored stops the run with the image untouched, then copies the data
+ * and commits the directory once. dir_index also (re)builds the
+ * persistent name table.
+ */
+void uvfs_store_run(uvfs_store_t * store, int dir_index)
+{
+    uvfs_image_t * image = store->image;
+    int i, journal;
+
+    uvfs_lock_metadata(image, UVFS_LOCK_EXCLUSIVE);
+    journal = uvfs_journal_begin(image);
+    read_metadata(store);
+
+    for(i = 0; i < store->num_jobs; i++)
+        plan_job(store, &store->jobs[i]);
+    if(dir_index)
+        build_dir_index(store);
+
+    // publish the chains, claims and counts before letting go of the
+    // lock, so concurrent stores plan around them; the summary is stale
+    // while FAT blocks are being written
+    uvfs_summary_begin(image);
+    for(i = 0; i < store->num_jobs; i++)
+        link_chain(store, store->jobs[i].extents, store->jobs[i].num_extents);
+    uvfs_fatcache_flush(&store->fat);
+    uvfs_dir_flush(store);
+    write_dir(store, DIR_ENTRY_AVAILABLE);
+    uvfs_summary_commit(image, &store->census);
+
+    // directories are published now, and other stores use them freely
+    for(i = 0; i < store->num_touched; i++)
+        uvfs_release_entry(image, store->touched[i]);
+    uvfs_journal_commit(image);
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+
+    for(i = 0; i < store->num_jobs; i++)
+        write_job(store, &store->jobs[i]);
+
+    // with a journal the commit makes the run durable, but the data it
+    // points at has to be on disk first
+    if(journal)
+        uvfs_group_sync(image);
+
+    uvfs_lock_metadata(image, UVFS_LOCK_EXCLUSIVE);
+    uvfs_journal_begin(image);
+    store_commit(store, dir_index);
+    uvfs_journal_commit(image);
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        if(store->jobs[i].claimed)
+            uvfs_release_entry(image, store->jobs[i].slot);
+    }
+
+    if(!journal)
+        uvfs_group_sync(image);
+}
+
+/*
+ * Gives the file de (network byte order) a map of its chain
+ */
+static void map_entry(uvfs_store_t * store, directory_entry_t * de)
+{
+    int num_extents;
+    uvfs_extent_t * extents = uvfs_file_extents(store->image, ntohl(de->start_block), &num_extents);
+
+    uvfs_set_map(de, uvfs_map_write(store, extents, num_extents));
+    free(extents);
+}
+
+/*
+ * Collects the entries of a directory for map_dir
+ */
+typedef struct dir_entries dir_entries_t;
+struct dir_entries {
+    directory_entry_t * entries;
+    unsigned long count;
+};
+
+static void collect_entry(const directory_entry_t * de, void * arg)
+{
+    dir_entries_t * list = arg;
+
+    list->entries[list->count++] = *de;
+}
+
+/*
+ * Gives every file under the directory rooted at root, in parent, a map
+ * of its chain
+ */
+static void map_dir(uvfs_store_t * store, unsigned int root, const uvfs_dir_path_t * parent)
+{
+    uvfs_dir_path_t at = { root, parent };
+    dir_entries_t list;
+    unsigned long i;
+
+    uvfs_dir_enter(&at);
+
+    list.count = 0;
+    if((list.entries = malloc((uvfs_dir_count(store->image, root) + 1) * sizeof(directory_entry_t))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    uvfs_dir_list(store->image, root, collect_entry, &list);
+
+    for(i = 0; i < list.count; i++)
+    {
+        if(list.entries[i].status == DIR_ENTRY_DIRECTORY)
+            map_dir(store, ntohl(list.entries[i].start_block), &at);
+        else if(list.entries[i].status == DIR_ENTRY_NORMALFILE)
+        {
+            map_entry(store, &list.entries[i]);
+            uvfs_dir_update(store, root, &list.entries[i]);
+        }
+    }
+    free(list.entries);
+}
+
+/*
+ * Moves the image to extent maps (uvicfs18): gives every file in every
+ * directory a map of its chain and then writes the new magic, all in one
+ * locked run and, on a journalled image, one transaction. Files other
+ * stores are still writing keep the tail their plan cached, which reads
+ * as a map that does not check out until they are next written. An
+ * image that already has extent maps is left as it is.
+ */
+void uvfs_store_extents(uvfs_store_t * store)
+{
+    uvfs_image_t * image = store->image;
+    directory_entry_t * dir;
+    unsigned char * dirty;
+    int i, journal;
+
+    uvfs_lock_metadata(image, UVFS_LOCK_EXCLUSIVE);
+    journal = uvfs_journal_begin(image);
+    read_metadata(store);
+
+    // another store may have converted it since the image was opened
+    if(memcmp(image->map, FILE_SYSTEM_ID_EXTENTS, FILE_SYSTEM_ID_LEN) != 0)
+    {
+        image->extent_maps = 1;
+        dir = read_dir(image);
+        dirty = new_dirty(image->sb.dir_blocks);
+
+        for(i = 0; i < image->dir_entries; i++)
+        {
+            if(dir[i].status == DIR_ENTRY_DIRECTORY)
+                map_dir(store, ntohl(dir[i].start_block), NULL);
+            else if(dir[i].status == DIR_ENTRY_NORMALFILE)
+            {
+                map_entry(store, &dir[i]);
+                dirty[i * sizeof(directory_entry_t) / image->sb.block_size] = 1;
+            }
+        }
+
+        uvfs_summary_begin(image);
+        uvfs_fatcache_flush(&store->fat);
+        uvfs_dir_flush(store);
+        write_dirty(image, dir, dirty, image->sb.dir_blocks, image->sb.dir_start);
+        uvfs_summary_commit(image, &store->census);
+        uvfs_pwrite(image, FILE_SYSTEM_ID_EXTENTS, FILE_SYSTEM_ID_LEN, 0);
+        memcpy(image->sb.magic, FILE_SYSTEM_ID_EXTENTS, FILE_SYSTEM_ID_LEN);
+        free(dir);
+        free(dirty);
+    }
+    image->extent_maps = 1;
+
+    uvfs_journal_commit(image);
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+    if(!journal)
+        uvfs_group_sync(image);
+}
+
+/*
+ * Releases what uvfs_store_load set up; the image stays open
+ */
+void uvfs_store_destroy(uvfs_store_t * store)
+{
+    int i;
+
+    for(i = 0; i < store->num_jobs; i++)
+    {
+        if(store->jobs[i].src_fd >= 0)
+            close(store->jobs[i].src_fd);
+        free(store->jobs[i].extents);
+        free(store->jobs[i].reuse);
+    }
+    for(i = 0; i < store->num_nodes; i++)
+        free(store->nodes[i].data);
+    free(store->jobs);
+    free(store->touched);
+    free(store->nodes);
+    uvfs_fatcache_destroy(&store->fat);
+    uvfs_aio_destroy(&store->aio);
+    uvfs_alloc_destroy(&store->alloc);
+    uvfs_dirhash_destroy(&store->names);
+    free(store->ROOT);
+    free(store->dir_dirty);
+    store->jobs = NULL;
+    store->num_jobs = 0;
+    store->touched = NULL;
+    store->num_touched = 0;
+    store->nodes = NULL;
+    store->num_nodes = 0;
+}
@@ -0,0 +1,945 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uvfs.h"
+
+#define FAT_CACHE_MB 8
+#define MAX_THREADS 64
+
+#define NOBODY  -1                      // block owned by no chain
+#define REGION  -2                      // superblock, FAT, name table or journal
+
+#define KIND_FILE    0
+#define KIND_DIR     1
+#define KIND_ROOTDIR 2
+#define KIND_CLAIM   3                  // a file a running store is writing
+#define KIND_DEAD    4                  // a claim left by a store that died
+
+#define FAULT_NONE   0
+#define FAULT_BROKEN 1                  // runs into a free or reserved block, or off the image
+#define FAULT_LOOP   2
+#define FAULT_SHARED 3
+#define FAULT_LONG   4                  // goes on past the blocks its entry has
+
+#define TREE_GOOD    0
+#define TREE_DAMAGED 1                  // a node of a directory's tree is not a node
+#define TREE_REPEAT  2                  // its root node is a directory already listed
+
+/*
+ * uvfsck: checks an image in time linear in its size.
+ *
+ * One pass over the FAT, split between threads, counts it and checks
+ * that exactly the superblock, the FAT, the name table and the journal
+ * are reserved. One pass over the directory tree lists every chain that
+ * should exist: the root directory, each file and subdirectory, and the
+ * claims of stores still running. Each subdirectory's root node is taken
+ * for it in the ownership array before its records are listed, so one
+ * that holds itself or an ancestor is found rather than followed. Threads then walk those chains,
+ * taking each block for its chain in an ownership array with an atomic
+ * compare and swap, so a block is visited once however the chains are
+ * tangled: a block already taken by the same chain is a cycle and one
+ * taken by another chain a cross-link, and the walk stops there. A walk
+ * also stops at the last block its entry accounts for, so a chain that
+ * runs on into another file's leaves that file its blocks. What is left
+ * allocated and owned by nobody has leaked.
+ *
+ * --repair cuts each faulty chain after its last good block and fits
+ * the entry to what is left, removes entries left with nothing and
+ * claims nobody holds, frees leaked blocks, fixes reserved marks and
+ * rewrites the allocation summary. Damaged directories are reported but
+ * left alone; what a damaged node holds cannot be listed, so leaks are
+ * then neither looked for nor freed.
+ */
+
+/************************ STRUCT *******************************/
+
+/*
+ * One chain and, after the walk, what was found on it
+ */
+typedef struct fsck_owner fsck_owner_t;
+struct fsck_owner {
+    char * path;
+    char name[DIR_FILENAME_MAX + 1];
+    int kind;                           // KIND_*
+    directory_entry_t de;               // network byte order
+    unsigned int dir_block;             // its directory's root node, 0 for the root
+    int index;                          // its entry, if the root directory holds it
+    unsigned int start;
+    unsigned int num_blocks;
+    unsigned int map;                   // extent map, 0 if none
+    unsigned int length;                // blocks of the chain it owns
+    unsigned int last;                  // the last of them
+    int fault;                          // FAULT_*
+    unsigned int fault_block;           // the block it loops back to or shares
+    int other;                          // owner of the shared block
+    int map_bad;                        // extent map disagrees with the chain
+    int tree;                           // TREE_*, for a directory
+    int same;                           // the directory listed first, for TREE_REPEAT
+};
+
+/*
+ * A stretch of blocks with one problem, from a pass over the FAT
+ */
+typedef struct fsck_range fsck_range_t;
+struct fsck_range {
+    unsigned int start;
+    unsigned int end;
+    const char * what;
+};
+
+typedef struct fsck fsck_t;
+struct fsck {
+    uvfs_image_t * image;
+    int num_threads;
+    int * owner;                        // per block: an owner, NOBODY or REGION
+    fsck_owner_t * owners;
+    int num_owners;
+    int cap_owners;
+    int next_owner;                     // shared cursor into owners
+    int busy;                           // running stores hold claims
+    int hidden;                         // damaged directories hide chains
+    unsigned int table_start, table_blocks;
+    unsigned int journal_start, journal_blocks;
+    unsigned long problems;
+};
+
+/*
+ * One thread's share of a pass over the FAT
+ */
+typedef struct fsck_slice fsck_slice_t;
+struct fsck_slice {
+    fsck_t * fsck;
+    unsigned int start;
+    unsigned int end;
+    size_t free_blocks;
+    size_t resv_blocks;
+    fsck_range_t * ranges;
+    int num_ranges;
+    int cap_ranges;
+};
+
+/*
+ * A subdirectory being walked, for the records uvfs_dir_scan passes
+ */
+typedef struct fsck_dir fsck_dir_t;
+struct fsck_dir {
+    fsck_t * fsck;
+    unsigned int root;
+    const char * path;
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+int                 add_owner(fsck_t * fsck, int kind, const directory_entry_t * de, unsigned int dir_block,
+                        int index, const char * dirname);
+void                add_entry(fsck_t * fsck, const directory_entry_t * de, unsigned int dir_block, int index,
+                        const char * dirname);
+void                add_dir_entry(const directory_entry_t * de, void * arg);
+void                add_dir(fsck_t * fsck, int id);
+int                 in_region(const fsck_t * fsck, unsigned int block);
+void                add_range(fsck_slice_t * slice, unsigned int block, const char * what);
+void                run_threads(fsck_t * fsck, void * (*fn)(void *), fsck_slice_t * slices);
+void                report_ranges(fsck_t * fsck, fsck_slice_t * slices);
+void *              scan_fat(void * arg);
+void *              scan_leaks(void * arg);
+void *              walk_chains(void * arg);
+void                walk(fsck_t * fsck, int id);
+void                own_map(fsck_t * fsck, int id);
+unsigned int        size_blocks(const uvfs_image_t * image, const fsck_owner_t * o);
+unsigned int        chain_limit(const uvfs_image_t * image, const fsck_owner_t * o);
+int                 chain_fits(const uvfs_image_t * image, unsigned int block, unsigned int n);
+void                settle(fsck_t * fsck, int id);
+void                report_owner(fsck_t * fsck, int id);
+int                 repair_owner(fsck_t * fsck, uvfs_store_t * store, int id);
+void                repair_fat(fsck_t * fsck, uvfs_store_t * store);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Records the chain of de (network byte order) in the directory whose
+ * path is dirname. Returns its owner number.
+ */
+int add_owner(fsck_t * fsck, int kind, const directory_entry_t * de, unsigned int dir_block,
+    int index, const char * dirname)
+{
+    fsck_owner_t * o;
+    size_t len = strlen(dirname) + DIR_FILENAME_MAX + 2;
+
+    if(fsck->num_owners == fsck->cap_owners)
+    {
+        fsck->cap_owners = fsck->cap_owners ? fsck->cap_owners * 2 : 64;
+        if((fsck->owners = realloc(fsck->owners, fsck->cap_owners * sizeof(fsck_owner_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    o = &fsck->owners[fsck->num_owners];
+    memset(o, 0, sizeof(fsck_owner_t));
+    if((o->path = malloc(len)) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(o->name, de->filename, DIR_FILENAME_MAX);
+    snprintf(o->path, len, "%s%s%s", dirname, dirname[0] ? "/" : "", o->name);
+    o->kind = kind;
+    o->de = *de;
+    o->dir_block = dir_block;
+    o->index = index;
+    o->start = ntohl(de->start_block);
+    o->num_blocks = ntohl(de->num_blocks);
+    o->other = NOBODY;
+    if(kind == KIND_FILE)
+        o->map = uvfs_entry_map(fsck->image, de);
+    return fsck->num_owners++;
+}
+
+/*
+ * Records the chains of one record, entry index of the root directory or
+ * in the subdirectory rooted at dir_block, and of everything under it
+ */
+void add_entry(fsck_t * fsck, const directory_entry_t * de, unsigned int dir_block, int index,
+    const char * dirname)
+{
+    uint64_t slot;
+    int id;
+
+    if(de->status == DIR_ENTRY_NORMALFILE)
+        add_owner(fsck, KIND_FILE, de, dir_block, index, dirname);
+    else if(de->status == DIR_ENTRY_DIRECTORY)
+    {
+        id = add_owner(fsck, KIND_DIR, de, dir_block, index, dirname);
+        add_dir(fsck, id);
+    }
+    else if(de->filename[0] != '\0' && memcmp(de->_padding, DIR_CLAIM_MAGIC, DIR_CLAIM_MAGIC_LEN) == 0)
+    {
+        // a running store's chain is still being written; a dead one's has leaked
+        id = add_owner(fsck, KIND_DEAD, de, dir_block, index, dirname);
+        slot = dir_block == 0 ? (uint64_t)index : uvfs_claim_slot(dir_block, fsck->owners[id].name);
+        if(uvfs_entry_claimed(fsck->image, slot))
+        {
+            fsck->owners[id].kind = KIND_CLAIM;
+            fsck->busy = 1;
+        }
+    }
+}
+
+void add_dir_entry(const directory_entry_t * de, void * arg)
+{
+    fsck_dir_t * dir = arg;
+
+    add_entry(dir->fsck, de, dir->root, -1, dir->path);
+}
+
+/*
+ * Records every chain under subdirectory owner id, whose root node it
+ * takes first. One whose root is taken already is not listed again.
+ */
+void add_dir(fsck_t * fsck, int id)
+{
+    fsck_dir_t dir;
+    unsigned int root = fsck->owners[id].start;
+    char * copy = strdup(fsck->owners[id].path);
+
+    if(copy == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    if(root < fsck->image->sb.num_blocks && fsck->owner[root] >= 0)
+    {
+        fsck->owners[id].tree = TREE_REPEAT;
+        fsck->owners[id].same = fsck->owner[root];
+        free(copy);
+        return;
+    }
+    if(root < fsck->image->sb.num_blocks && fsck->owner[root] == NOBODY)
+        fsck->owner[root] = id;
+
+    dir.fsck = fsck;
+    dir.root = root;
+    dir.path = copy;
+    if(!uvfs_dir_scan(fsck->image, root, add_dir_entry, &dir))
+    {
+        fsck->owners[id].tree = TREE_DAMAGED;
+        fsck->hidden = 1;
+    }
+    free(copy);
+}
+
+/*
+ * Returns 1 if block should be reserved: the superblock, the FAT, the
+ * name table or the journal
+ */
+int in_region(const fsck_t * fsck, unsigned int block)
+{
+    const superblock_entry_t * sb = &fsck->image->sb;
+
+    return block < sb->fat_start + sb->fat_blocks ||
+        (block >= fsck->table_start && block - fsck->table_start < fsck->table_blocks) ||
+        (block >= fsck->journal_start && block - fsck->journal_start < fsck->journal_blocks);
+}
+
+/*
+ * Adds block to the slice's ranges, extending the last one when block
+ * follows it with the same problem
+ */
+void add_range(fsck_slice_t * slice, unsigned int block, const char * what)
+{
+    fsck_range_t * r = slice->num_ranges ? &slice->ranges[slice->num_ranges - 1] : NULL;
+
+    if(r != NULL && r->what == what && r->end + 1 == block)
+    {
+        r->end = block;
+        return;
+    }
+    if(slice->num_ranges == slice->cap_ranges)
+    {
+        slice->cap_ranges = slice->cap_ranges ? slice->cap_ranges * 2 : 16;
+        if((slice->ranges = realloc(slice->ranges, slice->cap_ranges * sizeof(fsck_range_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    r = &slice->ranges[slice->num_ranges++];
+    r->start = r->end = block;
+    r->what = what;
+}
+
+/*
+ * Runs fn in each thread, on a slice of the image's blocks apiece, or on
+ * the shared owner cursor when slices is NULL
+ */
+void run_threads(fsck_t * fsck, void * (*fn)(void *), fsck_slice_t * slices)
+{
+    pthread_t threads[MAX_THREADS];
+    unsigned int num_blocks = fsck->image->sb.num_blocks;
+    int i;
+
+    for(i = 0; slices != NULL && i < fsck->num_threads; i++)
+    {
+        memset(&slices[i], 0, sizeof(fsck_slice_t));
+        slices[i].fsck = fsck;
+        slices[i].start = (uint64_t)num_blocks * i / fsck->num_threads;
+        slices[i].end = (uint64_t)num_blocks * (i + 1) / fsck->num_threads;
+    }
+    for(i = 0; i < fsck->num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, fn, slices != NULL ? (void *)&slices[i] : (void *)fsck) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < fsck->num_threads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Prints the ranges the slices found, in block order, and lets them go
+ */
+void report_ranges(fsck_t * fsck, fsck_slice_t * slices)
+{
+    int i, k;
+
+    for(i = 0; i < fsck->num_threads; i++)
+    {
+        for(k = 0; k < slices[i].num_ranges; k++)
+        {
+            fsck_range_t * r = &slices[i].ranges[k];
+
+            if(r->start == r->end)
+                printf("Block %u: %s\n", r->start, r->what);
+            else
+                printf("Blocks %u-%u: %s\n", r->start, r->end, r->what);
+            fsck->problems++;
+        }
+        free(slices[i].ranges);
+    }
+}
+
+/*
+ * Counts a slice of the FAT and checks its reserved marks
+ */
+void * scan_fat(void * arg)
+{
+    fsck_slice_t * slice = arg;
+    fsck_t * fsck = slice->fsck;
+    const uvfs_image_t * image = fsck->image;
+    unsigned int b;
+
+    uvfs_count_fat(uvfs_census_best(), image->fat + slice->start, slice->end - slice->start,
+        &slice->free_blocks, &slice->resv_blocks);
+
+    for(b = slice->start; b < slice->end; b++)
+    {
+        int region = in_region(fsck, b), reserved = uvfs_fat_entry(image, b) == FAT_RESERVED;
+
+        if(region)
+            fsck->owner[b] = REGION;
+        if(region && !reserved)
+            add_range(slice, b, "should be reserved");
+        else if(reserved && !region)
+            add_range(slice, b, "reserved outside the FAT, name table and journal");
+    }
+    return NULL;
+}
+
+/*
+ * Finds the allocated blocks in a slice that no chain owns
+ */
+void * scan_leaks(void * arg)
+{
+    fsck_slice_t * slice = arg;
+    fsck_t * fsck = slice->fsck;
+    unsigned int b;
+
+    for(b = slice->start; b < slice->end; b++)
+    {
+        unsigned int next = uvfs_fat_entry(fsck->image, b);
+
+        if(next != FAT_AVAILABLE && next != FAT_RESERVED && fsck->owner[b] == NOBODY)
+            add_range(slice, b, "allocated to nothing");
+    }
+    return NULL;
+}
+
+void * walk_chains(void * arg)
+{
+    fsck_t * fsck = arg;
+    int id;
+
+    while((id = __atomic_fetch_add(&fsck->next_owner, 1, __ATOMIC_RELAXED)) < fsck->num_owners)
+        walk(fsck, id);
+    return NULL;
+}
+
+/*
+ * Walks the chain of owner id, taking its blocks, until it ends, breaks,
+ * or reaches a block already taken. A file's extent map is checked
+ * against the chain on the way, and its blocks taken if it is good.
+ */
+void walk(fsck_t * fsck, int id)
+{
+    const uvfs_image_t * image = fsck->image;
+    fsck_owner_t * o = &fsck->owners[id];
+    unsigned int block = o->start, used = 0, limit = chain_limit(image, o);
+    uvfs_extent_t * runs = NULL;
+    int num_runs = 0, at = 0;
+
+    // a repeated directory's chain is the first one's
+    if(o->kind == KIND_DEAD || o->tree == TREE_REPEAT)
+        return;
+    if(o->map != 0 && (runs = uvfs_map_extents(image, o->map, o->num_blocks, &num_runs)) == NULL)
+        o->map_bad = 1;
+
+    while(1)
+    {
+        int expected = NOBODY;
+        unsigned int next;
+
+        if(block >= image->sb.num_blocks ||
+            (next = uvfs_fat_entry(image, block)) == FAT_AVAILABLE || next == FAT_RESERVED)
+        {
+            o->fault = FAULT_BROKEN;
+            break;
+        }
+        if(!__atomic_compare_exchange_n(&fsck->owner[block], &expected, id, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            o->fault = expected == id ? FAULT_LOOP : FAULT_SHARED;
+            o->fault_block = block;
+            o->other = expected;
+            break;
+        }
+
+        // the map must name the same blocks in the same order
+        if(runs != NULL)
+        {
+            if(at >= num_runs || block != runs[at].start + used)
+                o->map_bad = 1;
+            else if(++used == runs[at].length)
+            {
+                at++;
+                used = 0;
+            }
+        }
+
+        o->length++;
+        o->last = block;
+        if(next == FAT_LASTBLOCK)
+            break;
+        if(o->length == limit && o->kind != KIND_CLAIM)
+        {
+            o->fault = FAULT_LONG;
+            break;
+        }
+        block = next;
+    }
+
+    if(runs != NULL && (o->fault != FAULT_NONE || at != num_runs))
+        o->map_bad = 1;
+    if(runs != NULL && !o->map_bad)
+        own_map(fsck, id);
+    free(runs);
+}
+
+/*
+ * Takes the blocks of owner id's extent map; one some other chain has
+ * makes the map bad
+ */
+void own_map(fsck_t * fsck, int id)
+{
+    const uvfs_image_t * image = fsck->image;
+    unsigned int map = fsck->owners[id].map;
+
+    while(map != 0)
+    {
+        int expected = NOBODY;
+
+        if(uvfs_fat_entry(image, map) != FAT_LASTBLOCK ||
+            !__atomic_compare_exchange_n(&fsck->owner[map], &expected, id, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            fsck->owners[id].map_bad = 1;
+            return;
+        }
+        map = ntohl(((const extent_map_t *)uvfs_block(image, map))->next);
+    }
+}
+
+/*
+ * Returns the blocks o's entry should have for its size
+ */
+unsigned int size_blocks(const uvfs_image_t * image, const fsck_owner_t * o)
+{
+    size_t size = ntohl(o->de.file_size), bs = image->sb.block_size;
+
+    if(o->kind == KIND_DIR || o->kind == KIND_ROOTDIR)
+        return size % bs == 0 ? size / bs : 0;
+    return size == 0 ? 1 : (size + bs - 1) / bs;
+}
+
+/*
+ * Returns the most blocks o's chain should have, going by its entry
+ */
+unsigned int chain_limit(const uvfs_image_t * image, const fsck_owner_t * o)
+{
+    unsigned int need = size_blocks(image, o);
+
+    return need > o->num_blocks ? need : o->num_blocks;
+}
+
+/*
+ * Returns 1 if the chain from block is a good chain of exactly n blocks
+ */
+int chain_fits(const uvfs_image_t * image, unsigned int block, unsigned int n)
+{
+    unsigned int next;
+
+    while(n-- > 0)
+    {
+        if(block >= image->sb.num_blocks ||
+            (next = uvfs_fat_entry(image, block)) == FAT_AVAILABLE || next == FAT_RESERVED)
+            return 0;
+        if(next == FAT_LASTBLOCK)
+            return n == 0;
+        block = next;
+    }
+    return 0;
+}
+
+/*
+ * Settles a cross-link found by owner id's walk. Whichever walk got to
+ * the shared block first took the rest of the chain, so if the chain
+ * from there is just what the loser's entry lacks and not what the
+ * winner's does, the loser was right: the winner gives back the shared
+ * blocks and the loser is walked again.
+ */
+void settle(fsck_t * fsck, int id)
+{
+    const uvfs_image_t * image = fsck->image;
+    fsck_owner_t * o = &fsck->owners[id], * w;
+    unsigned int block, pos = 0, prev = 0, k;
+
+    if(o->fault != FAULT_SHARED || o->other < 0)
+        return;
+    w = &fsck->owners[o->other];
+    for(block = w->start; block != o->fault_block && pos < w->length; pos++)
+    {
+        prev = block;
+        block = uvfs_fat_entry(image, block);
+    }
+    if(pos == w->length || w->kind == KIND_CLAIM ||
+        !chain_fits(image, block, chain_limit(image, o) - o->length) ||
+        chain_fits(image, block, chain_limit(image, w) - pos))
+        return;
+
+    for(k = pos; k < w->length; k++)
+    {
+        fsck->owner[block] = NOBODY;
+        block = uvfs_fat_entry(image, block);
+    }
+    w->length = pos;
+    w->last = prev;
+    w->fault = FAULT_SHARED;
+    w->fault_block = o->fault_block;
+    w->other = id;
+
+    for(block = o->start, k = 0; k < o->length; k++)
+    {
+        fsck->owner[block] = NOBODY;
+        block = uvfs_fat_entry(image, block);
+    }
+    o->length = o->last = o->fault_block = 0;
+    o->fault = FAULT_NONE;
+    o->other = NOBODY;
+    o->map_bad = 0;
+    walk(fsck, id);
+}
+
+/*
+ * Prints what the walk found wrong with owner id
+ */
+void report_owner(fsck_t * fsck, int id)
+{
+    fsck_owner_t * o = &fsck->owners[id];
+
+    // a running store's chain may not be finished
+    if(o->kind == KIND_CLAIM)
+        return;
+    if(o->kind == KIND_DEAD)
+    {
+        printf("%s: claimed by a store that did not finish\n", o->path);
+        fsck->problems++;
+        return;
+    }
+    if(o->tree == TREE_REPEAT)
+    {
+        printf("%s: directory is %s again\n", o->path, fsck->owners[o->same].path);
+        fsck->problems++;
+        return;
+    }
+
+    switch(o->fault)
+    {
+        case FAULT_BROKEN:
+            if(o->length == 0)
+                printf("%s: chain broken at its start\n", o->path);
+            else
+                printf("%s: chain broken after block %u\n", o->path, o->last);
+            break;
+        case FAULT_LONG:
+            printf("%s: chain runs on past block %u\n", o->path, o->last);
+            break;
+        case FAULT_LOOP:
+            printf("%s: chain loops back to block %u\n", o->path, o->fault_block);
+            break;
+        case FAULT_SHARED:
+            if(o->other == REGION)
+                printf("%s: chain runs into reserved block %u\n", o->path, o->fault_block);
+            else if(o->other < id)
+                printf("%s and %s share block %u\n", fsck->owners[o->other].path, o->path, o->fault_block);
+            else
+                printf("%s and %s share block %u\n", o->path, fsck->owners[o->other].path, o->fault_block);
+            break;
+        default:
+            if(o->length != o->num_blocks)
+                printf("%s: chain is %u blocks, entry says %u\n", o->path, o->length, o->num_blocks);
+    }
+    if(o->fault != FAULT_NONE || o->length != o->num_blocks)
+        fsck->problems++;
+
+    if(size_blocks(fsck->image, o) != o->num_blocks)
+    {
+        printf("%s: %u bytes do not fit %u blocks\n", o->path, ntohl(o->de.file_size), o->num_blocks);
+        fsck->problems++;
+    }
+    if(o->map_bad)
+    {
+        printf("%s: extent map disagrees with the chain\n", o->path);
+        fsck->problems++;
+    }
+    if(o->tree == TREE_DAMAGED)
+    {
+        printf("%s: directory is damaged\n", o->path);
+        fsck->problems++;
+    }
+}
+
+/*
+ * Cuts owner id's chain after its last good block, or where its size
+ * says it ends, and fits its entry to what is left, removing it if
+ * nothing is. A repeated directory's entry is removed, which leaves its
+ * tree to the first. Blocks cut off are left for repair_fat. Returns 0
+ * if it cannot be repaired.
+ */
+int repair_owner(fsck_t * fsck, uvfs_store_t * store, int id)
+{
+    uvfs_image_t * image = fsck->image;
+    fsck_owner_t * o = &fsck->owners[id];
+    unsigned int need = size_blocks(image, o), keep = o->length, block = o->start, map, k;
+    size_t bs = image->sb.block_size;
+    directory_entry_t de;
+
+    if(o->tree == TREE_DAMAGED)
+        return 0;
+    if(o->tree == TREE_REPEAT)
+        keep = 0;
+    else if(o->kind != KIND_DEAD && o->fault == FAULT_NONE && o->length == o->num_blocks &&
+        need == o->num_blocks && !o->map_bad)
+        return 1;
+    else if(o->kind == KIND_CLAIM || o->kind == KIND_ROOTDIR ||
+        (o->kind == KIND_DIR && ((o->fault != FAULT_NONE && o->fault != FAULT_LONG) || o->length == 0)))
+        return 0;
+
+    if(o->kind == KIND_FILE && need < keep)
+        keep = need;
+
+    // a good map that will no longer describe the file is freed with the cut blocks
+    if(o->map != 0 && !o->map_bad && keep != o->num_blocks)
+    {
+        for(map = o->map; map != 0; map = ntohl(((const extent_map_t *)uvfs_block(image, map))->next))
+            fsck->owner[map] = NOBODY;
+    }
+
+    if(o->kind == KIND_DEAD || keep == 0)
+    {
+        if(o->dir_block != 0)
+            return uvfs_dir_delete(store, o->dir_block, o->name);
+        memset(&de, 0, sizeof(de));
+        uvfs_pwrite(image, &de, sizeof(de), uvfs_dir_entry_offset(image, o->index));
+        uvfs_dirtable_remove(image, o->name, o->index);
+        return 1;
+    }
+
+    for(k = 0; k < o->length; k++)
+    {
+        if(k + 1 == keep)
+            uvfs_fatcache_set(&store->fat, block, FAT_LASTBLOCK);
+        else if(k >= keep)
+            fsck->owner[block] = NOBODY;
+        block = uvfs_fat_entry(image, block);
+    }
+
+    de = o->de;
+    convertToHostDE(&de);
+    if(o->kind == KIND_DIR || de.file_size > keep * bs)
+        de.file_size = keep * bs;
+    de.num_blocks = keep;
+    convertToNetDE(&de);
+    if(o->kind == KIND_FILE && image->extent_maps)
+    {
+        // readers walk the chain until a store writes a new map
+        if(o->map_bad || keep != o->num_blocks)
+            memset(de._padding, 0, sizeof(de._padding));
+    }
+    else if(o->kind == KIND_FILE)
+    {
+        for(block = o->start, k = 1; k < keep; k++)
+            block = uvfs_fat_entry(image, block);
+        uvfs_set_tail(&de, block);
+    }
+
+    if(o->dir_block != 0)
+        return uvfs_dir_update(store, o->dir_block, &de);
+    uvfs_pwrite(image, &de, sizeof(de), uvfs_dir_entry_offset(image, o->index));
+    return 1;
+}
+
+/*
+ * Frees every allocated block nobody owns, unless damaged directories
+ * may hold it, and puts the reserved marks where they belong
+ */
+void repair_fat(fsck_t * fsck, uvfs_store_t * store)
+{
+    unsigned int b;
+
+    for(b = 0; b < fsck->image->sb.num_blocks; b++)
+    {
+        unsigned int next = uvfs_fatcache_get(&store->fat, b);
+        int region = in_region(fsck, b);
+
+        if(region && next != FAT_RESERVED)
+            uvfs_fatcache_set(&store->fat, b, FAT_RESERVED);
+        else if(!region && !fsck->hidden && next != FAT_AVAILABLE && fsck->owner[b] == NOBODY)
+            uvfs_fatcache_set(&store->fat, b, FAT_AVAILABLE);
+    }
+}
+
+/*************************** MAIN ***************************/
+
+int main(int argc, char *argv[]) {
+    int  i;
+    char *imagename  = NULL;
+    int  repair      = 0;
+    int  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    uvfs_image_t image;
+    fsck_t fsck;
+    fsck_slice_t slices[MAX_THREADS];
+    uvfs_census_t census, summary;
+    directory_entry_t root;
+    int unrepaired = 0;
+
+/******************* ZASTRE ***********************/
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            imagename = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--repair") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            num_threads = atoi(argv[i+1]);
+            i++;
+        }
+    }
+
+    if (imagename == NULL)
+    {
+        fprintf(stderr, "usage: uvfsck --image <imagename> [--repair] [--threads <n>]\n");
+        exit(1);
+    }
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+/******************** END Z *********************/
+
+    uvfs_open(&image, imagename, repair ? UVFS_RDWR : UVFS_RDONLY);
+    uvfs_lock_metadata(&image, repair ? UVFS_LOCK_EXCLUSIVE : UVFS_LOCK_SHARED);
+
+    memset(&fsck, 0, sizeof(fsck));
+    fsck.image = &image;
+    fsck.num_threads = num_threads;
+    if((fsck.owner = malloc((size_t)image.sb.num_blocks * sizeof(int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < image.sb.num_blocks; i++)
+        fsck.owner[i] = NOBODY;
+    uvfs_dirtable_location(&image, &fsck.table_start, &fsck.table_blocks);
+    uvfs_journal_location(&image, &fsck.journal_start, &fsck.journal_blocks);
+
+    // the FAT in bulk: its counts and reserved marks
+    run_threads(&fsck, scan_fat, slices);
+    memset(&census, 0, sizeof(census));
+    for(i = 0; i < num_threads; i++)
+    {
+        census.free_blocks += slices[i].free_blocks;
+        census.resv_blocks += slices[i].resv_blocks;
+    }
+    census.alloc_blocks = image.sb.num_blocks - census.free_blocks - census.resv_blocks;
+    report_ranges(&fsck, slices);
+
+    // the directory tree: every chain there should be
+    memset(&root, 0, sizeof(root));
+    root.start_block = htonl(image.sb.dir_start);
+    root.num_blocks = htonl(image.sb.dir_blocks);
+    root.file_size = htonl(image.sb.dir_blocks * image.sb.block_size);
+    add_owner(&fsck, KIND_ROOTDIR, &root, 0, -1, "");
+    free(fsck.owners[0].path);
+    if((fsck.owners[0].path = strdup("root directory")) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < image.dir_entries; i++)
+        add_entry(&fsck, &image.dir[i], 0, i, "");
+
+    // the walks take the directories' root nodes again
+    for(i = 0; i < fsck.num_owners; i++)
+    {
+        if(fsck.owners[i].kind == KIND_DIR && fsck.owners[i].start < image.sb.num_blocks &&
+            fsck.owner[fsck.owners[i].start] == i)
+            fsck.owner[fsck.owners[i].start] = NOBODY;
+    }
+
+    // the chains, each walked by one thread
+    run_threads(&fsck, walk_chains, NULL);
+    for(i = 0; i < fsck.num_owners; i++)
+        settle(&fsck, i);
+    for(i = 0; i < fsck.num_owners; i++)
+        report_owner(&fsck, i);
+
+    // running stores hold blocks their chains do not reach yet
+    if(fsck.busy)
+        printf("Other stores are writing the image; leaks were not looked for.\n");
+    else if(fsck.hidden)
+        printf("Damaged directories hide what they hold; leaks were not looked for.\n");
+    else
+    {
+        run_threads(&fsck, scan_leaks, slices);
+        report_ranges(&fsck, slices);
+    }
+
+    if(uvfs_summary_read(&image, &summary) == UVFS_SUMMARY_VALID &&
+        memcmp(&summary, &census, sizeof(census)) != 0)
+    {
+        printf("Allocation summary does not match the FAT.\n");
+        fsck.problems++;
+    }
+
+    if(repair && fsck.problems > 0)
+    {
+        uvfs_store_t store;
+        int indexing;
+
+        if(fsck.busy)
+        {
+            fprintf(stderr, "Image is being written by another store.\n");
+            exit(1);
+        }
+
+        memset(&store, 0, sizeof(store));
+        store.image = &image;
+        uvfs_fatcache_init(&store.fat, &image, FAT_CACHE_MB << 20);
+
+        // entries first, so stopping part way leaves blocks leaked but
+        // never an entry naming a freed block
+        uvfs_summary_begin(&image);
+        indexing = uvfs_dirtable_begin(&image);
+        for(i = 0; i < fsck.num_owners; i++)
+        {
+            if(!repair_owner(&fsck, &store, i))
+            {
+                printf("%s: cannot be repaired\n", fsck.owners[i].path);
+                unrepaired = 1;
+            }
+        }
+        uvfs_dir_flush(&store);
+        uvfs_fatcache_flush(&store.fat);
+        if(indexing)
+            uvfs_dirtable_commit(&image);
+        uvfs_group_sync(&image);
+
+        repair_fat(&fsck, &store);
+        uvfs_fatcache_flush(&store.fat);
+        uvfs_fat_census(&image, &census);
+        uvfs_summary_commit(&image, &census);
+        uvfs_group_sync(&image);
+        uvfs_fatcache_destroy(&store.fat);
+    }
+    uvfs_lock_metadata(&image, UVFS_LOCK_NONE);
+
+    if(fsck.problems == 0)
+        printf("No problems found.\n");
+    else
+        printf("%lu problem%s found%s.\n", fsck.problems, fsck.problems == 1 ? "" : "s",
+            !repair ? "" : unrepaired ? ", not all repaired" : " and repaired");
+
+    for(i = 0; i < fsck.num_owners; i++)
+        free(fsck.owners[i].path);
+    free(fsck.owners);
+    free(fsck.owner);
+    uvfs_close(&image);
+
+    return fsck.problems > 0 && (!repair || unrepaired);
+}
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "uvfs.h"
+
+#define MAX_IMAGES 64
+#define MAX_NAME_LEN 4096
+#define ERROR_MAX 1024
+#define CLIENT_TIMEOUT 5
+#define STORE_FAT_CACHE (8 << 20)
+#define RECV_CHUNK (64 << 10)
+
+/************************ STRUCT *******************************/
+
+/*
+ * An image kept open for the life of the server with the metadata every
+ * request needs: allocation counts, the name index over the mapped root
+ * directory and a chain index for every file. Other processes store,
+ * replace, remove and defragment files behind the server's back, so
+ * these are checked against the image under the metadata lock when used
+ * and rebuilt where they are out of date.
+ */
+typedef struct served served_t;
+struct served {
+    uvfs_image_t image;
+    char path[PATH_MAX];                // canonical path clients ask for
+    uvfs_census_t census;
+    uvfs_dirhash_t names;
+    uvfs_index_t * indexes;             // one per directory entry
+    directory_entry_t * keys;           // the entries they were built from, on-disk order
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+void                load_image(served_t * served, char * imagename, int mode);
+void                refresh(served_t * served);
+void                read_census(served_t * served);
+uvfs_index_t *      resident_index(served_t * served, const char * name, directory_entry_t * de);
+served_t *          find_image(const char * path);
+void                serve(int fd);
+void                serve_stat(int fd, served_t * served);
+void                serve_ls(int fd, served_t * served);
+void                serve_cat(int fd, served_t * served, const char * name, uint64_t offset, uint64_t length);
+void                serve_store(int fd, served_t * served, const char * name, uint64_t length);
+int                 reply(int fd, uint32_t status, const void * payload, uint64_t length);
+int                 reply_error(int fd, const char * message);
+int                 send_all(int fd, const void * buffer, size_t len);
+int                 recv_all(int fd, void * buffer, size_t len);
+void                on_signal(int sig);
+
+/************************* GLOBALS *************************/
+
+served_t images[MAX_IMAGES];
+int num_images = 0;
+volatile sig_atomic_t stopping = 0;
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+void load_image(served_t * served, char * imagename, int mode)
+{
+    uvfs_open(&served->image, imagename, mode);
+    if(realpath(imagename, served->path) == NULL)
+    {
+        fprintf(stderr, "Specified image could not be opened.\n");
+        exit(1);
+    }
+    refresh(served);
+}
+
+/*
+ * Rebuilds the resident metadata of served from its mapping, at start-up
+ * and after every store it runs
+ */
+void refresh(served_t * served)
+{
+    uvfs_image_t * image = &served->image;
+    int i;
+
+    uvfs_lock_metadata(image, UVFS_LOCK_SHARED);
+
+    read_census(served);
+
+    if(served->names.slots != NULL)
+        uvfs_dirhash_destroy(&served->names);
+    uvfs_dirhash_build(&served->names, image->dir, image->dir_entries);
+
+    if(served->indexes == NULL &&
+        ((served->indexes = calloc(image->dir_entries, sizeof(uvfs_index_t))) == NULL ||
+        (served->keys = calloc(image->dir_entries, sizeof(directory_entry_t))) == NULL))
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        directory_entry_t de = image->dir[i];
+
+        uvfs_index_destroy(&served->indexes[i]);
+        served->keys[i] = de;
+        if(de.status != DIR_ENTRY_NORMALFILE)
+            continue;
+
+        convertToNetDE(&de);
+        uvfs_index_build(image, &de, &served->indexes[i]);
+    }
+
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+}
+
+/*
+ * Takes the allocation counts from the summary, or a FAT scan if it is
+ * not clean; called with the metadata lock held
+ */
+void read_census(served_t * served)
+{
+    if(uvfs_summary_read(&served->image, &served->census) != UVFS_SUMMARY_VALID)
+        uvfs_fat_census(&served->image, &served->census);
+}
+
+/*
+ * Returns the resident index of the root directory file name and copies
+ * its entry, host byte order, to de, or returns NULL if there is no such
+ * file. Called with the metadata lock held. Name lookups only ever land
+ * on live entries, so a miss rebuilds the name index and looks again; an
+ * index is rebuilt if its entry has changed since, or if its extents no
+ * longer match the FAT, as after a defragmenter moves the blocks.
+ */
+uvfs_index_t * resident_index(served_t * served, const char * name, directory_entry_t * de)
+{
+    uvfs_image_t * image = &served->image;
+    int entry;
+
+    if((entry = uvfs_dirhash_find(&served->names, name)) < 0)
+    {
+        uvfs_dirhash_destroy(&served->names);
+        uvfs_dirhash_build(&served->names, image->dir, image->dir_entries);
+        entry = uvfs_dirhash_find(&served->names, name);
+    }
+    if(entry < 0 || image->dir[entry].status != DIR_ENTRY_NORMALFILE)
+        return NULL;
+
+    *de = image->dir[entry];
+    convertToNetDE(de);
+    if(memcmp(&served->keys[entry], &image->dir[entry], sizeof(directory_entry_t)) != 0 ||
+        !uvfs_index_valid(image, de, &served->indexes[entry]))
+    {
+        uvfs_index_destroy(&served->indexes[entry]);
+        uvfs_index_build(image, de, &served->indexes[entry]);
+        served->keys[entry] = image->dir[entry];
+    }
+    return &served->indexes[entry];
+}
+
+served_t * find_image(const char * path)
+{
+    int i;
+
+    for(i = 0; i < num_images; i++)
+    {
+        if(strcmp(images[i].path, path) == 0)
+            return &images[i];
+    }
+    return NULL;
+}
+
+int send_all(int fd, const void * buffer, size_t len)
+{
+    const unsigned char * p = buffer;
+
+    while(len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void * buffer, size_t len)
+{
+    unsigned char * p = buffer;
+
+    while(len > 0)
+    {
+        ssize_t n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int reply(int fd, uint32_t status, const void * payload, uint64_t length)
+{
+    uvfsd_response_t resp;
+
+    memcpy(resp.magic, UVFSD_MAGIC, UVFSD_MAGIC_LEN);
+    resp.status = status;
+    resp.length = length;
+
+    if(send_all(fd, &resp, sizeof(resp)) != 0)
+        return -1;
+    return payload != NULL ? send_all(fd, payload, length) : 0;
+}
+
+int reply_error(int fd, const char * message)
+{
+    return reply(fd, 1, message, strlen(message));
+}
+
+/*
+ * Reads one request from fd and answers it
+ */
+void serve(int fd)
+{
+    uvfsd_request_t req;
+    char path[PATH_MAX];
+    char name[MAX_NAME_LEN];
+    served_t * served;
+
+    if(recv_all(fd, &req, sizeof(req)) != 0)
+        return;
+
+    if(strncmp(req.magic, UVFSD_MAGIC, UVFSD_MAGIC_LEN) != 0 ||
+        req.image_len >= sizeof(path) || req.name_len >= sizeof(name))
+    {
+        reply_error(fd, "Bad request.");
+        return;
+    }
+
+    if(recv_all(fd, path, req.image_len) != 0 || recv_all(fd, name, req.name_len) != 0)
+        return;
+    path[req.image_len] = '\0';
+    name[req.name_len] = '\0';
+
+    if((served = find_image(path)) == NULL)
+    {
+        reply_error(fd, "Image not served.");
+        return;
+    }
+
+    switch(req.op) {
+    case UVFSD_STAT:
+        serve_stat(fd, served);
+        break;
+    case UVFSD_LS:
+        serve_ls(fd, served);
+        break;
+    case UVFSD_CAT:
+        serve_cat(fd, served, name, req.offset, req.length);
+        break;
+    case UVFSD_STORE:
+        serve_store(fd, served, name, req.length);
+        break;
+    default:
+        reply_error(fd, "Bad request.");
+    }
+}
+
+void serve_stat(int fd, served_t * served)
+{
+    uvfsd_stat_t st;
+
+    uvfs_lock_metadata(&served->image, UVFS_LOCK_SHARED);
+    read_census(served);
+    uvfs_lock_metadata(&served->image, UVFS_LOCK_NONE);
+
+    st.sb = served->image.sb;
+    st.free_blocks = served->census.free_blocks;
+    st.resv_blocks = served->census.resv_blocks;
+    st.alloc_blocks = served->census.alloc_blocks;
+    reply(fd, 0, &st, sizeof(st));
+}
+
+void serve_ls(int fd, served_t * served)
+{
+    uvfs_image_t * image = &served->image;
+    directory_entry_t * entries = malloc(image->dir_entries * sizeof(directory_entry_t));
+    int i, n = 0;
+
+    if(entries == NULL)
+    {
+        reply_error(fd, "Out of memory.");
+        return;
+    }
+
+    uvfs_lock_metadata(image, UVFS_LOCK_SHARED);
+    for(i = 0; i < image->dir_entries; i++)
+    {
+        if(image->dir[i].status != DIR_ENTRY_AVAILABLE)
+            entries[n++] = image->dir[i];
+    }
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+
+    reply(fd, 0, entries, n * sizeof(directory_entry_t));
+    free(entries);
+}
+
+/*
+ * Sends length bytes of name from offset (clipped to the file) straight
+ * from the image to the socket along the file's chain index
+ */
+void serve_cat(int fd, served_t * served, const char * name, uint64_t offset, uint64_t length)
+{
+    uvfs_image_t * image = &served->image;
+    size_t bs = image->sb.block_size;
+    uvfs_sender_t sender;
+    uvfs_index_t * index, nested;
+    directory_entry_t de;
+    int i, found;
+
+    // files in subdirectories are not kept resident: they are looked up
+    // and indexed for the request
+    uvfs_lock_metadata(image, UVFS_LOCK_SHARED);
+    if(strchr(name, '/') == NULL)
+        found = (index = resident_index(served, name, &de)) != NULL;
+    else
+    {
+        found = uvfs_lookup(image, name, &de) && de.status == DIR_ENTRY_NORMALFILE;
+        if(found)
+        {
+            convertToNetDE(&de);
+            uvfs_index_build(image, &de, &nested);
+        }
+        index = &nested;
+    }
+    uvfs_lock_metadata(image, UVFS_LOCK_NONE);
+
+    if(!found)
+    {
+        reply_error(fd, "File not found on specified image.");
+        return;
+    }
+
+    if(offset > de.file_size)
+        offset = de.file_size;
+    if(length > de.file_size - offset)
+        length = de.file_size - offset;
+
+    if((size_t)index->first_block[index->num_extents] * bs < offset + length)
+        reply_error(fd, "Corrupt FAT chain.");
+    else if(reply(fd, 0, NULL, length) == 0)
+    {
+        uvfs_sender_init(&sender, fd);
+
+        for(i = uvfs_index_lookup(index, offset / bs); length > 0; i++)
+        {
+            size_t start = (size_t)index->first_block[i] * bs;
+            size_t skip = offset - start;
+            size_t len = (size_t)index->extents[i].length * bs - skip;
+
+            if(len > length)
+                len = length;
+
+            if(uvfs_send_range(image, &sender,
+                uvfs_block_offset(image, index->extents[i].start) + skip, len) != 0)
+                break;
+            offset += len;
+            length -= len;
+        }
+    }
+
+    if(index == &nested)
+        uvfs_index_destroy(&nested);
+}
+
+/*
+ * Receives length bytes of file data and stores them as name. The store
+ * engine exits on errors, so it runs in a child whose error output
+ * becomes the reply; the resident metadata is rebuilt afterwards.
+ */
+void serve_store(int fd, served_t * served, const char * name, uint64_t length)
+{
+    unsigned char * buffer = NULL;
+    char message[ERROR_MAX];
+    int data_fd = -1, pipe_fd[2] = { -1, -1 };
+    size_t msg_len = 0;
+    uint64_t done = 0;
+    int status;
+    pid_t pid;
+
+    // spool the data so the store sees an ordinary source descriptor; it
+    // is taken in full even when refused so the client gets the reply
+    if((data_fd = memfd_create("uvfsd-store", 0)) < 0 || (buffer = malloc(RECV_CHUNK)) == NULL)
+    {
+        reply_error(fd, "Could not receive file.");
+        goto out;
+    }
+    while(done < length)
+    {
+        size_t want = length - done < RECV_CHUNK ? length - done : RECV_CHUNK;
+
+        if(recv_all(fd, buffer, want) != 0)
+            goto out;
+        if(pwrite(data_fd, buffer, want, done) != want)
+        {
+            reply_error(fd, "Could not receive file.");
+            goto out;
+        }
+        done += want;
+    }
+
+    if(!served->image.writable)
+    {
+        reply_error(fd, "Image is served read-only.");
+        goto out;
+    }
+
+    if(pipe(pipe_fd) != 0 || (pid = fork()) < 0)
+    {
+        reply_error(fd, "Could not start store.");
+        goto out;
+    }
+
+    if(pid == 0)
+    {
+        uvfs_store_t store;
+
+        dup2(pipe_fd[1], STDERR_FILENO);
+        memset(&store, 0, sizeof(store));
+        uvfs_store_add(&store, (char *)name, NULL);
+        store.jobs[0].src_fd = data_fd;
+        uvfs_store_load(&store, &served->image, STORE_FAT_CACHE, 1);
+        uvfs_store_run(&store, 0);
+        _exit(0);
+    }
+
+    close(pipe_fd[1]);
+    pipe_fd[1] = -1;
+    for(;;)
+    {
+        ssize_t n = read(pipe_fd[0], message + msg_len, sizeof(message) - 1 - msg_len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        msg_len += n;
+    }
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    refresh(served);
+
+    while(msg_len > 0 && message[msg_len - 1] == '\n')
+        msg_len--;
+    message[msg_len] = '\0';
+
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        reply(fd, 0, NULL, 0);
+    else
+        reply_error(fd, msg_len > 0 ? message : "Store failed.");
+
+out:
+    free(buffer);
+    if(data_fd >= 0)
+        close(data_fd);
+    if(pipe_fd[0] >= 0)
+        close(pipe_fd[0]);
+    if(pipe_fd[1] >= 0)
+        close(pipe_fd[1]);
+}
+
+void on_signal(int sig)
+{
+    stopping = 1;
+}
+
+/*************************** MAIN ***************************/
+
+int main(int argc, char *argv[]) {
+    int  i;
+    char *socketname = NULL;
+    char *imagenames[MAX_IMAGES];
+    int  writable = 0;
+
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    int listen_fd;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i+1 < argc) {
+            socketname = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            if (num_images == MAX_IMAGES) {
+                fprintf(stderr, "Too many images.\n");
+                exit(1);
+            }
+            imagenames[num_images++] = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--writable") == 0) {
+            writable = 1;
+        }
+    }
+
+    if (socketname == NULL || num_images == 0 ||
+        strlen(socketname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "usage: uvfsd --socket <socket path> " \
+            "--image <imagename> [--image ...] [--writable]\n");
+        exit(1);
+    }
+
+    for(i = 0; i < num_images; i++)
+        load_image(&images[i], imagenames[i], writable ? UVFS_RDWR : UVFS_RDONLY);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;          // no SA_RESTART: accept must return
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // replace a socket left behind by an earlier server, nothing else
+    if(lstat(socketname, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socketname);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketname);
+
+    if((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Could not listen on %s.\n", socketname);
+        exit(1);
+    }
+
+    // one request per connection, served in arrival order; a stalled
+    // client times out rather than holding up the others
+    while(!stopping)
+    {
+        struct timeval tv = { CLIENT_TIMEOUT, 0 };
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if(fd < 0)
+            continue;
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(fd);
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(socketname);
+
+    for(i = 0; i < num_images; i++)
+        uvfs_close(&images[i].image);
+
+    return 0;
+}
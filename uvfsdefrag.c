@@ -0,0 +1,612 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uvfs.h"
+
+#define FAT_CACHE_MB 8
+#define MOVE_CHUNK (1 << 20)
+
+#define OWNER_FREE   -1
+#define OWNER_PINNED -2
+
+/*
+ * uvfsdefrag: packs files into single runs toward the front of an image.
+ *
+ * The plan comes from one walk of every chain in the directory tree,
+ * which records the owner of each block: a file that may move, or
+ * pinned, for everything else the FAT has allocated (directory nodes,
+ * the name table, the journal, claims of stores still copying, files
+ * being written, and damaged or cross-linked chains). Files are then
+ * taken in the order of their first blocks and each is given the first
+ * window from the front that holds it, and its extent map, in one run.
+ * Files in the way are moved out to the free blocks highest on the
+ * image, to be packed when their turn comes; a file already in one run
+ * that its window overlaps stays where it is. Every block is copied a
+ * bounded number of times, so the run takes time linear in the data.
+ *
+ * Each move copies the data to free blocks and syncs it, links the new
+ * chain and syncs, points the entry at it and syncs, and only then frees
+ * the old chain, so a crash at any point leaves every file whole and at
+ * worst blocks allocated to nothing, for uvfsck to reclaim. The metadata
+ * lock is held throughout, so stores wait for the run to finish. A move
+ * leaves the entry's size and times alone, so sidecar indexes keyed on
+ * them still match; uvfs_index_load checks their extents against the
+ * FAT, which no move leaves as it was, and rebuilds them.
+ */
+
+/************************ STRUCT *******************************/
+
+/*
+ * A file that may be moved, and where its blocks are now
+ */
+typedef struct defrag_file defrag_file_t;
+struct defrag_file {
+    directory_entry_t de;               // network byte order
+    unsigned int dir_block;             // its directory's root node, 0 for the root
+    int index;                          // its entry, if the root directory holds it
+    unsigned int * blocks;              // data blocks in chain order
+    unsigned int * maps;                // extent map blocks
+    unsigned int num_maps;
+    int pinned;                         // must not move
+    int moved;
+    int placed;
+};
+
+typedef struct defrag defrag_t;
+struct defrag {
+    uvfs_image_t * image;
+    uvfs_store_t store;                 // FAT cache and subdirectory nodes
+    int dry_run;
+    defrag_file_t * files;
+    int num_files;
+    int cap_files;
+    int * owner;                        // per block: a file, OWNER_FREE or OWNER_PINNED
+    unsigned int high;                  // no free block lies above it
+    unsigned int no_window;             // smallest need no window was found for
+    unsigned char * buffer;
+    unsigned long extents_before;
+    unsigned long extents_after;
+    unsigned int files_moved;
+    unsigned long blocks_copied;
+};
+
+/*
+ * A subdirectory being walked, for the entries uvfs_dir_list passes
+ */
+typedef struct defrag_dir defrag_dir_t;
+struct defrag_dir {
+    defrag_t * d;
+    uvfs_dir_path_t at;
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+void                add_file(defrag_t * d, const directory_entry_t * de, unsigned int dir_block, int index);
+void                add_dir_entry(const directory_entry_t * de, void * arg);
+void                add_dir(defrag_t * d, unsigned int root, const uvfs_dir_path_t * parent);
+unsigned int        count_runs(const unsigned int * blocks, unsigned int n);
+int                 compare_first(const void * a, const void * b);
+unsigned int *      take_high(defrag_t * d, unsigned int count, unsigned int limit);
+void                release(defrag_t * d, unsigned int * blocks, unsigned int count);
+void                copy_blocks(defrag_t * d, const unsigned int * from, const unsigned int * to, unsigned int n);
+void                move_file(defrag_t * d, int f, unsigned int * to, unsigned int * maps);
+int                 move_high(defrag_t * d, int f, unsigned int limit);
+int                 pack_file(defrag_t * d, int f, unsigned int * cursor);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+/*
+ * Records the file de (network byte order) and claims its blocks, or
+ * pins it if its chain is damaged, shared or being written
+ */
+void add_file(defrag_t * d, const directory_entry_t * de, unsigned int dir_block, int index)
+{
+    const uvfs_image_t * image = d->image;
+    unsigned int n = ntohl(de->num_blocks), block = ntohl(de->start_block), map, k;
+    uint64_t slot = dir_block == 0 ? (uint64_t)index : uvfs_claim_slot(dir_block, de->filename);
+    defrag_file_t * file;
+    uvfs_extent_t * runs;
+    int f = d->num_files, num_runs;
+
+    if(d->num_files == d->cap_files)
+    {
+        d->cap_files = d->cap_files ? d->cap_files * 2 : 64;
+        if((d->files = realloc(d->files, d->cap_files * sizeof(defrag_file_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    file = &d->files[d->num_files++];
+    memset(file, 0, sizeof(defrag_file_t));
+    file->de = *de;
+    file->dir_block = dir_block;
+    file->index = index;
+    if(n == 0)
+    {
+        file->pinned = 1;
+        return;
+    }
+    if((file->blocks = calloc(n, sizeof(unsigned int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    // the chain must be exactly num_blocks long and share no block
+    for(k = 0; k < n; k++)
+    {
+        if(block >= image->sb.num_blocks || d->owner[block] != OWNER_PINNED)
+        {
+            if(block < image->sb.num_blocks && d->owner[block] >= 0)
+                d->files[d->owner[block]].pinned = 1;
+            break;
+        }
+        d->owner[block] = f;
+        file->blocks[k] = block;
+        block = uvfs_fat_entry(image, block);
+        if((block == FAT_LASTBLOCK) != (k == n - 1))
+        {
+            k++;
+            break;
+        }
+    }
+    if(k < n || block != FAT_LASTBLOCK || uvfs_entry_claimed(image, slot))
+    {
+        file->pinned = 1;
+        return;
+    }
+    d->extents_before += count_runs(file->blocks, n);
+
+    // a good map goes with the file
+    if((map = uvfs_entry_map(image, de)) == 0 ||
+        (runs = uvfs_map_extents(image, map, n, &num_runs)) == NULL)
+        return;
+    free(runs);
+    k = uvfs_map_blocks(image, num_runs);
+    if((file->maps = malloc(k * sizeof(unsigned int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(; map != 0 && file->num_maps < k && d->owner[map] == OWNER_PINNED;
+        map = ntohl(((const extent_map_t *)uvfs_block(image, map))->next))
+    {
+        d->owner[map] = f;
+        file->maps[file->num_maps++] = map;
+    }
+}
+
+void add_dir_entry(const directory_entry_t * de, void * arg)
+{
+    defrag_dir_t * dir = arg;
+
+    if(de->status == DIR_ENTRY_NORMALFILE)
+        add_file(dir->d, de, dir->at.root, -1);
+    else if(de->status == DIR_ENTRY_DIRECTORY)
+        add_dir(dir->d, ntohl(de->start_block), &dir->at);
+}
+
+/*
+ * Records every file under the directory rooted at root, in parent
+ */
+void add_dir(defrag_t * d, unsigned int root, const uvfs_dir_path_t * parent)
+{
+    defrag_dir_t dir = { d, { root, parent } };
+
+    uvfs_dir_enter(&dir.at);
+    uvfs_dir_list(d->image, root, add_dir_entry, &dir);
+}
+
+/*
+ * Returns the number of runs of consecutive blocks in blocks
+ */
+unsigned int count_runs(const unsigned int * blocks, unsigned int n)
+{
+    unsigned int runs = n > 0, k;
+
+    for(k = 1; k < n; k++)
+    {
+        if(blocks[k] != blocks[k - 1] + 1)
+            runs++;
+    }
+    return runs;
+}
+
+static defrag_t * sort_files;
+
+int compare_first(const void * a, const void * b)
+{
+    unsigned int x = sort_files->files[*(const int *)a].blocks[0];
+    unsigned int y = sort_files->files[*(const int *)b].blocks[0];
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Takes count free blocks, highest first, from those at limit or above.
+ * Returns them in ascending order, or NULL, taking none, if there are
+ * too few.
+ */
+unsigned int * take_high(defrag_t * d, unsigned int count, unsigned int limit)
+{
+    unsigned int * blocks = malloc((count ? count : 1) * sizeof(unsigned int));
+    unsigned int b = d->high + 1, k = count;
+
+    if(blocks == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    while(k > 0 && b-- > limit)
+    {
+        if(d->owner[b] == OWNER_FREE)
+            blocks[--k] = b;
+    }
+    if(k > 0)
+    {
+        free(blocks);
+        return NULL;
+    }
+    for(k = 0; k < count; k++)
+        d->owner[blocks[k]] = OWNER_PINNED;
+    if(count > 0)
+        d->high = blocks[0] > 0 ? blocks[0] - 1 : 0;
+    return blocks;
+}
+
+/*
+ * Marks blocks free again in the plan
+ */
+void release(defrag_t * d, unsigned int * blocks, unsigned int count)
+{
+    unsigned int k;
+
+    for(k = 0; k < count; k++)
+    {
+        d->owner[blocks[k]] = OWNER_FREE;
+        if(blocks[k] > d->high)
+            d->high = blocks[k];
+    }
+}
+
+/*
+ * Copies blocks from to to, a run of adjacent blocks on both sides at a
+ * time, in pieces of up to MOVE_CHUNK bytes
+ */
+void copy_blocks(defrag_t * d, const unsigned int * from, const unsigned int * to, unsigned int n)
+{
+    uvfs_image_t * image = d->image;
+    size_t bs = image->sb.block_size, len, done, piece;
+    unsigned int k = 0, run;
+
+    while(k < n)
+    {
+        for(run = 1; k + run < n && from[k + run] == from[k] + run && to[k + run] == to[k] + run; run++)
+            ;
+        len = (size_t)run * bs;
+        for(done = 0; done < len; done += piece)
+        {
+            piece = len - done < MOVE_CHUNK ? len - done : MOVE_CHUNK;
+            memset(d->buffer, 0, piece);
+            uvfs_pread(image->fd, d->buffer, piece, uvfs_block_offset(image, from[k]) + done);
+            uvfs_pwrite(image, d->buffer, piece, uvfs_block_offset(image, to[k]) + done);
+        }
+        k += run;
+    }
+}
+
+/*
+ * Moves file f to the blocks to and its map, if the image keeps maps, to
+ * maps, all of which the plan has taken
+ */
+void move_file(defrag_t * d, int f, unsigned int * to, unsigned int * maps)
+{
+    uvfs_image_t * image = d->image;
+    defrag_file_t * file = &d->files[f];
+    unsigned int n = ntohl(file->de.num_blocks), k;
+    unsigned int num_maps = image->extent_maps ? uvfs_map_blocks(image, count_runs(to, n)) : 0;
+
+    d->extents_after += count_runs(to, n);
+    d->extents_after -= count_runs(file->blocks, n);
+    d->files_moved += !file->moved;
+    d->blocks_copied += n;
+    file->moved = 1;
+
+    if(!d->dry_run)
+    {
+        uvfs_fatcache_t * fat = &d->store.fat;
+
+        // the copy, then the new chain, then the entry pointing at it
+        copy_blocks(d, file->blocks, to, n);
+        if(num_maps > 0)
+        {
+            uvfs_extent_t * runs = malloc(count_runs(to, n) * sizeof(uvfs_extent_t));
+            int num_runs = 0;
+
+            if(runs == NULL)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+            for(k = 0; k < n; k++)
+            {
+                if(k > 0 && to[k] == to[k - 1] + 1)
+                    runs[num_runs - 1].length++;
+                else
+                {
+                    runs[num_runs].start = to[k];
+                    runs[num_runs++].length = 1;
+                }
+            }
+            uvfs_map_put(image, maps, runs, num_runs);
+            free(runs);
+        }
+        uvfs_group_sync(image);
+
+        for(k = 0; k < n; k++)
+            uvfs_fatcache_set(fat, to[k], k + 1 < n ? to[k + 1] : FAT_LASTBLOCK);
+        for(k = 0; k < num_maps; k++)
+            uvfs_fatcache_set(fat, maps[k], FAT_LASTBLOCK);
+        uvfs_fatcache_flush(fat);
+        uvfs_group_sync(image);
+
+        file->de.start_block = htonl(to[0]);
+        if(image->extent_maps)
+            uvfs_set_map(&file->de, maps[0]);
+        else
+            uvfs_set_tail(&file->de, to[n - 1]);
+        if(file->dir_block == 0)
+            uvfs_pwrite(image, &file->de, sizeof(directory_entry_t), uvfs_dir_entry_offset(image, file->index));
+        else
+        {
+            if(!uvfs_dir_update(&d->store, file->dir_block, &file->de))
+            {
+                fprintf(stderr, "Specified directory is damaged.\n");
+                exit(1);
+            }
+            uvfs_dir_flush(&d->store);
+        }
+        uvfs_group_sync(image);
+
+        for(k = 0; k < n; k++)
+            uvfs_fatcache_set(fat, file->blocks[k], FAT_AVAILABLE);
+        for(k = 0; k < file->num_maps; k++)
+            uvfs_fatcache_set(fat, file->maps[k], FAT_AVAILABLE);
+        uvfs_fatcache_flush(fat);
+    }
+
+    release(d, file->blocks, n);
+    release(d, file->maps, file->num_maps);
+    for(k = 0; k < n; k++)
+        d->owner[to[k]] = f;
+    for(k = 0; k < num_maps; k++)
+        d->owner[maps[k]] = f;
+    free(file->blocks);
+    free(file->maps);
+    file->blocks = to;
+    file->maps = maps;
+    file->num_maps = num_maps;
+}
+
+/*
+ * Moves file f out of the way, to the highest free blocks at limit or
+ * above. Returns 0 if there are too few.
+ */
+int move_high(defrag_t * d, int f, unsigned int limit)
+{
+    unsigned int n = ntohl(d->files[f].de.num_blocks), num_maps = 0, high = d->high;
+    unsigned int * to, * maps = NULL;
+
+    if((to = take_high(d, n, limit)) == NULL)
+        return 0;
+    if(d->image->extent_maps)
+    {
+        num_maps = uvfs_map_blocks(d->image, count_runs(to, n));
+        if((maps = take_high(d, num_maps, limit)) == NULL)
+        {
+            release(d, to, n);
+            d->high = high;
+            free(to);
+            return 0;
+        }
+    }
+    move_file(d, f, to, maps);
+    return 1;
+}
+
+/*
+ * Packs file f into the first window at or after cursor that can hold it
+ * in one run, moving the files in the window out first, and advances
+ * cursor past it. Returns 0 if there is no longer room to move files out
+ * of the way.
+ */
+int pack_file(defrag_t * d, int f, unsigned int * cursor)
+{
+    defrag_file_t * file = &d->files[f];
+    unsigned int n = ntohl(file->de.num_blocks), need = n + (d->image->extent_maps ? 1 : 0);
+    unsigned int start = *cursor, end, b, k;
+    unsigned int * to, * maps = NULL;
+    int contiguous = count_runs(file->blocks, n) == 1;
+
+    // the window skips pinned blocks and files already packed; a file
+    // no smaller than one that found no window will not find one either
+    if(need >= d->no_window)
+        return 1;
+    for(end = start; end < start + need; end++)
+    {
+        if(end >= d->image->sb.num_blocks)
+        {
+            d->no_window = need;
+            return 1;
+        }
+        if(d->owner[end] == OWNER_PINNED || (d->owner[end] >= 0 && d->files[d->owner[end]].placed))
+            start = end + 1;
+    }
+
+    // a file in one run the window overlaps is as good where it is
+    if(contiguous && file->blocks[0] < end)
+    {
+        file->placed = 1;
+        if(file->blocks[n - 1] + 1 > *cursor)
+            *cursor = file->blocks[n - 1] + 1;
+        return 1;
+    }
+
+    for(b = start; b < end; b++)
+    {
+        if(d->owner[b] >= 0 && !move_high(d, d->owner[b], end))
+            return 0;
+    }
+
+    if((to = malloc(n * sizeof(unsigned int))) == NULL ||
+        (need > n && (maps = malloc(sizeof(unsigned int))) == NULL))
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(k = 0; k < n; k++)
+        to[k] = start + k;
+    if(maps != NULL)
+        maps[0] = start + n;
+    for(b = start; b < end; b++)
+        d->owner[b] = OWNER_PINNED;
+    move_file(d, f, to, maps);
+    file->placed = 1;
+    *cursor = end;
+    return 1;
+}
+
+/*************************** MAIN ***************************/
+
+int main(int argc, char *argv[]) {
+    int  i;
+    char *imagename = NULL;
+    int  dry_run    = 0;
+
+    uvfs_image_t image;
+    defrag_t d;
+    int * order, num_order = 0;
+    unsigned int b, cursor = 0;
+    int finished = 1;
+
+    memset(&d, 0, sizeof(d));
+
+/******************* ZASTRE ***********************/
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            imagename = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        }
+    }
+
+    if (imagename == NULL)
+    {
+        fprintf(stderr, "usage: uvfsdefrag --image <imagename> [--dry-run]\n");
+        exit(1);
+    }
+
+/******************** END Z *********************/
+
+    uvfs_open(&image, imagename, dry_run ? UVFS_RDONLY : UVFS_RDWR);
+    uvfs_lock_metadata(&image, dry_run ? UVFS_LOCK_SHARED : UVFS_LOCK_EXCLUSIVE);
+
+    d.image = &image;
+    d.dry_run = dry_run;
+    d.no_window = ~0u;
+    d.store.image = &image;
+    if(!dry_run)
+        uvfs_fatcache_init(&d.store.fat, &image, FAT_CACHE_MB << 20);
+    if((d.owner = malloc(image.sb.num_blocks * sizeof(int))) == NULL ||
+        (d.buffer = malloc(MOVE_CHUNK)) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    // everything allocated is pinned until a file's walk claims it
+    for(b = 0; b < image.sb.num_blocks; b++)
+    {
+        d.owner[b] = uvfs_fat_entry(&image, b) == FAT_AVAILABLE ? OWNER_FREE : OWNER_PINNED;
+        if(d.owner[b] == OWNER_FREE)
+            d.high = b;
+    }
+    for(i = 0; i < image.dir_entries; i++)
+    {
+        if(image.dir[i].status == DIR_ENTRY_NORMALFILE)
+            add_file(&d, &image.dir[i], 0, i);
+        else if(image.dir[i].status == DIR_ENTRY_DIRECTORY)
+            add_dir(&d, ntohl(image.dir[i].start_block), NULL);
+    }
+
+    // files that cannot move are obstacles like any pinned block
+    if((order = malloc((d.num_files ? d.num_files : 1) * sizeof(int))) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(i = 0; i < d.num_files; i++)
+    {
+        defrag_file_t * file = &d.files[i];
+        unsigned int k, n = file->blocks ? ntohl(file->de.num_blocks) : 0;
+
+        if(!file->pinned)
+        {
+            order[num_order++] = i;
+            continue;
+        }
+        for(k = 0; k < n; k++)
+        {
+            if(file->blocks[k] < image.sb.num_blocks && d.owner[file->blocks[k]] == i)
+                d.owner[file->blocks[k]] = OWNER_PINNED;
+        }
+        for(k = 0; k < file->num_maps; k++)
+            d.owner[file->maps[k]] = OWNER_PINNED;
+    }
+    sort_files = &d;
+    qsort(order, num_order, sizeof(int), compare_first);
+    d.extents_after = d.extents_before;
+
+    if(!dry_run)
+        uvfs_summary_begin(&image);
+    for(i = 0; i < num_order; i++)
+    {
+        if(!pack_file(&d, order[i], &cursor))
+        {
+            finished = 0;
+            break;
+        }
+    }
+    if(!dry_run)
+    {
+        uvfs_census_t census;
+
+        uvfs_fat_census(&image, &census);
+        uvfs_summary_commit(&image, &census);
+        uvfs_group_sync(&image);
+        uvfs_fatcache_destroy(&d.store.fat);
+    }
+    uvfs_lock_metadata(&image, UVFS_LOCK_NONE);
+
+    printf("%s %u of %d files, copying %lu blocks\n", dry_run ? "Would move" : "Moved",
+        d.files_moved, d.num_files, d.blocks_copied);
+    printf("Extents: %lu before, %lu after\n", d.extents_before, d.extents_after);
+    if(!finished)
+        printf("Stopped early: not enough free space to move files out of the way.\n");
+
+    for(i = 0; i < d.num_files; i++)
+    {
+        free(d.files[i].blocks);
+        free(d.files[i].maps);
+    }
+    free(d.files);
+    free(d.owner);
+    free(d.buffer);
+    free(order);
+    uvfs_close(&image);
+
+    return 0;
+}
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "uvfs.h"
+
+#define EXTRACT_PIECE (4 << 20)
+#define MAX_THREADS 64
+
+/************************ STRUCT *******************************/
+
+/*
+ * One contiguous piece of one file: a run of image bytes and where they
+ * land in the output file
+ */
+typedef struct piece piece_t;
+struct piece {
+    int file;                           // into extract's paths
+    size_t src_offset;
+    size_t dst_offset;
+    size_t len;
+};
+
+typedef struct extract extract_t;
+struct extract {
+    uvfs_image_t * image;
+    piece_t * pieces;
+    size_t num_pieces;
+    size_t cap_pieces;
+    size_t next_piece;                  // shared work queue cursor
+    int num_threads;
+    char ** paths;                      // output files, created by the plan
+    int num_files;
+    int cap_files;
+    int cache_stats;
+    uvfs_cachestat_t stat;
+};
+
+/*
+ * A subdirectory being extracted, for the entries uvfs_dir_list passes
+ */
+typedef struct extract_dir extract_dir_t;
+struct extract_dir {
+    extract_t * ex;
+    const char * path;
+    uvfs_dir_path_t at;
+};
+
+/************************* FUNCTION PROTOTYPES ****************************/
+
+void                add_piece(extract_t * ex, int file, size_t src_offset, size_t dst_offset, size_t len);
+void                plan_file(extract_t * ex, const directory_entry_t * de, int file);
+void                plan_entry(extract_t * ex, const directory_entry_t * entry, const char * dirname,
+                        const uvfs_dir_path_t * parent);
+void                plan_dir_entry(const directory_entry_t * entry, void * arg);
+void *              worker(void * arg);
+
+/************************* FUNCTION IMPLEMENTATIONS *************************/
+
+void add_piece(extract_t * ex, int file, size_t src_offset, size_t dst_offset, size_t len)
+{
+    if(ex->num_pieces == ex->cap_pieces)
+    {
+        ex->cap_pieces = ex->cap_pieces ? ex->cap_pieces * 2 : 256;
+        if((ex->pieces = realloc(ex->pieces, ex->cap_pieces * sizeof(piece_t))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    piece_t * p = &ex->pieces[ex->num_pieces++];
+    p->file = file;
+    p->src_offset = src_offset;
+    p->dst_offset = dst_offset;
+    p->len = len;
+}
+
+/*
+ * Splits the file described by de (host byte order) into pieces of at
+ * most EXTRACT_PIECE bytes along its extents, stopping at file_size
+ */
+void plan_file(extract_t * ex, const directory_entry_t * de, int file)
+{
+    size_t bs = ex->image->sb.block_size;
+    size_t left = de->file_size, dst = 0;
+    int num_extents, i;
+    uvfs_extent_t * extents = uvfs_entry_extents(ex->image, de, &num_extents);
+
+    for(i = 0; i < num_extents && left > 0; i++)
+    {
+        size_t src = (size_t)extents[i].start * bs;
+        size_t run = (size_t)extents[i].length * bs;
+
+        if(run > left)
+            run = left;
+        left -= run;
+
+        while(run > 0)
+        {
+            size_t len = run < EXTRACT_PIECE ? run : EXTRACT_PIECE;
+            add_piece(ex, file, src, dst, len);
+            src += len;
+            dst += len;
+            run -= len;
+        }
+    }
+
+    free(extents);
+
+    if(left > 0)
+    {
+        fprintf(stderr, "Corrupt FAT chain for %s.\n", de->filename);
+        exit(1);
+    }
+}
+
+/*
+ * Creates the host file or directory for entry (on-disk byte order) in
+ * dirname, parent, and queues what it holds: a file's pieces, or every entry of
+ * a subdirectory. Files are created at their final size and closed
+ * again; the workers open them as they write, so an extract holds no
+ * more descriptors than it has workers however many files there are.
+ */
+void plan_entry(extract_t * ex, const directory_entry_t * entry, const char * dirname,
+    const uvfs_dir_path_t * parent)
+{
+    directory_entry_t de = *entry;
+
+    convertToNetDE(&de);
+    de.filename[DIR_FILENAME_MAX - 1] = '\0';
+
+    if(de.filename[0] == '\0' || strchr(de.filename, '/') != NULL ||
+        strcmp(de.filename, ".") == 0 || strcmp(de.filename, "..") == 0)
+    {
+        fprintf(stderr, "Skipping unsafe filename %s.\n", de.filename);
+        return;
+    }
+
+    char path[strlen(dirname) + DIR_FILENAME_MAX + 2];
+    sprintf(path, "%s/%s", dirname, de.filename);
+
+    if(de.status == DIR_ENTRY_DIRECTORY)
+    {
+        extract_dir_t dir = { ex, path, { de.start_block, parent } };
+
+        uvfs_dir_enter(&dir.at);
+
+        if(mkdir(path, 0755) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Could not create %s.\n", path);
+            exit(1);
+        }
+        uvfs_dir_list(ex->image, de.start_block, plan_dir_entry, &dir);
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, de.file_size) != 0 || close(fd) != 0)
+    {
+        fprintf(stderr, "Could not create %s.\n", path);
+        exit(1);
+    }
+
+    if(ex->num_files == ex->cap_files)
+    {
+        ex->cap_files = ex->cap_files ? ex->cap_files * 2 : 64;
+        if((ex->paths = realloc(ex->paths, ex->cap_files * sizeof(char *))) == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    if((ex->paths[ex->num_files] = strdup(path)) == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    plan_file(ex, &de, ex->num_files++);
+}
+
+void plan_dir_entry(const directory_entry_t * entry, void * arg)
+{
+    extract_dir_t * dir = arg;
+
+    plan_entry(dir->ex, entry, dir->path, &dir->at);
+}
+
+/*
+ * Takes pieces off the shared queue until it is empty, writing each one
+ * straight from the image mapping with pwrite. The queue follows each
+ * chain, so the piece one round of workers ahead is advised for
+ * read-ahead before this one is written. A worker keeps one output file
+ * open, for as long as its pieces come from that file.
+ */
+void * worker(void * arg)
+{
+    extract_t * ex = arg;
+    size_t i;
+    int file = -1, fd = -1;
+
+    while((i = __atomic_fetch_add(&ex->next_piece, 1, __ATOMIC_RELAXED)) < ex->num_pieces)
+    {
+        piece_t * p = &ex->pieces[i];
+        size_t done = 0;
+
+        if(p->file != file)
+        {
+            if(fd >= 0 && close(fd) != 0)
+            {
+                fprintf(stderr, "Write failed.\n");
+                exit(1);
+            }
+            file = p->file;
+            if((fd = open(ex->paths[file], O_WRONLY)) < 0)
+            {
+                fprintf(stderr, "Could not open %s.\n", ex->paths[file]);
+                exit(1);
+            }
+        }
+
+        if(p->src_offset + p->len > ex->image->map_len)
+        {
+            fprintf(stderr, "Read failed.\n");
+            exit(1);
+        }
+
+        if(ex->cache_stats)
+        {
+            uvfs_cachestat_t stat = { 0, 0 };
+            uvfs_cache_probe(ex->image, p->src_offset, p->len, &stat);
+            __atomic_fetch_add(&ex->stat.hits, stat.hits, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&ex->stat.misses, stat.misses, __ATOMIC_RELAXED);
+        }
+
+        if(i + ex->num_threads < ex->num_pieces)
+        {
+            piece_t * next = &ex->pieces[i + ex->num_threads];
+            uvfs_advise(ex->image, next->src_offset, next->len);
+        }
+
+        while(done < p->len)
+        {
+            ssize_t n = pwrite(fd, ex->image->map + p->src_offset + done,
+                p->len - done, p->dst_offset + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                fprintf(stderr, "Write failed.\n");
+                exit(1);
+            }
+            done += n;
+        }
+    }
+
+    if(fd >= 0 && close(fd) != 0)
+    {
+        fprintf(stderr, "Write failed.\n");
+        exit(1);
+    }
+    return NULL;
+}
+
+/*************************** MAIN ***************************/
+
+int main(int argc, char *argv[]) {
+    int  i;
+    char *imagename = NULL;
+    char *dirname   = NULL;
+    int  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    uvfs_image_t image;
+    extract_t ex;
+    pthread_t threads[MAX_THREADS];
+
+    memset(&ex, 0, sizeof(ex));
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            imagename = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--dir") == 0 && i+1 < argc) {
+            dirname = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            num_threads = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            ex.cache_stats = 1;
+        }
+    }
+
+    if (imagename == NULL || dirname == NULL) {
+        fprintf(stderr, "usage: uvfsextract --image <imagename> " \
+            "--dir <directory on host> [--threads <n>] [--cache-stats]\n");
+        exit(1);
+    }
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    uvfs_open(&image, imagename, UVFS_RDONLY);
+    ex.image = &image;
+
+    if(mkdir(dirname, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Specified directory could not be created.\n");
+        exit(1);
+    }
+
+    // one pass over the directory tree: create every output at its final
+    // size and queue its pieces; the chains are walked under the metadata
+    // lock
+    uvfs_lock_metadata(&image, UVFS_LOCK_SHARED);
+    for(i = 0; i < image.dir_entries; i++)
+    {
+        if(image.dir[i].status == DIR_ENTRY_NORMALFILE || image.dir[i].status == DIR_ENTRY_DIRECTORY)
+            plan_entry(&ex, &image.dir[i], dirname, NULL);
+    }
+    uvfs_lock_metadata(&image, UVFS_LOCK_NONE);
+
+    if(num_threads > ex.num_pieces)
+        num_threads = ex.num_pieces > 0 ? ex.num_pieces : 1;
+    ex.num_threads = num_threads;
+
+    for(i = 0; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, worker, &ex) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(1);
+        }
+    }
+    for(i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    if(ex.cache_stats)
+        fprintf(stderr, "Cache: %lu hits, %lu misses (pages)\n", ex.stat.hits, ex.stat.misses);
+
+    for(i = 0; i < ex.num_files; i++)
+        free(ex.paths[i]);
+    free(ex.paths);
+    free(ex.pieces);
+    uvfs_close(&image);
+
+    return 0;
+}